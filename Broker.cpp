@@ -0,0 +1,695 @@
+#include "Broker.hpp"
+
+#if !defined(_WIN32)
+
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "Exceptions.hpp"
+#include "HelperFunctions.hpp"
+
+namespace oul {
+
+enum BrokerMessageType {
+	BROKER_BUILD_PROGRAM,
+	BROKER_CREATE_BUFFER,
+	BROKER_WRITE_BUFFER,
+	BROKER_READ_BUFFER,
+	BROKER_RELEASE_BUFFER,
+	BROKER_EXECUTE_KERNEL
+};
+
+enum BrokerStatus {
+	BROKER_OK,
+	BROKER_ERROR
+};
+
+// Wait this long for new work when no client has a request pending
+static const int BROKER_POLL_TIMEOUT = 100; // ms
+
+/*
+ * Messages are a header of two 32 bit integers, the type (or status
+ * for responses) and the payload length, followed by the payload.
+ * Both ends are on the same machine, so everything is sent in host byte order.
+ */
+static void put(std::vector<char> &message, const void * data, size_t size) {
+	const char * bytes = (const char *)data;
+	message.insert(message.end(), bytes, bytes + size);
+}
+
+template <class T>
+static void put(std::vector<char> &message, T value) {
+	put(message, &value, sizeof(T));
+}
+
+static void putString(std::vector<char> &message, const std::string &value) {
+	put(message, (cl_uint)value.size());
+	put(message, value.data(), value.size());
+}
+
+class MessageReader {
+public:
+	MessageReader(const std::vector<char> &message) : message(message), position(0) {
+	}
+	template <class T>
+	T get() {
+		T value;
+		std::memcpy(&value, getBytes(sizeof(T)), sizeof(T));
+		return value;
+	}
+	std::string getString() {
+		cl_uint size = get<cl_uint>();
+		return std::string(getBytes(size), size);
+	}
+	const char * getBytes(size_t size) {
+		if(position + size > message.size())
+			throw Exception("Malformed broker message", __LINE__, __FILE__);
+		const char * bytes = message.empty() ? NULL : &message[position];
+		position += size;
+		return bytes;
+	}
+private:
+	const std::vector<char> &message;
+	size_t position;
+};
+
+static bool readAll(int socket, void * data, size_t size) {
+	char * bytes = (char *)data;
+	while(size > 0) {
+		ssize_t received = recv(socket, bytes, size, 0);
+		if(received < 0 && errno == EINTR)
+			continue;
+		if(received <= 0)
+			return false;
+		bytes += received;
+		size -= received;
+	}
+	return true;
+}
+
+static bool writeAll(int socket, const void * data, size_t size) {
+	const char * bytes = (const char *)data;
+	while(size > 0) {
+		ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// The broker's client sockets are non-blocking, wait until the client reads
+			pollfd descriptor;
+			descriptor.fd = socket;
+			descriptor.events = POLLOUT;
+			descriptor.revents = 0;
+			if(poll(&descriptor, 1, -1) < 0 && errno != EINTR)
+				return false;
+			continue;
+		}
+		if(sent <= 0)
+			return false;
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+static bool sendMessage(int socket, cl_uint type, const std::vector<char> &payload) {
+	cl_uint header[2] = {type, (cl_uint)payload.size()};
+	return writeAll(socket, header, sizeof(header)) &&
+			(payload.empty() || writeAll(socket, &payload[0], payload.size()));
+}
+
+static bool receiveMessage(int socket, cl_uint &type, std::vector<char> &payload) {
+	cl_uint header[2];
+	if(!readAll(socket, header, sizeof(header)))
+		return false;
+	type = header[0];
+	payload.resize(header[1]);
+	return payload.empty() || readAll(socket, &payload[0], payload.size());
+}
+
+static sockaddr_un getSocketAddress(std::string socketPath) {
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(socketPath.size() >= sizeof(address.sun_path)) {
+		std::string msg = "Broker socket path " + socketPath + " is too long";
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	std::strcpy(address.sun_path, socketPath.c_str());
+	return address;
+}
+
+std::string getDefaultBrokerSocketPath() {
+	const char * path = std::getenv("OUL_BROKER_SOCKET");
+	if(path != NULL)
+		return path;
+	return "/tmp/oul-broker.sock";
+}
+
+SharedMemory::SharedMemory(std::string name, size_t size, bool owner) :
+		name(name),
+		size(size),
+		owner(owner),
+		pointer(NULL)
+	{
+	int descriptor = owner ? shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR) :
+			shm_open(name.c_str(), O_RDWR, 0);
+	if(descriptor < 0) {
+		std::string msg = "Could not open shared memory " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	// mmap can't map an empty segment
+	size_t mappedSize = size > 0 ? size : 1;
+	if(owner && ftruncate(descriptor, mappedSize) != 0) {
+		close(descriptor);
+		shm_unlink(name.c_str());
+		std::string msg = "Could not resize shared memory " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	pointer = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+	if(pointer == MAP_FAILED) {
+		if(owner)
+			shm_unlink(name.c_str());
+		std::string msg = "Could not map shared memory " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+}
+
+SharedMemory::~SharedMemory() {
+	munmap(pointer, size > 0 ? size : 1);
+	if(owner)
+		shm_unlink(name.c_str());
+}
+
+SharedMemoryPtr SharedMemory::create(size_t size) {
+	static unsigned int counter = 0;
+	std::string name = "/oul-" + number((int)getpid()) + "-" + number((int)counter++);
+	return SharedMemoryPtr(new SharedMemory(name, size, true));
+}
+
+SharedMemoryPtr SharedMemory::open(std::string name, size_t size) {
+	return SharedMemoryPtr(new SharedMemory(name, size, false));
+}
+
+std::string SharedMemory::getName() const {
+	return name;
+}
+
+size_t SharedMemory::getSize() const {
+	return size;
+}
+
+void * SharedMemory::getPointer() const {
+	return pointer;
+}
+
+BrokerBuffer::BrokerBuffer() :
+		id(0)
+	{
+}
+
+BrokerBuffer::BrokerBuffer(unsigned int id, SharedMemoryPtr memory) :
+		id(id),
+		memory(memory)
+	{
+}
+
+unsigned int BrokerBuffer::getId() const {
+	return id;
+}
+
+size_t BrokerBuffer::getSize() const {
+	return memory ? memory->getSize() : 0;
+}
+
+void * BrokerBuffer::getHostPointer() const {
+	return memory ? memory->getPointer() : NULL;
+}
+
+void BrokerKernelArguments::setArg(unsigned int index, const BrokerBuffer &buffer) {
+	Argument &argument = get(index);
+	argument.type = ARGUMENT_BUFFER;
+	argument.buffer = buffer.getId();
+}
+
+void BrokerKernelArguments::setLocalArg(unsigned int index, size_t size) {
+	Argument &argument = get(index);
+	argument.type = ARGUMENT_LOCAL;
+	argument.localSize = size;
+}
+
+const std::vector<BrokerKernelArguments::Argument> &BrokerKernelArguments::getArguments() const {
+	return arguments;
+}
+
+BrokerKernelArguments::Argument &BrokerKernelArguments::get(unsigned int index) {
+	if(index >= arguments.size()) {
+		Argument empty;
+		empty.type = ARGUMENT_SCALAR;
+		empty.buffer = 0;
+		empty.localSize = 0;
+		arguments.resize(index+1, empty);
+	}
+	return arguments[index];
+}
+
+BrokerClient::BrokerClient(std::string socketPath) {
+	sockaddr_un address = getSocketAddress(socketPath);
+	socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if(socket < 0 || connect(socket, (sockaddr *)&address, sizeof(address)) != 0) {
+		if(socket >= 0)
+			close(socket);
+		std::string msg = "Could not connect to the device broker at " + socketPath;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+}
+
+BrokerClient::~BrokerClient() {
+	close(socket);
+}
+
+std::vector<char> BrokerClient::request(unsigned int type, const std::vector<char> &payload) {
+	cl_uint status;
+	std::vector<char> response;
+	if(!sendMessage(socket, type, payload) || !receiveMessage(socket, status, response))
+		throw Exception("Lost the connection to the device broker", __LINE__, __FILE__);
+	if(status != BROKER_OK) {
+		std::string msg = "Device broker: " + std::string(response.begin(), response.end());
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return response;
+}
+
+/**
+ * Source files are read by the client, since the broker may not see the same files.
+ */
+int BrokerClient::createProgramFromSource(std::string filename, std::string buildOptions) {
+	return createProgramFromString(readFile(filename), buildOptions);
+}
+
+/**
+ * Programs are cached in the broker, so asking for a program that any client
+ * has built before with the same options returns that program at once.
+ */
+int BrokerClient::createProgramFromString(std::string code, std::string buildOptions) {
+	std::vector<char> payload;
+	putString(payload, buildOptions);
+	putString(payload, code);
+	std::vector<char> response = request(BROKER_BUILD_PROGRAM, payload);
+	return MessageReader(response).get<cl_int>();
+}
+
+int BrokerClient::createProgramFromSourceWithName(std::string programName, std::string filename, std::string buildOptions) {
+	programNames[programName] = createProgramFromSource(filename, buildOptions);
+	return programNames[programName];
+}
+
+int BrokerClient::createProgramFromStringWithName(std::string programName, std::string code, std::string buildOptions) {
+	programNames[programName] = createProgramFromString(code, buildOptions);
+	return programNames[programName];
+}
+
+int BrokerClient::getProgram(std::string name) {
+	if(programNames.count(name) == 0) {
+		std::string msg = "Could not find OpenCL program with the name " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return programNames[name];
+}
+
+bool BrokerClient::hasProgram(std::string name) {
+	return programNames.count(name) > 0;
+}
+
+/**
+ * Runs a kernel on the queue the broker has assigned to this client,
+ * and returns when it has finished.
+ */
+void BrokerClient::executeKernel(int program, std::string kernelName, const BrokerKernelArguments &arguments,
+		size_t global_work_size, size_t local_work_size) {
+	const std::vector<BrokerKernelArguments::Argument> &args = arguments.getArguments();
+	std::vector<char> payload;
+	put(payload, (cl_int)program);
+	putString(payload, kernelName);
+	put(payload, (cl_ulong)global_work_size);
+	put(payload, (cl_ulong)local_work_size);
+	put(payload, (cl_uint)args.size());
+	for(unsigned int i = 0; i < args.size(); i++) {
+		put(payload, (cl_uint)args[i].type);
+		put(payload, (cl_uint)args[i].buffer);
+		put(payload, (cl_ulong)args[i].localSize);
+		putString(payload, std::string(args[i].value.begin(), args[i].value.end()));
+	}
+	request(BROKER_EXECUTE_KERNEL, payload);
+}
+
+/**
+ * Host pointer flags have no meaning across processes. If host_data is given,
+ * it is copied to the device through the shared memory of the buffer instead.
+ */
+BrokerBuffer BrokerClient::createBuffer(cl_mem_flags flags, size_t size, void * host_data, std::string bufferName) {
+	std::vector<char> payload;
+	put(payload, (cl_ulong)(flags & ~(CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)));
+	put(payload, (cl_ulong)size);
+	std::vector<char> response = request(BROKER_CREATE_BUFFER, payload);
+	MessageReader reader(response);
+	unsigned int id = reader.get<cl_uint>();
+	std::string memoryName = reader.getString();
+	BrokerBuffer buffer(id, SharedMemory::open(memoryName, size));
+
+	reporter.report("Created broker buffer " + bufferName + " of " + number(size) + " bytes", oul::INFO);
+	if(host_data != NULL)
+		writeBuffer(buffer, size, host_data);
+	return buffer;
+}
+
+void BrokerClient::writeBuffer(BrokerBuffer buffer, size_t size, const void * inputData) {
+	if(size > buffer.getSize())
+		throw Exception("Write is larger than the broker buffer", __LINE__, __FILE__);
+	std::memcpy(buffer.getHostPointer(), inputData, size);
+	std::vector<char> payload;
+	put(payload, (cl_uint)buffer.getId());
+	put(payload, (cl_ulong)size);
+	request(BROKER_WRITE_BUFFER, payload);
+}
+
+void BrokerClient::readBuffer(BrokerBuffer buffer, size_t size, void * outputData) {
+	if(size > buffer.getSize())
+		throw Exception("Read is larger than the broker buffer", __LINE__, __FILE__);
+	std::vector<char> payload;
+	put(payload, (cl_uint)buffer.getId());
+	put(payload, (cl_ulong)size);
+	request(BROKER_READ_BUFFER, payload);
+	std::memcpy(outputData, buffer.getHostPointer(), size);
+}
+
+void BrokerClient::releaseBuffer(BrokerBuffer buffer) {
+	std::vector<char> payload;
+	put(payload, (cl_uint)buffer.getId());
+	request(BROKER_RELEASE_BUFFER, payload);
+}
+
+DeviceBroker::DeviceBroker(Context context, std::string socketPath) :
+		context(context),
+		socketPath(socketPath),
+		running(false),
+		nextClient(0),
+		nextBufferId(1)
+	{
+	numberOfQueues = context.getContext().getInfo<CL_CONTEXT_DEVICES>().size();
+
+	sockaddr_un address = getSocketAddress(socketPath);
+	listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenSocket < 0)
+		throw Exception("Could not create the broker socket", __LINE__, __FILE__);
+	// Only remove the socket of a broker that did not shut down properly,
+	// never the one of a broker that is still running
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(probe >= 0) {
+		bool inUse = connect(probe, (sockaddr *)&address, sizeof(address)) == 0;
+		bool stale = !inUse && errno == ECONNREFUSED;
+		close(probe);
+		if(inUse) {
+			close(listenSocket);
+			std::string msg = "A device broker is already running on " + socketPath;
+			throw Exception(msg.c_str(), __LINE__, __FILE__);
+		}
+		if(stale)
+			unlink(socketPath.c_str());
+	}
+	if(bind(listenSocket, (sockaddr *)&address, sizeof(address)) != 0 || listen(listenSocket, 16) != 0) {
+		close(listenSocket);
+		std::string msg = "Could not listen on broker socket " + socketPath;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	reporter.report("Device broker is listening on " + socketPath, oul::INFO);
+}
+
+DeviceBroker::~DeviceBroker() {
+	for(unsigned int i = 0; i < clients.size(); i++)
+		close(clients[i].socket);
+	close(listenSocket);
+	unlink(socketPath.c_str());
+}
+
+/**
+ * Serves clients until stop() is called. Every round, each client with a
+ * pending request gets exactly one request served, so a client that submits
+ * a lot of work can't starve the others.
+ */
+void DeviceBroker::run() {
+	running = true;
+	bool workPending = false;
+	while(running) {
+		std::vector<pollfd> descriptors(clients.size()+1);
+		descriptors[0].fd = listenSocket;
+		descriptors[0].events = POLLIN;
+		for(unsigned int i = 0; i < clients.size(); i++) {
+			descriptors[i+1].fd = clients[i].socket;
+			descriptors[i+1].events = POLLIN;
+		}
+		if(poll(&descriptors[0], descriptors.size(), workPending ? 0 : BROKER_POLL_TIMEOUT) < 0 && errno != EINTR)
+			throw Exception("Polling the broker sockets failed", __LINE__, __FILE__);
+
+		std::vector<int> closed;
+		for(unsigned int i = 0; i < clients.size(); i++) {
+			if(descriptors[i+1].revents != 0 && !receive(clients[i]))
+				closed.push_back(clients[i].socket);
+		}
+		for(unsigned int i = 0; i < closed.size(); i++)
+			disconnect(closed[i]);
+		if(descriptors[0].revents & POLLIN)
+			accept();
+
+		workPending = serveRound();
+	}
+}
+
+void DeviceBroker::stop() {
+	running = false;
+}
+
+unsigned int DeviceBroker::getNumberOfClients() const {
+	return clients.size();
+}
+
+unsigned int DeviceBroker::getNumberOfPrograms() const {
+	return programCache.size();
+}
+
+void DeviceBroker::accept() {
+	int socket = ::accept(listenSocket, NULL, NULL);
+	if(socket < 0)
+		return;
+	// A client that sends half a message must not block the others
+	fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+	Client client;
+	client.socket = socket;
+	// Spread the clients over the devices of the context
+	client.queue = clients.size() % numberOfQueues;
+	clients.push_back(client);
+	reporter.report("Device broker accepted a client, assigned to queue " + number(client.queue), oul::INFO);
+}
+
+/**
+ * Reads whatever the client has sent and queues every complete message.
+ * Partial messages stay in the client's receive buffer until the rest arrives.
+ * Returns false if the connection was closed.
+ */
+bool DeviceBroker::receive(Client &client) {
+	char bytes[4096];
+	while(true) {
+		ssize_t received = recv(client.socket, bytes, sizeof(bytes), 0);
+		if(received < 0 && errno == EINTR)
+			continue;
+		if(received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if(received <= 0)
+			return false;
+		client.received.insert(client.received.end(), bytes, bytes + received);
+	}
+
+	size_t position = 0;
+	cl_uint header[2];
+	while(client.received.size() - position >= sizeof(header)) {
+		std::memcpy(header, &client.received[position], sizeof(header));
+		if(client.received.size() - position - sizeof(header) < header[1])
+			break;
+		std::vector<char>::const_iterator payload = client.received.begin() + position + sizeof(header);
+		Request request;
+		request.type = header[0];
+		request.payload.assign(payload, payload + header[1]);
+		client.pending.push_back(request);
+		position += sizeof(header) + header[1];
+	}
+	client.received.erase(client.received.begin(), client.received.begin() + position);
+	return true;
+}
+
+/**
+ * Closes the connection and releases every buffer the client still owns.
+ */
+void DeviceBroker::disconnect(int socket) {
+	std::map<unsigned int, Buffer>::iterator it = buffers.begin();
+	while(it != buffers.end()) {
+		if(it->second.owner == socket) {
+			buffers.erase(it++);
+		} else {
+			++it;
+		}
+	}
+	for(unsigned int i = 0; i < clients.size(); i++) {
+		if(clients[i].socket == socket) {
+			clients.erase(clients.begin() + i);
+			break;
+		}
+	}
+	close(socket);
+	reporter.report("Device broker client disconnected", oul::INFO);
+}
+
+/**
+ * Serves one pending request from every client, starting after the client
+ * that was served first in the previous round.
+ * Returns whether any client still has requests pending.
+ */
+bool DeviceBroker::serveRound() {
+	bool workPending = false;
+	std::vector<int> closed;
+	for(unsigned int i = 0; i < clients.size(); i++) {
+		Client &client = clients[(nextClient + i) % clients.size()];
+		if(client.pending.empty())
+			continue;
+
+		Request request = client.pending.front();
+		client.pending.pop_front();
+		cl_uint status = BROKER_OK;
+		std::vector<char> response;
+		try {
+			response = serve(client, request);
+		} catch(cl::Error &error) {
+			status = BROKER_ERROR;
+			std::string msg = std::string(error.what()) + " (" + getCLErrorString(error.err()) + ")";
+			response.assign(msg.begin(), msg.end());
+		} catch(Exception &exception) {
+			status = BROKER_ERROR;
+			std::string msg = exception.what();
+			response.assign(msg.begin(), msg.end());
+		}
+		if(!sendMessage(client.socket, status, response))
+			closed.push_back(client.socket);
+		workPending = workPending || !client.pending.empty();
+	}
+	if(clients.size() > 0)
+		nextClient = (nextClient + 1) % clients.size();
+	for(unsigned int i = 0; i < closed.size(); i++)
+		disconnect(closed[i]);
+	return workPending;
+}
+
+/**
+ * Clients may only use the buffers they created themselves.
+ */
+DeviceBroker::Buffer &DeviceBroker::getBuffer(const Client &client, unsigned int id) {
+	if(buffers.count(id) == 0) {
+		std::string msg = "No broker buffer with id " + number(id);
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	if(buffers[id].owner != client.socket) {
+		std::string msg = "Broker buffer " + number(id) + " is not owned by this client";
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return buffers[id];
+}
+
+std::vector<char> DeviceBroker::serve(Client &client, const Request &request) {
+	MessageReader reader(request.payload);
+	std::vector<char> response;
+	cl::CommandQueue queue = context.getQueue(client.queue);
+
+	switch(request.type) {
+	case BROKER_BUILD_PROGRAM: {
+		std::string buildOptions = reader.getString();
+		std::string code = reader.getString();
+		std::string key = buildOptions + '\0' + code;
+		if(programCache.count(key) == 0)
+			programCache[key] = context.createProgramFromString(code, buildOptions);
+		put(response, (cl_int)programCache[key]);
+		break;
+	}
+	case BROKER_CREATE_BUFFER: {
+		cl_mem_flags flags = reader.get<cl_ulong>();
+		size_t size = reader.get<cl_ulong>();
+		Buffer buffer;
+		buffer.owner = client.socket;
+		buffer.memory = SharedMemory::create(size);
+		buffer.buffer = cl::Buffer(context.getContext(), flags, size);
+		unsigned int id = nextBufferId++;
+		buffers[id] = buffer;
+		put(response, (cl_uint)id);
+		putString(response, buffer.memory->getName());
+		break;
+	}
+	case BROKER_WRITE_BUFFER: {
+		Buffer &buffer = getBuffer(client, reader.get<cl_uint>());
+		size_t size = reader.get<cl_ulong>();
+		BlockingCall blockingCall(context.getRunTimeMeasurementManager(), "blocking write", __FILE__, __LINE__);
+		queue.enqueueWriteBuffer(buffer.buffer, CL_TRUE, 0, size, buffer.memory->getPointer());
+		break;
+	}
+	case BROKER_READ_BUFFER: {
+		Buffer &buffer = getBuffer(client, reader.get<cl_uint>());
+		size_t size = reader.get<cl_ulong>();
+		BlockingCall blockingCall(context.getRunTimeMeasurementManager(), "blocking read", __FILE__, __LINE__);
+		queue.enqueueReadBuffer(buffer.buffer, CL_TRUE, 0, size, buffer.memory->getPointer());
+		break;
+	}
+	case BROKER_RELEASE_BUFFER: {
+		unsigned int id = reader.get<cl_uint>();
+		getBuffer(client, id);
+		buffers.erase(id);
+		break;
+	}
+	case BROKER_EXECUTE_KERNEL: {
+		int program = reader.get<cl_int>();
+		std::string kernelName = reader.getString();
+		size_t global = reader.get<cl_ulong>();
+		size_t local = reader.get<cl_ulong>();
+		cl::Kernel kernel(context.getProgram(program), kernelName.c_str());
+		cl_uint numberOfArguments = reader.get<cl_uint>();
+		for(cl_uint i = 0; i < numberOfArguments; i++) {
+			cl_uint type = reader.get<cl_uint>();
+			unsigned int bufferId = reader.get<cl_uint>();
+			size_t localSize = reader.get<cl_ulong>();
+			std::string value = reader.getString();
+			if(type == BrokerKernelArguments::ARGUMENT_BUFFER) {
+				kernel.setArg(i, getBuffer(client, bufferId).buffer);
+			} else if(type == BrokerKernelArguments::ARGUMENT_LOCAL) {
+				kernel.setArg(i, cl::__local(localSize));
+			} else {
+				// cl::Kernel::setArg takes a non-const pointer
+				std::vector<char> bytes(value.begin(), value.end());
+				kernel.setArg(i, bytes.size(), bytes.empty() ? NULL : (void *)&bytes[0]);
+			}
+		}
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global),
+				local > 0 ? cl::NDRange(local) : cl::NullRange);
+		BlockingCall blockingCall(context.getRunTimeMeasurementManager(), "finish", __FILE__, __LINE__);
+		queue.finish();
+		break;
+	}
+	default:
+		throw Exception("Unknown broker request", __LINE__, __FILE__);
+	}
+	return response;
+}
+
+} //namespace oul
+
+#endif
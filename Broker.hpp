@@ -0,0 +1,203 @@
+#ifndef BROKER_HPP_
+#define BROKER_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <vector>
+#include <map>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <boost/shared_ptr.hpp>
+#include "Context.hpp"
+#include "Reporter.hpp"
+
+/*
+ * A local device broker, which lets several processes share the devices,
+ * the compiled programs and the runtime thread pools of one broker process.
+ * Clients talk to the broker over a UNIX socket and hand data over in
+ * POSIX shared memory. Only available on POSIX systems.
+ */
+namespace oul {
+
+std::string getDefaultBrokerSocketPath();
+
+/**
+ * A POSIX shared memory segment mapped into this process.
+ * The process that creates the segment also removes it.
+ */
+class SharedMemory {
+
+public:
+	static boost::shared_ptr<SharedMemory> create(size_t size); //can throw oul::Exception
+	static boost::shared_ptr<SharedMemory> open(std::string name, size_t size); //can throw oul::Exception
+	~SharedMemory();
+
+	std::string getName() const;
+	size_t getSize() const;
+	void * getPointer() const;
+
+private:
+	SharedMemory(std::string name, size_t size, bool owner); //can throw oul::Exception
+	SharedMemory(const SharedMemory &other);
+	SharedMemory &operator=(const SharedMemory &other);
+
+	std::string name;
+	size_t size;
+	bool owner;
+	void * pointer;
+};
+
+typedef boost::shared_ptr<class SharedMemory> SharedMemoryPtr;
+
+/**
+ * A device buffer owned by the broker, with a shared memory segment
+ * that data is staged through on its way to and from the device.
+ */
+class BrokerBuffer {
+
+public:
+	BrokerBuffer();
+	BrokerBuffer(unsigned int id, SharedMemoryPtr memory);
+
+	unsigned int getId() const;
+	size_t getSize() const;
+	void * getHostPointer() const;
+
+private:
+	unsigned int id;
+	SharedMemoryPtr memory;
+};
+
+/**
+ * Kernel arguments for BrokerClient::executeKernel. Mirrors cl::Kernel::setArg.
+ */
+class BrokerKernelArguments {
+
+public:
+	enum ArgumentType {ARGUMENT_BUFFER, ARGUMENT_SCALAR, ARGUMENT_LOCAL};
+	struct Argument {
+		ArgumentType type;
+		unsigned int buffer;
+		std::vector<char> value;
+		size_t localSize;
+	};
+
+	void setArg(unsigned int index, const BrokerBuffer &buffer);
+	void setLocalArg(unsigned int index, size_t size);
+	template <class T>
+	void setArg(unsigned int index, T value) {
+		Argument &argument = get(index);
+		argument.type = ARGUMENT_SCALAR;
+		argument.value.resize(sizeof(T));
+		std::memcpy(&argument.value[0], &value, sizeof(T));
+	}
+
+	const std::vector<Argument> &getArguments() const;
+
+private:
+	Argument &get(unsigned int index);
+
+	std::vector<Argument> arguments;
+};
+
+/**
+ * Client side of the broker. The API mirrors Context, except that programs
+ * and buffers are referred to by ids, since the OpenCL objects live in the broker.
+ * All calls are synchronous.
+ */
+class BrokerClient {
+
+public:
+	BrokerClient(std::string socketPath = getDefaultBrokerSocketPath()); //can throw oul::Exception
+	~BrokerClient();
+
+	int createProgramFromSource(std::string filename, std::string buildOptions = "");
+	int createProgramFromString(std::string code, std::string buildOptions = "");
+	int createProgramFromSourceWithName(std::string programName, std::string filename, std::string buildOptions = "");
+	int createProgramFromStringWithName(std::string programName, std::string code, std::string buildOptions = "");
+	int getProgram(std::string name); //can throw oul::Exception
+	bool hasProgram(std::string name);
+
+	void executeKernel(int program, std::string kernelName, const BrokerKernelArguments &arguments,
+			size_t global_work_size, size_t local_work_size = 0); //can throw oul::Exception
+
+	BrokerBuffer createBuffer(cl_mem_flags flags, size_t size, void * host_data, std::string bufferName); //can throw oul::Exception
+	void writeBuffer(BrokerBuffer buffer, size_t size, const void * inputData); //can throw oul::Exception
+	void readBuffer(BrokerBuffer buffer, size_t size, void * outputData); //can throw oul::Exception
+	void releaseBuffer(BrokerBuffer buffer); //can throw oul::Exception
+
+private:
+	BrokerClient(const BrokerClient &other);
+	BrokerClient &operator=(const BrokerClient &other);
+
+	std::vector<char> request(unsigned int type, const std::vector<char> &payload); //can throw oul::Exception
+
+	int socket;
+	std::map<std::string, int> programNames;
+	Reporter reporter;
+};
+
+typedef boost::shared_ptr<class BrokerClient> BrokerClientPtr;
+
+/**
+ * The broker. Owns a Context with the devices, compiles each distinct program
+ * once for all clients, and serves the requests of its clients round-robin,
+ * so that one busy client can't starve the others.
+ */
+class DeviceBroker {
+
+public:
+	DeviceBroker(Context context, std::string socketPath = getDefaultBrokerSocketPath()); //can throw oul::Exception
+	~DeviceBroker();
+
+	void run();
+	void stop();
+	unsigned int getNumberOfClients() const;
+	unsigned int getNumberOfPrograms() const;
+
+private:
+	struct Request {
+		unsigned int type;
+		std::vector<char> payload;
+	};
+	struct Client {
+		int socket;
+		unsigned int queue;
+		std::deque<Request> pending;
+		std::vector<char> received; // Start of a message that has not fully arrived
+	};
+	struct Buffer {
+		int owner;
+		cl::Buffer buffer;
+		SharedMemoryPtr memory;
+	};
+
+	DeviceBroker(const DeviceBroker &other);
+	DeviceBroker &operator=(const DeviceBroker &other);
+
+	void accept();
+	bool receive(Client &client);
+	void disconnect(int socket);
+	bool serveRound();
+	std::vector<char> serve(Client &client, const Request &request); //can throw cl::Error and oul::Exception
+	Buffer &getBuffer(const Client &client, unsigned int id); //can throw oul::Exception
+
+	Context context;
+	std::string socketPath;
+	int listenSocket;
+	volatile bool running;
+	Reporter reporter;
+
+	std::vector<Client> clients;
+	unsigned int nextClient;
+	unsigned int numberOfQueues;
+	std::map<std::string, int> programCache;
+	std::map<unsigned int, Buffer> buffers;
+	unsigned int nextBufferId;
+};
+
+typedef boost::shared_ptr<class DeviceBroker> DeviceBrokerPtr;
+
+} //namespace oul
+
+#endif /* BROKER_HPP_ */
@@ -0,0 +1,45 @@
+#include "Command.hpp"
+
+#include "Exceptions.hpp"
+
+namespace oul {
+
+Command::Command() {
+}
+
+Command::Command(cl::Event event, EventExecutorPtr executor) :
+		event(event),
+		executor(executor)
+	{
+}
+
+cl::Event Command::getEvent() const {
+	return event;
+}
+
+bool Command::isComplete() const {
+	cl_int status = event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+	return status == CL_COMPLETE || status < 0;
+}
+
+void Command::wait() const {
+	{
+		BlockingCall blockingCall(executor ? executor->getRunTimeMeasurementManager() : RuntimeMeasurementsManagerPtr(), "event wait", __FILE__, __LINE__);
+		event.wait();
+	}
+	throwIfFailed();
+}
+
+void Command::then(Continuation continuation) {
+	if (!executor)
+		throw Exception("Command has no EventExecutor to run the continuation on", __LINE__, __FILE__);
+	executor->schedule(event, continuation);
+}
+
+void Command::throwIfFailed() const {
+	cl_int status = event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+	if (status < 0)
+		throw cl::Error(status, "Command failed");
+}
+
+} //namespace oul
@@ -0,0 +1,34 @@
+#ifndef COMMAND_HPP_
+#define COMMAND_HPP_
+
+#include "CL/OpenCL.hpp"
+#include "EventExecutor.hpp"
+
+namespace oul {
+
+/**
+ * A handle to an enqueued OpenCL command.
+ * The command can be waited for, given a continuation which is run by the
+ * context's EventExecutor when the command completes, or, when compiled as
+ * C++20, awaited from a coroutine with CommandCoroutines.hpp.
+ */
+class Command {
+
+public:
+	Command();
+	Command(cl::Event event, EventExecutorPtr executor);
+
+	cl::Event getEvent() const;
+	bool isComplete() const; //can throw cl::Error
+	void wait() const; //can throw cl::Error
+	void then(Continuation continuation); //can throw cl::Error
+	void throwIfFailed() const; //can throw cl::Error
+
+private:
+	cl::Event event;
+	EventExecutorPtr executor;
+};
+
+} //namespace oul
+
+#endif /* COMMAND_HPP_ */
@@ -0,0 +1,100 @@
+#ifndef COMMANDCOROUTINES_HPP_
+#define COMMANDCOROUTINES_HPP_
+
+#include "Command.hpp"
+
+#if !defined(__cpp_impl_coroutine)
+#error "CommandCoroutines.hpp needs a compiler with C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <boost/shared_ptr.hpp>
+
+namespace oul {
+
+/**
+ * Lets host coroutines await Commands, for code compiled as C++20:
+ *
+ *     co_await context.enqueue(kernel, cl::NDRange(size));
+ *     co_await context.read(buffer, size, hostData);
+ *
+ * The coroutine is resumed by EventExecutor::run()/poll(), not by a blocking finish.
+ * Everything here is header only and outside of the library's classes, so the
+ * library itself is built the same way whether or not this header is used.
+ */
+class CommandAwaiter {
+
+public:
+	explicit CommandAwaiter(Command command) : command(command) {}
+
+	bool await_ready() const {
+		return command.isComplete();
+	}
+	void await_suspend(std::coroutine_handle<> handle) {
+		command.then(handle);
+	}
+	void await_resume() const {
+		command.throwIfFailed();
+	}
+
+private:
+	Command command;
+};
+
+inline CommandAwaiter operator co_await(Command command) {
+	return CommandAwaiter(command);
+}
+
+/**
+ * Return type for host coroutines that await Commands. The coroutine starts
+ * running immediately and is resumed by the EventExecutor, so the Task object
+ * is only needed to check whether the coroutine has finished.
+ */
+class Task {
+
+public:
+	struct State {
+		State() : done(false) {}
+		bool done;
+		std::exception_ptr exception;
+	};
+
+	struct promise_type {
+		promise_type() : state(new State) {}
+		Task get_return_object() {
+			return Task(state);
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return std::suspend_never();
+		}
+		std::suspend_never final_suspend() noexcept {
+			return std::suspend_never();
+		}
+		void return_void() {
+			state->done = true;
+		}
+		void unhandled_exception() {
+			state->exception = std::current_exception();
+			state->done = true;
+		}
+		boost::shared_ptr<State> state;
+	};
+
+	bool isDone() const {
+		return state->done;
+	}
+	void rethrowIfFailed() const {
+		if (state->exception)
+			std::rethrow_exception(state->exception);
+	}
+
+private:
+	explicit Task(boost::shared_ptr<State> state) : state(state) {}
+
+	boost::shared_ptr<State> state;
+};
+
+} //namespace oul
+
+#endif /* COMMANDCOROUTINES_HPP_ */
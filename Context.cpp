@@ -1,6 +1,11 @@
 #include "Context.hpp"
 
 #include <iostream>
+#include <utility>
+#include <set>
+#include <cstring>
+#include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
 #include "HelperFunctions.hpp"
 #include "RuntimeMeasurement.hpp"
 
@@ -32,25 +37,61 @@ void CL_CALLBACK contextCallback(const char *errinfo, const void *private_info,
 	r.report("Context callback:\n " + std::string(errinfo), oul::ERROR);
 }
 
-Context::Context() {
+/**
+ * Everything a Context and its copies share
+ */
+struct ContextState {
+	ContextState() : profilingEnabled(false) {}
+
+	Reporter reporter;
+	cl::Context context;
+	std::vector<cl::CommandQueue> queues;
+	std::map<std::string, int> programNames;
+	std::vector<cl::Program> programs;
+	std::vector<cl::Device> devices;
+	cl::Platform platform;
+	GarbageCollectorPtr garbageCollector;
+
+	bool profilingEnabled;
+	RuntimeMeasurementsManagerPtr runtimeManager;
+	EventExecutorPtr executor;
+
+	// Profiling enabled twins of the queues, created when the runtime
+	// measurements are enabled after the queues were made without profiling
+	std::vector<cl::CommandQueue> profilingQueues;
+	std::vector<bool> usingProfilingQueue;
+
+	// The launches used per program and kernel function name
+	std::map<std::pair<cl_program, std::string>, std::set<KernelLaunch> > kernelLaunches;
+
+	boost::mutex programMutex; // Guards programs and programNames
+	boost::mutex launchMutex; // Guards kernelLaunches
+	boost::mutex queueMutex; // Guards profilingQueues and usingProfilingQueue
+};
+
+Context::Context() :
+		state(new ContextState())
+	{
 	//TODO make private or implement properly
-	reporter.report("[!!!WARNING!!!] Calling default oul::Context constructor, object is not correctly instantiated, make this private!", oul::WARNING);
+	state->reporter.report("[!!!WARNING!!!] Calling default oul::Context constructor, object is not correctly instantiated, make this private!", oul::WARNING);
 }
 
 Context::Context(std::vector<cl::Device> devices, unsigned long * OpenGLContext, bool enableProfiling) :
-		profilingEnabled(enableProfiling),
-		runtimeManager(new RuntimeMeasurementsManager())
+		state(new ContextState())
 	{
-	if(profilingEnabled)
-		runtimeManager->enable();
+	state->profilingEnabled = enableProfiling;
+	state->runtimeManager = RuntimeMeasurementsManagerPtr(new RuntimeMeasurementsManager());
+	state->executor = EventExecutorPtr(new EventExecutor(state->runtimeManager));
+	if(state->profilingEnabled)
+		state->runtimeManager->enable();
 	else
-		runtimeManager->disable();
+		state->runtimeManager->disable();
 
-    this->garbageCollector = GarbageCollectorPtr(new GarbageCollector);
+    state->garbageCollector = GarbageCollectorPtr(new GarbageCollector);
 
-    this->devices = devices;
+    state->devices = devices;
     // TODO: make sure that all devices have the same platform
-    this->platform = devices[0].getInfo<CL_DEVICE_PLATFORM>();
+    state->platform = devices[0].getInfo<CL_DEVICE_PLATFORM>();
 
     // TODO: OpenGL interop properties
     // TODO: must check that a OpenGL context and display is available
@@ -59,14 +100,14 @@ Context::Context(std::vector<cl::Device> devices, unsigned long * OpenGLContext,
     if(OpenGLContext != NULL) {
 #if defined(__APPLE__) || defined(__MACOSX)
         cps = createInteropContextProperties(
-                this->platform,
+                state->platform,
                 (cl_context_properties)CGLGetShareGroup(CGLGetCurrentContext()),
                 NULL
         );
 #else
 #ifdef _WIN32
         cps = createInteropContextProperties(
-                this->platform,
+                state->platform,
                 (cl_context_properties)wglGetCurrentContext(),
                 (cl_context_properties)wglGetCurrentDC()
         );
@@ -75,7 +116,7 @@ Context::Context(std::vector<cl::Device> devices, unsigned long * OpenGLContext,
         Display * display = XOpenDisplay(0);
         std::cout << "current display is " << display << std::endl;
         cps = createInteropContextProperties(
-                this->platform,
+                state->platform,
                 (cl_context_properties)OpenGLContext,
                 (cl_context_properties)display
         );
@@ -84,20 +125,53 @@ Context::Context(std::vector<cl::Device> devices, unsigned long * OpenGLContext,
     } else {
         cps = new cl_context_properties[3];
         cps[0] = CL_CONTEXT_PLATFORM;
-        cps[1] = (cl_context_properties)(platform)();
+        cps[1] = (cl_context_properties)(state->platform)();
         cps[2] = 0;
     }
-    this->context = cl::Context(devices,cps,contextCallback);
+    state->context = cl::Context(devices,cps,contextCallback);
     delete[] cps;
 
     // Create a command queue for each device
     for(int i = 0; i < devices.size(); i++) {
-        if(profilingEnabled) {
-            this->queues.push_back(cl::CommandQueue(context, devices[i], CL_QUEUE_PROFILING_ENABLE));
+        if(state->profilingEnabled) {
+            state->queues.push_back(cl::CommandQueue(state->context, devices[i], CL_QUEUE_PROFILING_ENABLE));
         } else {
-            this->queues.push_back(cl::CommandQueue(context, devices[i]));
+            state->queues.push_back(cl::CommandQueue(state->context, devices[i]));
         }
     }
+    state->profilingQueues.resize(devices.size());
+    state->usingProfilingQueue.resize(devices.size(), false);
+    // The switch must not keep the state alive, the state owns the manager
+    if(!state->profilingEnabled)
+        state->runtimeManager->addProfilingSwitch(boost::bind(&Context::switchProfiling, boost::weak_ptr<ContextState>(state), _1));
+}
+
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+/**
+ * Moving takes over the shared state without touching the reference count.
+ * The moved from Context is left without state, and may only be assigned to.
+ */
+Context::Context(Context &&other) :
+		state(std::move(other.state))
+	{
+}
+
+Context &Context::operator=(Context &&other) {
+	state = std::move(other.state);
+	return *this;
+}
+#endif
+
+int Context::addProgram(cl::Program program) {
+    boost::mutex::scoped_lock lock(state->programMutex);
+    state->programs.push_back(program);
+    return state->programs.size()-1;
+}
+
+int Context::nameProgram(std::string programName, int program) {
+    boost::mutex::scoped_lock lock(state->programMutex);
+    state->programNames[programName] = program;
+    return program;
 }
 
 int Context::createProgramFromSource(std::string filename, std::string buildOptions) {
@@ -105,8 +179,7 @@ int Context::createProgramFromSource(std::string filename, std::string buildOpti
 
     cl::Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length()));
     cl::Program program = buildSources(source, buildOptions);
-    programs.push_back(program);
-    return programs.size()-1;
+    return addProgram(program);
 }
 
 /**
@@ -122,67 +195,115 @@ int Context::createProgramFromSource(std::vector<std::string> filenames, std::st
     }
 
     cl::Program program = buildSources(sources, buildOptions);
-    programs.push_back(program);
-    return programs.size()-1;
+    return addProgram(program);
 }
 
 int Context::createProgramFromString(std::string code, std::string buildOptions) {
     cl::Program::Sources source(1, std::make_pair(code.c_str(), code.length()));
 
     cl::Program program = buildSources(source, buildOptions);
-    programs.push_back(program);
-    return programs.size()-1;
+    return addProgram(program);
 }
 
 cl::Program Context::getProgram(unsigned int i) {
-    return programs[i];
+    boost::mutex::scoped_lock lock(state->programMutex);
+    return state->programs[i];
 }
 
+/**
+ * If the queues were created without profiling and the runtime measurements
+ * have been enabled since, a profiling enabled queue for the same device is
+ * returned instead. Queues should be fetched anew for each piece of work,
+ * since work on a queue fetched before a switch is not ordered with work on
+ * the queue returned after it.
+ */
 cl::CommandQueue Context::getQueue(unsigned int i) {
-    return queues[i];
+    if(state->profilingEnabled)
+        return state->queues[i];
+
+    boost::mutex::scoped_lock lock(state->queueMutex);
+    return state->usingProfilingQueue[i] ? state->profilingQueues[i] : state->queues[i];
+}
+
+/**
+ * Called by the runtime measurements manager when it is enabled or disabled.
+ * The profiling enabled queues are created on first use, and the queues that
+ * are left are finished, so that work enqueued before the switch completes
+ * before work enqueued after it starts.
+ */
+void Context::switchProfiling(boost::weak_ptr<ContextState> weakState, bool profile) {
+    boost::shared_ptr<ContextState> state = weakState.lock();
+    if(!state)
+        return;
+
+    boost::mutex::scoped_lock lock(state->queueMutex);
+    for(unsigned int i = 0; i < state->queues.size(); i++) {
+        if(profile == state->usingProfilingQueue[i])
+            continue;
+        if(profile && state->profilingQueues[i]() == NULL)
+            state->profilingQueues[i] = cl::CommandQueue(state->context, state->devices[i], CL_QUEUE_PROFILING_ENABLE);
+        BlockingCall blockingCall(state->runtimeManager, "finish", __FILE__, __LINE__);
+        if(profile)
+            state->queues[i].finish();
+        else
+            state->profilingQueues[i].finish();
+        state->usingProfilingQueue[i] = profile;
+    }
+}
+
+/**
+ * Waits for all work in all queues of the context to finish
+ */
+void Context::finish() {
+    BlockingCall blockingCall(state->runtimeManager, "finish", __FILE__, __LINE__);
+    for(unsigned int i = 0; i < state->queues.size(); i++) {
+        state->queues[i].finish();
+        boost::mutex::scoped_lock lock(state->queueMutex);
+        if(state->profilingQueues[i]() != NULL)
+            state->profilingQueues[i].finish();
+    }
 }
 
 
 cl::Device Context::getDevice(unsigned int i) {
-    return devices[i];
+    return state->devices[i];
 }
 
-cl::Device getDevice(cl::CommandQueue queue){
+cl::Device Context::getDevice(cl::CommandQueue queue){
 	return queue.getInfo<CL_QUEUE_DEVICE>();
 }
 
 cl::Context Context::getContext() {
-    return context;
+    return state->context;
 }
 
 cl::Platform Context::getPlatform() {
-    return platform;
+    return state->platform;
 }
 
 GarbageCollector* Context::getGarbageCollector() {
-	GarbageCollector* retval = garbageCollector.get();
+	GarbageCollector* retval = state->garbageCollector.get();
     return retval;
 }
 
 GarbageCollectorPtr Context::getGarbageCollectorPtr(){
-	return garbageCollector;
+	return state->garbageCollector;
 }
 
 cl::Program Context::buildSources(cl::Program::Sources source, std::string buildOptions) {
     // Make program of the source code in the context
-    cl::Program program = cl::Program(context, source);
+    cl::Program program = cl::Program(state->context, source);
 
     // Build program for the context devices
     try{
-        program.build(devices, buildOptions.c_str());
-        programs.push_back(program);
+        program.build(state->devices, buildOptions.c_str());
     } catch(cl::Error &error) {
         if(error.err() == CL_BUILD_PROGRAM_FAILURE) {
-            for(unsigned int i=0; i<devices.size(); i++){
-            	reporter.report("Build log, device "+oul::number(i)+ "\n"+ program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[i]), oul::ERROR);
+            for(unsigned int i=0; i<state->devices.size(); i++){
+            	state->reporter.report("Build log, device "+oul::number(i)+ "\n"+ program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(state->devices[i]), oul::ERROR);
             }
         }
-        reporter.report(getCLErrorString(error.err()), oul::ERROR);
+        state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
 
         throw error;
     }
@@ -190,7 +311,15 @@ cl::Program Context::buildSources(cl::Program::Sources source, std::string build
 }
 
 RuntimeMeasurementsManagerPtr Context::getRunTimeMeasurementManager(){
-	return runtimeManager;
+	return state->runtimeManager;
+}
+
+EventExecutorPtr Context::getExecutor(){
+	return state->executor;
+}
+
+unsigned int Context::getNumberOfHandles() const {
+	return state.use_count();
 }
 
 
@@ -202,45 +331,43 @@ int Context::createProgramFromSourceWithName(
         std::string programName,
         std::string filename,
         std::string buildOptions) {
-    programNames[programName] = createProgramFromSource(filename,buildOptions);
-    return programNames[programName];
+    return nameProgram(programName, createProgramFromSource(filename,buildOptions));
 }
 
 int Context::createProgramFromSourceWithName(
         std::string programName,
         std::vector<std::string> filenames,
         std::string buildOptions) {
-    programNames[programName] = createProgramFromSource(filenames,buildOptions);
-    return programNames[programName];
+    return nameProgram(programName, createProgramFromSource(filenames,buildOptions));
 }
 
 int Context::createProgramFromStringWithName(
         std::string programName,
         std::string code,
         std::string buildOptions) {
-    programNames[programName] = createProgramFromString(code,buildOptions);
-    return programNames[programName];
+    return nameProgram(programName, createProgramFromString(code,buildOptions));
 }
 
 int Context::createProgramFromBinaryWithName(
         std::string programName,
         std::string filename,
         std::string buildOptions) {
-    programNames[programName] = createProgramFromBinary(filename,buildOptions);
-    return programNames[programName];
+    return nameProgram(programName, createProgramFromBinary(filename,buildOptions));
 }
 
 cl::Program Context::getProgram(std::string name) {
-    if(programNames.count(name) == 0) {
+    boost::mutex::scoped_lock lock(state->programMutex);
+    if(state->programNames.count(name) == 0) {
         std::string msg ="Could not find OpenCL program with the name" + name;
         throw Exception(msg.c_str(), __LINE__, __FILE__);
     }
 
-    return programs[programNames[name]];
+    return state->programs[state->programNames[name]];
 }
 
 bool Context::hasProgram(std::string name) {
-    return programNames.count(name) > 0;
+    boost::mutex::scoped_lock lock(state->programMutex);
+    return state->programNames.count(name) > 0;
 }
 
 cl::Kernel Context::createKernel(cl::Program program, std::string kernel_name)
@@ -250,12 +377,12 @@ cl::Kernel Context::createKernel(cl::Program program, std::string kernel_name)
 	try
 	{
 		kernel = cl::Kernel(program, kernel_name.c_str(), NULL);
-		reporter.report("Created kernel with name "+std::string(kernel_name), oul::INFO);
+		state->reporter.report("Created kernel with name "+std::string(kernel_name), oul::INFO);
 	}
 	catch(cl::Error &error)
 	{
-		reporter.report("Could not create kernel. Reason:"+std::string(error.what()), oul::ERROR);
-		reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		state->reporter.report("Could not create kernel. Reason:"+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
 		throw;
 	}
 
@@ -264,15 +391,25 @@ cl::Kernel Context::createKernel(cl::Program program, std::string kernel_name)
 
 void Context::executeKernel(cl::CommandQueue queue, cl::Kernel kernel, size_t global_work_size, size_t local_work_size)
 {
-	reporter.report("Executing kernel", oul::INFO);
+	state->reporter.report("Executing kernel", oul::INFO);
 	try
 	{
-		queue.enqueueNDRangeKernel(kernel, 0, global_work_size, local_work_size, NULL, NULL);
-		queue.finish();
+		// Recorded first, so a launch the device rejects is still reported
+		recordKernelLaunch(kernel, cl::NDRange(global_work_size), cl::NDRange(local_work_size), queue);
+		cl::Event event;
+		queue.enqueueNDRangeKernel(kernel, 0, global_work_size, local_work_size, NULL, &event);
+		if(state->runtimeManager->isTracing())
+			state->runtimeManager->traceCLCommand(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), "kernel", event, queue);
+		{
+			BlockingCall blockingCall(state->runtimeManager, "finish", __FILE__, __LINE__);
+			queue.finish();
+		}
+		if(state->runtimeManager->isInstrumentingKernels())
+			state->runtimeManager->instrumentKernel(kernel, cl::NDRange(global_work_size), event);
 	} catch (cl::Error &error)
 	{
-		reporter.report("Could not execute kernel(s). Reason: "+std::string(error.what()), oul::ERROR);
-		reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		state->reporter.report("Could not execute kernel(s). Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
 		throw;
 	}
 }
@@ -285,11 +422,13 @@ cl::Buffer Context::createBuffer(cl::Context context, cl_mem_flags flags, size_t
 		if (host_data != NULL)
 			flags |= CL_MEM_COPY_HOST_PTR;
 		dev_mem = cl::Buffer(context, flags, size, host_data, NULL);
+		if (host_data != NULL && state->runtimeManager)
+			state->runtimeManager->recordTransfer(TRANSFER_HOST_TO_DEVICE, size, cl::CommandQueue(), bufferName);
 		dev_mem.setDestructorCallback(memoryDestructorCallback, static_cast<void*>(new std::string(bufferName)));
 	} catch (cl::Error &error)
 	{
-		reporter.report("Could not create a OpenCL buffer queue. Reason: "+std::string(error.what()), oul::ERROR);
-		reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		state->reporter.report("Could not create a OpenCL buffer queue. Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
 		throw;
 	}
 	return dev_mem;
@@ -299,13 +438,275 @@ void Context::readBuffer(cl::CommandQueue queue, cl::Buffer outputBuffer, size_t
 {
 	try
 	{
-		queue.enqueueReadBuffer(outputBuffer, CL_TRUE, 0, outputVolumeSize, outputData, 0, 0);
+		cl::Event event;
+		// Enqueued without blocking and then waited for, so the read is traced when it was enqueued
+		{
+			BlockingCall blockingCall(state->runtimeManager, "blocking read", __FILE__, __LINE__);
+			queue.enqueueReadBuffer(outputBuffer, CL_FALSE, 0, outputVolumeSize, outputData, 0, &event);
+			if(state->runtimeManager->isTracing())
+				state->runtimeManager->traceCLCommand("read", "transfer", event, queue, outputVolumeSize);
+			event.wait();
+		}
+		state->runtimeManager->recordTransfer(TRANSFER_DEVICE_TO_HOST, outputVolumeSize, queue, "", event);
+	} catch (cl::Error &error)
+	{
+		state->reporter.report("Could not read output volume buffer from OpenCL. Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		throw;
+	}
+}
+
+/**
+ * Enqueues the kernel without waiting for it to finish.
+ * The returned Command can be awaited or given a continuation.
+ * The work of the launch, if given, places the kernel on the roofline.
+ */
+Command Context::enqueue(cl::Kernel kernel, cl::NDRange global, cl::NDRange local, unsigned int queue, KernelWork work)
+{
+	cl::Event event;
+	try
+	{
+		cl::CommandQueue commandQueue = getQueue(queue);
+		// Recorded first, so a launch the device rejects is still reported
+		recordKernelLaunch(kernel, global, local, commandQueue);
+		commandQueue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, &event);
+		commandQueue.flush();
+		if(state->runtimeManager->isTracing())
+			state->runtimeManager->traceCLCommand(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), "kernel", event, commandQueue);
+		if(state->runtimeManager->isInstrumentingKernels())
+			state->runtimeManager->instrumentKernel(kernel, global, event, work);
+	} catch (cl::Error &error)
+	{
+		state->reporter.report("Could not enqueue kernel. Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		throw;
+	}
+	return Command(event, state->executor);
+}
+
+/**
+ * Enqueues a non-blocking read. hostData must stay valid until the Command has completed.
+ */
+Command Context::read(cl::Buffer buffer, size_t size, void * hostData, unsigned int queue, std::string bufferName)
+{
+	cl::Event event;
+	try
+	{
+		cl::CommandQueue commandQueue = getQueue(queue);
+		commandQueue.enqueueReadBuffer(buffer, CL_FALSE, 0, size, hostData, NULL, &event);
+		commandQueue.flush();
+		if(state->runtimeManager->isTracing())
+			state->runtimeManager->traceCLCommand("read", "transfer", event, commandQueue, size);
+		state->runtimeManager->recordTransfer(TRANSFER_DEVICE_TO_HOST, size, commandQueue, bufferName, event);
+	} catch (cl::Error &error)
+	{
+		state->reporter.report("Could not enqueue buffer read. Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		throw;
+	}
+	return Command(event, state->executor);
+}
+
+/**
+ * Enqueues a non-blocking write. hostData must stay valid until the Command has completed.
+ */
+Command Context::write(cl::Buffer buffer, size_t size, const void * hostData, unsigned int queue, std::string bufferName)
+{
+	cl::Event event;
+	try
+	{
+		cl::CommandQueue commandQueue = getQueue(queue);
+		commandQueue.enqueueWriteBuffer(buffer, CL_FALSE, 0, size, hostData, NULL, &event);
+		commandQueue.flush();
+		if(state->runtimeManager->isTracing())
+			state->runtimeManager->traceCLCommand("write", "transfer", event, commandQueue, size);
+		state->runtimeManager->recordTransfer(TRANSFER_HOST_TO_DEVICE, size, commandQueue, bufferName, event);
 	} catch (cl::Error &error)
 	{
-		reporter.report("Could not read output volume buffer from OpenCL. Reason: "+std::string(error.what()), oul::ERROR);
-		reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		state->reporter.report("Could not enqueue buffer write. Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
 		throw;
 	}
+	return Command(event, state->executor);
+}
+
+/**
+ * Enqueues a copy between two buffers on the device
+ */
+Command Context::copy(cl::Buffer source, cl::Buffer destination, size_t size, unsigned int queue, std::string bufferName)
+{
+	cl::Event event;
+	try
+	{
+		cl::CommandQueue commandQueue = getQueue(queue);
+		commandQueue.enqueueCopyBuffer(source, destination, 0, 0, size, NULL, &event);
+		commandQueue.flush();
+		if(state->runtimeManager->isTracing())
+			state->runtimeManager->traceCLCommand("copy", "transfer", event, commandQueue, size);
+		state->runtimeManager->recordTransfer(TRANSFER_DEVICE_TO_DEVICE, size, commandQueue, bufferName, event);
+	} catch (cl::Error &error)
+	{
+		state->reporter.report("Could not enqueue buffer copy. Reason: "+std::string(error.what()), oul::ERROR);
+		state->reporter.report(getCLErrorString(error.err()), oul::ERROR);
+		throw;
+	}
+	return Command(event, state->executor);
+}
+
+KernelLaunch::KernelLaunch() :
+		device(NULL),
+		dimensions(0)
+	{
+	for(int i = 0; i < 3; i++)
+		global[i] = local[i] = 0;
+}
+
+bool KernelLaunch::operator<(const KernelLaunch &other) const {
+	if(device != other.device)
+		return device < other.device;
+	if(dimensions != other.dimensions)
+		return dimensions < other.dimensions;
+	int compare = std::memcmp(global, other.global, sizeof(global));
+	if(compare != 0)
+		return compare < 0;
+	return std::memcmp(local, other.local, sizeof(local)) < 0;
+}
+
+std::string KernelLaunch::toString() const {
+	std::string global = "", local = "";
+	for(unsigned int i = 0; i < dimensions; i++) {
+		global += (i > 0 ? "x" : "") + oul::number(this->global[i]);
+		local += (i > 0 ? "x" : "") + oul::number(this->local[i]);
+	}
+	return "global " + global + ", local " + (this->local[0] == 0 ? std::string("any") : local);
+}
+
+// Configurations beyond this many per kernel are not recorded
+static const unsigned int MAX_KERNEL_LAUNCHES = 64;
+
+static size_t roundUpToPowerOfTwo(size_t size) {
+	size_t rounded = 1;
+	while(rounded < size)
+		rounded *= 2;
+	return rounded;
+}
+
+/**
+ * Each distinct configuration is kept once per kernel, with the global
+ * size rounded to its size class
+ */
+void Context::recordKernelLaunch(cl::Kernel kernel, cl::NDRange global, cl::NDRange local, cl::CommandQueue queue) {
+	if(!state->runtimeManager || !state->runtimeManager->isEnabled())
+		return;
+
+	KernelLaunch launch;
+	launch.device = queue.getInfo<CL_QUEUE_DEVICE>()();
+	launch.dimensions = global.dimensions();
+	const size_t * globalSizes = global;
+	const size_t * localSizes = local;
+	for(unsigned int i = 0; i < launch.dimensions; i++) {
+		launch.global[i] = roundUpToPowerOfTwo(globalSizes[i]);
+		if(local.dimensions() > i)
+			launch.local[i] = localSizes[i];
+	}
+	std::pair<cl_program, std::string> key(kernel.getInfo<CL_KERNEL_PROGRAM>()(), kernel.getInfo<CL_KERNEL_FUNCTION_NAME>());
+	boost::mutex::scoped_lock lock(state->launchMutex);
+	std::set<KernelLaunch> &launches = state->kernelLaunches[key];
+	if(launches.size() < MAX_KERNEL_LAUNCHES)
+		launches.insert(launch);
+}
+
+/**
+ * Queries the work-group info of every kernel in every program of the
+ * context on every device. The launches used are checked against the
+ * kernel's maximum work-group size, its preferred work-group size multiple
+ * and its compile-time work-group size, and the local memory use against
+ * the device.
+ */
+std::vector<KernelResources> Context::getKernelResources() {
+    std::vector<cl::Program> programs;
+    {
+        boost::mutex::scoped_lock lock(state->programMutex);
+        programs = state->programs;
+    }
+    std::map<std::pair<cl_program, std::string>, std::set<KernelLaunch> > launches;
+    {
+        boost::mutex::scoped_lock lock(state->launchMutex);
+        launches = state->kernelLaunches;
+    }
+
+    std::vector<KernelResources> resources;
+    for(unsigned int p = 0; p < programs.size(); p++) {
+        std::vector<cl::Kernel> kernels;
+        programs[p].createKernels(&kernels);
+        for(unsigned int k = 0; k < kernels.size(); k++) {
+            for(unsigned int d = 0; d < state->devices.size(); d++) {
+                cl::Device device = state->devices[d];
+                KernelResources info;
+                info.kernelName = kernels[k].getInfo<CL_KERNEL_FUNCTION_NAME>();
+                info.program = p;
+                info.device = device;
+                info.workGroupSize = kernels[k].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+                info.preferredWorkGroupSizeMultiple = kernels[k].getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+                info.localMemory = kernels[k].getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+                info.privateMemory = kernels[k].getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(device);
+                cl::size_t<3> compileSize = kernels[k].getWorkGroupInfo<CL_KERNEL_COMPILE_WORK_GROUP_SIZE>(device);
+                for(int i = 0; i < 3; i++)
+                    info.compileWorkGroupSize[i] = compileSize[i];
+
+                if(info.localMemory > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+                    info.warnings.push_back("Uses " + oul::number(info.localMemory) + " bytes of local memory, the device has " +
+                            oul::number(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()));
+
+                std::set<KernelLaunch> &kernelLaunches = launches[std::make_pair(programs[p](), info.kernelName)];
+                std::set<KernelLaunch>::iterator it;
+                for(it = kernelLaunches.begin(); it != kernelLaunches.end(); ++it) {
+                    if(it->device != device())
+                        continue;
+                    info.launches.push_back(*it);
+                    if(it->local[0] == 0)
+                        continue;
+                    size_t localSize = 1;
+                    bool compileSizeMismatch = false;
+                    for(unsigned int i = 0; i < it->dimensions; i++) {
+                        localSize *= it->local[i];
+                        if(info.compileWorkGroupSize[0] != 0 && it->local[i] != info.compileWorkGroupSize[i])
+                            compileSizeMismatch = true;
+                    }
+                    if(localSize > info.workGroupSize)
+                        info.warnings.push_back(it->toString() + ": work-group size " + oul::number(localSize) +
+                                " exceeds the maximum of " + oul::number(info.workGroupSize));
+                    else if(info.preferredWorkGroupSizeMultiple > 0 && localSize % info.preferredWorkGroupSizeMultiple != 0)
+                        info.warnings.push_back(it->toString() + ": work-group size " + oul::number(localSize) +
+                                " is not a multiple of " + oul::number(info.preferredWorkGroupSizeMultiple));
+                    if(compileSizeMismatch)
+                        info.warnings.push_back(it->toString() + ": differs from the compile-time work-group size");
+                }
+                resources.push_back(info);
+            }
+        }
+    }
+    return resources;
+}
+
+void Context::printKernelResources() {
+    std::vector<KernelResources> resources = getKernelResources();
+    for(unsigned int i = 0; i < resources.size(); i++) {
+        const KernelResources &info = resources[i];
+        std::string text = info.kernelName + " on " + info.device.getInfo<CL_DEVICE_NAME>() +
+                ": max work-group size " + oul::number(info.workGroupSize) +
+                ", preferred multiple " + oul::number(info.preferredWorkGroupSizeMultiple) +
+                ", local memory " + oul::number(info.localMemory) + " B" +
+                ", private memory " + oul::number(info.privateMemory) + " B";
+        if(info.compileWorkGroupSize[0] != 0)
+            text += ", compile-time work-group size " + oul::number(info.compileWorkGroupSize[0]) + "x" +
+                    oul::number(info.compileWorkGroupSize[1]) + "x" + oul::number(info.compileWorkGroupSize[2]);
+        for(unsigned int j = 0; j < info.launches.size(); j++)
+            text += "\n    " + info.launches[j].toString();
+        state->reporter.report(text, oul::INFO);
+        for(unsigned int j = 0; j < info.warnings.size(); j++)
+            state->reporter.report(info.kernelName + ": " + info.warnings[j], oul::WARNING);
+    }
 }
 
 } //namespace oul
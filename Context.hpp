@@ -4,23 +4,73 @@
 #include "CL/OpenCL.hpp"
 #include <vector>
 #include <map>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/config.hpp>
 #include "Exceptions.hpp"
 #include "GarbageCollector.hpp"
 #include "Reporter.hpp"
 #include "RuntimeMeasurementManager.hpp"
+#include "EventExecutor.hpp"
+#include "Command.hpp"
 
 namespace oul {
 
+struct ContextState;
+
+/**
+ * A launch configuration that has been used for a kernel on a device.
+ * The global size is the size class, each dimension rounded up to a power
+ * of two, so that a size that changes every frame is kept only a few times.
+ */
+struct KernelLaunch {
+	KernelLaunch();
+	bool operator<(const KernelLaunch &other) const;
+	std::string toString() const;
+
+	cl_device_id device;
+	cl_uint dimensions;
+	size_t global[3];
+	size_t local[3]; // All 0 if the runtime chose the local size
+};
+
+/**
+ * The resource use of a kernel on one device, the launches used for it,
+ * and warnings about launches that don't fit the kernel or the device
+ */
+struct KernelResources {
+	std::string kernelName;
+	int program;
+	cl::Device device;
+	size_t workGroupSize;
+	size_t preferredWorkGroupSizeMultiple;
+	cl_ulong localMemory;
+	cl_ulong privateMemory;
+	size_t compileWorkGroupSize[3]; // All 0 if not given in the kernel
+	std::vector<KernelLaunch> launches;
+	std::vector<std::string> warnings;
+};
+
 /**
  * This class holds an OpenCL context, with all of its queues and devices.
  * Its main purpose is to be a class that can't be sent between different 
  * functions and objects that does OpenCL processing.
+ *
+ * A Context is a handle to state that is shared by all of its copies,
+ * so copying it is cheap, and programs created through one copy are
+ * visible to all the others.
  */
 class Context {
 
 public:
 	Context();
 	Context(std::vector<cl::Device> devices, unsigned long * OpenGLContext, bool enableProfiling = false);
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	Context(const Context &other) = default;
+	Context(Context &&other);
+	Context &operator=(const Context &other) = default;
+	Context &operator=(Context &&other);
+#endif
 
 	int createProgramFromSource(std::string filename, std::string buildOptions = "");
 	int createProgramFromSource(std::vector<std::string> filenames, std::string buildOptions = "");
@@ -40,7 +90,13 @@ public:
 	cl::Buffer createBuffer(cl::Context context, cl_mem_flags flags, size_t size, void * host_data, std::string bufferName); //can throw cl::Error
 	void readBuffer(cl::CommandQueue queue, cl::Buffer outputBuffer, size_t outputVolumeSize, void *outputData); //can throw cl::Error
 
+	Command enqueue(cl::Kernel kernel, cl::NDRange global, cl::NDRange local = cl::NullRange, unsigned int queue = 0, KernelWork work = KernelWork()); //can throw cl::Error
+	Command read(cl::Buffer buffer, size_t size, void * hostData, unsigned int queue = 0, std::string bufferName = ""); //can throw cl::Error
+	Command write(cl::Buffer buffer, size_t size, const void * hostData, unsigned int queue = 0, std::string bufferName = ""); //can throw cl::Error
+	Command copy(cl::Buffer source, cl::Buffer destination, size_t size, unsigned int queue = 0, std::string bufferName = ""); //can throw cl::Error
+
 	cl::CommandQueue getQueue(unsigned int i);
+	void finish(); //can throw cl::Error
 	cl::Device getDevice(unsigned int i);
 	cl::Device getDevice(cl::CommandQueue queue);
 	cl::Context getContext();
@@ -51,20 +107,21 @@ public:
 
 	RuntimeMeasurementsManagerPtr getRunTimeMeasurementManager();
 
+	EventExecutorPtr getExecutor();
+	unsigned int getNumberOfHandles() const; // The copies of this Context, including itself
+
+	// Launches are recorded while the runtime measurements are enabled
+	void recordKernelLaunch(cl::Kernel kernel, cl::NDRange global, cl::NDRange local, cl::CommandQueue queue); //can throw cl::Error
+	std::vector<KernelResources> getKernelResources(); //can throw cl::Error
+	void printKernelResources(); //can throw cl::Error
+
 private:
 	cl::Program buildSources(cl::Program::Sources source, std::string buildOptions);
+	int addProgram(cl::Program program);
+	int nameProgram(std::string programName, int program);
+	static void switchProfiling(boost::weak_ptr<ContextState> state, bool profile); //can throw cl::Error
 
-	Reporter reporter;
-	cl::Context context;
-	std::vector<cl::CommandQueue> queues;
-	std::map<std::string, int> programNames;
-	std::vector<cl::Program> programs;
-	std::vector<cl::Device> devices;
-	cl::Platform platform;
-	GarbageCollectorPtr garbageCollector;
-
-	bool profilingEnabled;
-	RuntimeMeasurementsManagerPtr runtimeManager;
+	boost::shared_ptr<ContextState> state;
 };
 
 typedef boost::shared_ptr<class Context> ContextPtr;
@@ -28,7 +28,12 @@ oul::DeviceCriteria::DeviceCriteria() {
     deviceCountMin = 0;
     deviceCountMax = 100;
     platformCriteria = DEVICE_PLATFORM_ANY;
-    devicePreference = DEVICE_PREFERENCE_NONE;
+    minimumLocalMemory = 0;
+    minimumMaxAllocation = 0;
+    minimumOpenCLVersion = 0;
+    partitioning = DEVICE_PARTITION_NONE;
+    partitionComputeUnits = 0;
+    partitionAffinityDomain = DEVICE_AFFINITY_NEXT_PARTITIONABLE;
 }
 
 void oul::DeviceCriteria::setPlatformCriteria(DevicePlatform platform) {
@@ -47,12 +52,34 @@ unsigned int oul::DeviceCriteria::getDeviceCountMinCriteria() const {
     return deviceCountMin;
 }
 
+/**
+ * Replaces all preferences with a single one
+ */
 void oul::DeviceCriteria::setDevicePreference(DevicePreference preference) {
-    this->devicePreference = preference;
+    devicePreferences.clear();
+    addDevicePreference(preference);
 }
 
+/**
+ * Adds a preference to the ones already set. When there are several,
+ * each is normalized to the best candidate device and weighted before they are summed.
+ */
+void oul::DeviceCriteria::addDevicePreference(DevicePreference preference, double weight) {
+    if(preference != DEVICE_PREFERENCE_NONE)
+        devicePreferences.push_back(std::make_pair(preference, weight));
+}
+
+/**
+ * Returns the first preference, or DEVICE_PREFERENCE_NONE if there are none
+ */
 DevicePreference oul::DeviceCriteria::getDevicePreference() const {
-    return devicePreference;
+    if(devicePreferences.empty())
+        return DEVICE_PREFERENCE_NONE;
+    return devicePreferences[0].first;
+}
+
+const std::vector<WeightedDevicePreference>& oul::DeviceCriteria::getDevicePreferences() const {
+    return devicePreferences;
 }
 
 unsigned int oul::DeviceCriteria::getDeviceCountMaxCriteria() const {
@@ -69,3 +96,62 @@ bool oul::DeviceCriteria::hasCapabilityCriteria(DeviceCapability capability) con
     }
     return found;
 }
+
+void oul::DeviceCriteria::setMinimumLocalMemoryCriteria(size_t bytes) {
+    minimumLocalMemory = bytes;
+}
+
+void oul::DeviceCriteria::setMinimumMaxAllocationCriteria(size_t bytes) {
+    minimumMaxAllocation = bytes;
+}
+
+void oul::DeviceCriteria::setMinimumOpenCLVersionCriteria(unsigned int major, unsigned int minor) {
+    minimumOpenCLVersion = major*10 + minor;
+}
+
+size_t oul::DeviceCriteria::getMinimumLocalMemoryCriteria() const {
+    return minimumLocalMemory;
+}
+
+size_t oul::DeviceCriteria::getMinimumMaxAllocationCriteria() const {
+    return minimumMaxAllocation;
+}
+
+unsigned int oul::DeviceCriteria::getMinimumOpenCLVersionCriteria() const {
+    return minimumOpenCLVersion;
+}
+
+void oul::DeviceCriteria::setPartitionEqually(unsigned int computeUnitsPerSubDevice) {
+    partitioning = DEVICE_PARTITION_EQUALLY;
+    partitionComputeUnits = computeUnitsPerSubDevice;
+}
+
+void oul::DeviceCriteria::setPartitionByCounts(std::vector<unsigned int> computeUnitCounts) {
+    partitioning = DEVICE_PARTITION_BY_COUNTS;
+    partitionCounts = computeUnitCounts;
+}
+
+void oul::DeviceCriteria::setPartitionByAffinityDomain(DeviceAffinityDomain domain) {
+    partitioning = DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+    partitionAffinityDomain = domain;
+}
+
+void oul::DeviceCriteria::setNoPartitioning() {
+    partitioning = DEVICE_PARTITION_NONE;
+}
+
+DevicePartitioning oul::DeviceCriteria::getPartitioning() const {
+    return partitioning;
+}
+
+unsigned int oul::DeviceCriteria::getPartitionComputeUnits() const {
+    return partitionComputeUnits;
+}
+
+const std::vector<unsigned int>& oul::DeviceCriteria::getPartitionCounts() const {
+    return partitionCounts;
+}
+
+DeviceAffinityDomain oul::DeviceCriteria::getPartitionAffinityDomain() const {
+    return partitionAffinityDomain;
+}
@@ -2,6 +2,8 @@
 #define DEVICECRITERIA_HPP_
 
 #include <vector>
+#include <utility>
+#include <cstddef>
 
 namespace oul {
 
@@ -10,9 +12,15 @@ enum DeviceType {DEVICE_TYPE_ANY, DEVICE_TYPE_GPU, DEVICE_TYPE_CPU};
 
 enum DevicePlatform {DEVICE_PLATFORM_ANY, DEVICE_PLATFORM_AMD, DEVICE_PLATFORM_NVIDIA, DEVICE_PLATFORM_INTEL, DEVICE_PLATFORM_APPLE};
 
-enum DeviceCapability {DEVICE_CAPABILITY_OPENGL_INTEROP};
+enum DeviceCapability {DEVICE_CAPABILITY_OPENGL_INTEROP, DEVICE_CAPABILITY_IMAGES, DEVICE_CAPABILITY_3D_IMAGE_WRITES};
 
-enum DevicePreference {DEVICE_PREFERENCE_NONE, DEVICE_PREFERENCE_NOT_CONNECTED_TO_SCREEN, DEVICE_PREFERENCE_COMPUTE_UNITS, DEVICE_PREFERENCE_GLOBAL_MEMORY};
+enum DevicePreference {DEVICE_PREFERENCE_NONE, DEVICE_PREFERENCE_NOT_CONNECTED_TO_SCREEN, DEVICE_PREFERENCE_COMPUTE_UNITS, DEVICE_PREFERENCE_GLOBAL_MEMORY, DEVICE_PREFERENCE_MEASURED_THROUGHPUT};
+
+typedef std::pair<DevicePreference, double> WeightedDevicePreference;
+
+enum DevicePartitioning {DEVICE_PARTITION_NONE, DEVICE_PARTITION_EQUALLY, DEVICE_PARTITION_BY_COUNTS, DEVICE_PARTITION_BY_AFFINITY_DOMAIN};
+
+enum DeviceAffinityDomain {DEVICE_AFFINITY_NUMA, DEVICE_AFFINITY_L4_CACHE, DEVICE_AFFINITY_L3_CACHE, DEVICE_AFFINITY_L2_CACHE, DEVICE_AFFINITY_L1_CACHE, DEVICE_AFFINITY_NEXT_PARTITIONABLE};
 
 /**
  * Class used to set up a set of criteria for choosing devices
@@ -24,22 +32,49 @@ class DeviceCriteria {
         void setCapabilityCriteria(DeviceCapability capability);
         void setTypeCriteria(DeviceType typeCriteria);
         void setDevicePreference(DevicePreference preference);
+        void addDevicePreference(DevicePreference preference, double weight = 1.0);
         void setDeviceCountCriteria(unsigned int min, unsigned int max);
         void setDeviceCountCriteria(unsigned int count);
         const std::vector<DeviceCapability>& getCapabilityCriteria() const;
         DevicePlatform getPlatformCriteria() const;
         DeviceType getTypeCriteria() const;
         DevicePreference getDevicePreference() const;
+        const std::vector<WeightedDevicePreference>& getDevicePreferences() const;
         unsigned int getDeviceCountMinCriteria() const;
         unsigned int getDeviceCountMaxCriteria() const;
         bool hasCapabilityCriteria(DeviceCapability capability) const;
+
+        // Hard minimums, devices that don't satisfy them are never selected
+        void setMinimumLocalMemoryCriteria(size_t bytes);
+        void setMinimumMaxAllocationCriteria(size_t bytes);
+        void setMinimumOpenCLVersionCriteria(unsigned int major, unsigned int minor);
+        size_t getMinimumLocalMemoryCriteria() const;
+        size_t getMinimumMaxAllocationCriteria() const;
+        unsigned int getMinimumOpenCLVersionCriteria() const; // major*10 + minor
+
+        // Split the selected devices into sub-devices, with a queue each (requires OpenCL 1.2)
+        void setPartitionEqually(unsigned int computeUnitsPerSubDevice);
+        void setPartitionByCounts(std::vector<unsigned int> computeUnitCounts);
+        void setPartitionByAffinityDomain(DeviceAffinityDomain domain);
+        void setNoPartitioning();
+        DevicePartitioning getPartitioning() const;
+        unsigned int getPartitionComputeUnits() const;
+        const std::vector<unsigned int>& getPartitionCounts() const;
+        DeviceAffinityDomain getPartitionAffinityDomain() const;
     private:
         DevicePlatform platformCriteria;
         DeviceType typeCriteria; // Can only be one
-        DevicePreference devicePreference; // Currently only support one preference
+        std::vector<WeightedDevicePreference> devicePreferences; // Scores are normalized and weighted
         std::vector<DeviceCapability> capabilityCriteria; // If multiple capabilities are selected, all of them have to be true
         unsigned int deviceCountMin;
         unsigned int deviceCountMax;
+        size_t minimumLocalMemory;
+        size_t minimumMaxAllocation;
+        unsigned int minimumOpenCLVersion;
+        DevicePartitioning partitioning;
+        unsigned int partitionComputeUnits;
+        std::vector<unsigned int> partitionCounts;
+        DeviceAffinityDomain partitionAffinityDomain;
 
 };
 
@@ -0,0 +1,232 @@
+#include "DeviceDispatcher.hpp"
+
+#include <fstream>
+#include <algorithm>
+#include <boost/chrono.hpp>
+#include "HelperFunctions.hpp"
+#include "OpenCLManager.hpp"
+#include "DeviceProbe.hpp"
+#include "Exceptions.hpp"
+
+namespace oul {
+
+// Weight of a new measurement in the moving averages of the cost model
+static const double COST_MODEL_ALPHA = 0.3;
+
+DispatchJob::DispatchJob() :
+		bytesToDevice(0),
+		bytesFromDevice(0),
+		workItems(0)
+	{
+}
+
+DispatchJob::DispatchJob(std::string name, size_t bytesToDevice, size_t bytesFromDevice, double workItems) :
+		name(name),
+		bytesToDevice(bytesToDevice),
+		bytesFromDevice(bytesFromDevice),
+		workItems(workItems)
+	{
+}
+
+/**
+ * A HistogramPyramid3DBuffer build: one byte per voxel up, the top level down,
+ * and one work item per cell in every level below the base.
+ */
+DispatchJob DispatchJob::histogramPyramid3D(int sizeX, int sizeY, int sizeZ) {
+	double voxels = (double)sizeX*sizeY*sizeZ;
+	return DispatchJob("HistogramPyramid3D " + oul::number(sizeX) + "x" + oul::number(sizeY) + "x" + oul::number(sizeZ),
+			(size_t)voxels, sizeof(int)*8, voxels / 7.0);
+}
+
+DeviceCostModel::DeviceCostModel() :
+		launchLatency(0.05),
+		transferBandwidth(5.0e6),
+		throughput(1.0e6),
+		updates(0)
+	{
+}
+
+double DeviceCostModel::predict(const DispatchJob &job) const {
+	return launchLatency + getTransferTime(job) + job.workItems / throughput;
+}
+
+double DeviceCostModel::getTransferTime(const DispatchJob &job) const {
+	return (job.bytesToDevice + job.bytesFromDevice) / transferBandwidth;
+}
+
+/**
+ * Refines the model with the measured runtime of a job.
+ * Whatever is not explained by launch latency and transfers is attributed
+ * to the kernels. If not even that is left, the launch latency was too high.
+ */
+void DeviceCostModel::update(const DispatchJob &job, double runtime) {
+	double computeTime = runtime - launchLatency - getTransferTime(job);
+	if (job.workItems > 0 && computeTime > 0) {
+		throughput = (1.0 - COST_MODEL_ALPHA) * throughput + COST_MODEL_ALPHA * (job.workItems / computeTime);
+	} else {
+		double latency = std::max(runtime - getTransferTime(job) - job.workItems / throughput, 0.0);
+		launchLatency = (1.0 - COST_MODEL_ALPHA) * launchLatency + COST_MODEL_ALPHA * latency;
+	}
+	updates++;
+}
+
+void DeviceCostModel::setLaunchLatency(double ms) {
+	launchLatency = ms;
+}
+
+void DeviceCostModel::setTransferBandwidth(double bytesPerMs) {
+	transferBandwidth = bytesPerMs;
+}
+
+void DeviceCostModel::setThroughput(double workItemsPerMs) {
+	throughput = workItemsPerMs;
+}
+
+double DeviceCostModel::getLaunchLatency() const {
+	return launchLatency;
+}
+
+double DeviceCostModel::getTransferBandwidth() const {
+	return transferBandwidth;
+}
+
+double DeviceCostModel::getThroughput() const {
+	return throughput;
+}
+
+unsigned int DeviceCostModel::getNumberOfUpdates() const {
+	return updates;
+}
+
+DeviceDispatcher::DeviceDispatcher(const DeviceCriteria &criteria, bool calibrate) {
+	std::vector<PlatformDevices> platformDevices = opencl()->getDevices(criteria);
+	std::vector<cl::Device> devices;
+	for (unsigned int i = 0; i < platformDevices.size(); i++)
+		devices.insert(devices.end(), platformDevices[i].second.begin(), platformDevices[i].second.end());
+	setup(devices, calibrate);
+}
+
+DeviceDispatcher::DeviceDispatcher(std::vector<cl::Device> devices, bool calibrate) {
+	setup(devices, calibrate);
+}
+
+void DeviceDispatcher::setup(std::vector<cl::Device> devices, bool calibrate) {
+	if (devices.size() == 0)
+		throw NoValidPlatformsException();
+
+	for (unsigned int i = 0; i < devices.size(); i++) {
+		contexts.push_back(opencl()->createContext(devices[i]));
+		models.push_back(DeviceCostModel());
+	}
+	if (calibrate)
+		this->calibrate();
+}
+
+/**
+ * Measures launch latency, transfer bandwidth and kernel throughput on every device
+ * with a few small probes.
+ */
+void DeviceDispatcher::calibrate() {
+	for (unsigned int i = 0; i < contexts.size(); i++)
+		calibrate(i);
+}
+
+void DeviceDispatcher::calibrate(unsigned int device) {
+	Context &context = contexts[device];
+	DeviceProbeResult probe = probeDevice(context);
+
+	DeviceCostModel &model = models[device];
+	model.setLaunchLatency(probe.launchLatency);
+	model.setTransferBandwidth(probe.transferBandwidth);
+	model.setThroughput(probe.throughput);
+
+	reporter.report("Calibrated device " + context.getDevice(0).getInfo<CL_DEVICE_NAME>() +
+			": launch latency " + oul::number(model.getLaunchLatency()) + " ms, transfer " +
+			oul::number(model.getTransferBandwidth() * 1.0e-6) + " GB/s, " +
+			oul::number(model.getThroughput()) + " work items/ms", oul::INFO);
+}
+
+unsigned int DeviceDispatcher::selectDevice(const DispatchJob &job) {
+	unsigned int best = 0;
+	for (unsigned int i = 1; i < models.size(); i++) {
+		if (models[i].predict(job) < models[best].predict(job))
+			best = i;
+	}
+	return best;
+}
+
+/**
+ * Runs the job on the device with the lowest predicted completion time,
+ * measures how long it actually took and refines the cost model of that device.
+ * The function is given the context of the selected device. Work it leaves in the
+ * queues is waited for before the time is taken.
+ * Returns the index of the device the job was run on.
+ */
+unsigned int DeviceDispatcher::dispatch(const DispatchJob &job, DispatchFunction function) {
+	DispatchRecord record;
+	record.job = job;
+	for (unsigned int i = 0; i < models.size(); i++)
+		record.predictions.push_back(models[i].predict(job));
+	record.device = selectDevice(job);
+
+	Context &context = contexts[record.device];
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	function(context);
+	// Every dispatcher context has a single device, and thereby a single queue
+	{
+		BlockingCall blockingCall(context.getRunTimeMeasurementManager(), "finish", __FILE__, __LINE__);
+		context.getQueue(0).finish();
+	}
+	record.runtime = millisecondsSince(start);
+
+	models[record.device].update(job, record.runtime);
+	records.push_back(record);
+	reporter.report("Job " + job.name + " was dispatched to device " + oul::number(record.device) +
+			", predicted " + oul::number(record.predictions[record.device]) + " ms, took " +
+			oul::number(record.runtime) + " ms", oul::INFO);
+	return record.device;
+}
+
+unsigned int DeviceDispatcher::getNumberOfDevices() const {
+	return contexts.size();
+}
+
+Context DeviceDispatcher::getContext(unsigned int device) {
+	return contexts.at(device);
+}
+
+DeviceCostModel DeviceDispatcher::getCostModel(unsigned int device) const {
+	return models.at(device);
+}
+
+std::vector<DispatchRecord> DeviceDispatcher::getRecords() const {
+	return records;
+}
+
+/**
+ * Writes all dispatched jobs as CSV, with the predicted time on every device
+ * next to the measured time on the selected one.
+ */
+void DeviceDispatcher::exportRecords(std::string filename) const {
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		std::string msg = "Could not open file " + filename + " for writing";
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+
+	file << "job,bytes_to_device,bytes_from_device,work_items,device,predicted_ms,actual_ms";
+	for (unsigned int i = 0; i < models.size(); i++)
+		file << ",predicted_ms_device" << i;
+	file << std::endl;
+	for (unsigned int i = 0; i < records.size(); i++) {
+		const DispatchRecord &record = records[i];
+		file << "\"" << record.job.name << "\"," << record.job.bytesToDevice << "," << record.job.bytesFromDevice << ","
+				<< record.job.workItems << "," << record.device << "," << record.predictions[record.device] << ","
+				<< record.runtime;
+		for (unsigned int j = 0; j < record.predictions.size(); j++)
+			file << "," << record.predictions[j];
+		file << std::endl;
+	}
+}
+
+} //namespace oul
@@ -0,0 +1,110 @@
+#ifndef DEVICEDISPATCHER_HPP_
+#define DEVICEDISPATCHER_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <vector>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include "Context.hpp"
+#include "DeviceCriteria.hpp"
+#include "Reporter.hpp"
+
+namespace oul {
+
+/**
+ * The size of a job as seen by the cost model
+ */
+class DispatchJob {
+
+public:
+	DispatchJob();
+	DispatchJob(std::string name, size_t bytesToDevice, size_t bytesFromDevice, double workItems);
+	static DispatchJob histogramPyramid3D(int sizeX, int sizeY, int sizeZ);
+
+	std::string name;
+	size_t bytesToDevice;
+	size_t bytesFromDevice;
+	double workItems;
+};
+
+/**
+ * A simple online cost model for one device:
+ * predicted time = launch latency + bytes / transfer bandwidth + work items / throughput.
+ * Launch latency and bandwidth come from calibration, while the throughput
+ * is refined from every measured job with an exponential moving average.
+ */
+class DeviceCostModel {
+
+public:
+	DeviceCostModel();
+
+	double predict(const DispatchJob &job) const; // In ms
+	void update(const DispatchJob &job, double runtime);
+
+	void setLaunchLatency(double ms);
+	void setTransferBandwidth(double bytesPerMs);
+	void setThroughput(double workItemsPerMs);
+	double getLaunchLatency() const;
+	double getTransferBandwidth() const;
+	double getThroughput() const;
+	double getTransferTime(const DispatchJob &job) const; // In ms
+	unsigned int getNumberOfUpdates() const;
+
+private:
+	double launchLatency;
+	double transferBandwidth;
+	double throughput;
+	unsigned int updates;
+};
+
+/**
+ * A dispatched job with the predicted completion time on every device
+ * and the measured time on the device it was routed to.
+ */
+struct DispatchRecord {
+	DispatchJob job;
+	unsigned int device;
+	std::vector<double> predictions;
+	double runtime;
+};
+
+typedef boost::function<void (Context &context)> DispatchFunction;
+
+/**
+ * Routes each job to the device with the lowest predicted completion time.
+ * Small jobs usually end up on the host CPU device, where there is nothing to
+ * transfer, while large jobs are offloaded to a discrete device.
+ * Every device gets its own context.
+ */
+class DeviceDispatcher {
+
+public:
+	DeviceDispatcher(const DeviceCriteria &criteria, bool calibrate = true);
+	DeviceDispatcher(std::vector<cl::Device> devices, bool calibrate = true);
+
+	void calibrate(); //can throw cl::Error
+	unsigned int selectDevice(const DispatchJob &job);
+	unsigned int dispatch(const DispatchJob &job, DispatchFunction function); //can throw cl::Error
+
+	unsigned int getNumberOfDevices() const;
+	Context getContext(unsigned int device);
+	DeviceCostModel getCostModel(unsigned int device) const;
+	std::vector<DispatchRecord> getRecords() const;
+	void exportRecords(std::string filename) const; //can throw oul::Exception
+
+private:
+	void setup(std::vector<cl::Device> devices, bool calibrate);
+	void calibrate(unsigned int device);
+
+	Reporter reporter;
+	std::vector<Context> contexts;
+	std::vector<DeviceCostModel> models;
+	std::vector<DispatchRecord> records;
+};
+
+typedef boost::shared_ptr<class DeviceDispatcher> DeviceDispatcherPtr;
+
+} //namespace oul
+
+#endif /* DEVICEDISPATCHER_HPP_ */
@@ -0,0 +1,288 @@
+#include "DeviceInventory.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <boost/thread.hpp>
+#include <boost/functional/hash.hpp>
+#include "Exceptions.hpp"
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+namespace oul {
+
+DeviceInfo::DeviceInfo() :
+		type(0),
+		computeUnits(0),
+		globalMemory(0),
+		localMemory(0),
+		maxAllocation(0),
+		imageSupport(false)
+	{
+}
+
+DeviceInfo DeviceInfo::describe(const cl::Device &device) {
+	DeviceInfo info;
+	info.device = device;
+	info.name = device.getInfo<CL_DEVICE_NAME>();
+	info.vendor = device.getInfo<CL_DEVICE_VENDOR>();
+	info.version = device.getInfo<CL_DEVICE_VERSION>();
+	info.driverVersion = device.getInfo<CL_DRIVER_VERSION>();
+	info.extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+	info.type = device.getInfo<CL_DEVICE_TYPE>();
+	info.computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+	info.globalMemory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	info.localMemory = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	info.maxAllocation = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	info.imageSupport = device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+	return info;
+}
+
+/**
+ * Fetches the properties of one platform and all of its devices.
+ * Run in a thread of its own for each platform.
+ */
+class PlatformProbe {
+public:
+	PlatformProbe(PlatformInfo * info) : info(info) {
+	}
+	void operator()() {
+		try {
+			info->name = info->platform.getInfo<CL_PLATFORM_NAME>();
+			info->vendor = info->platform.getInfo<CL_PLATFORM_VENDOR>();
+			std::vector<cl::Device> devices;
+			info->platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+			for (unsigned int i = 0; i < devices.size(); i++)
+				info->devices.push_back(DeviceInfo::describe(devices[i]));
+		} catch (cl::Error &error) {
+			// A platform without any devices
+		}
+	}
+private:
+	PlatformInfo * info;
+};
+
+DeviceInventory::DeviceInventory() :
+		loadedFromCache(false)
+	{
+}
+
+/**
+ * Builds the inventory, or loads it from the cache file if it is still valid.
+ * An empty cache filename disables the cache.
+ */
+DeviceInventoryPtr DeviceInventory::create(std::string cacheFilename) {
+	boost::shared_ptr<DeviceInventory> inventory(new DeviceInventory());
+	if (cacheFilename != "" && inventory->load(cacheFilename)) {
+		inventory->reporter.report("Loaded the device inventory from " + cacheFilename, oul::INFO);
+		return inventory;
+	}
+
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	inventory->platforms.resize(platforms.size());
+	boost::thread_group threads;
+	for (unsigned int i = 0; i < platforms.size(); i++) {
+		inventory->platforms[i].platform = platforms[i];
+		threads.create_thread(PlatformProbe(&inventory->platforms[i]));
+	}
+	threads.join_all();
+
+	if (cacheFilename != "")
+		inventory->save(cacheFilename);
+	return inventory;
+}
+
+const std::vector<PlatformInfo> &DeviceInventory::getPlatforms() const {
+	return platforms;
+}
+
+std::vector<cl::Platform> DeviceInventory::getPlatformList() const {
+	std::vector<cl::Platform> list;
+	for (unsigned int i = 0; i < platforms.size(); i++)
+		list.push_back(platforms[i].platform);
+	return list;
+}
+
+/**
+ * Sub-devices are not part of the inventory, and are described on request.
+ */
+DeviceInfo DeviceInventory::getDeviceInfo(const cl::Device &device) const {
+	for (unsigned int i = 0; i < platforms.size(); i++) {
+		for (unsigned int j = 0; j < platforms[i].devices.size(); j++) {
+			if (platforms[i].devices[j].device() == device())
+				return platforms[i].devices[j];
+		}
+	}
+	return DeviceInfo::describe(device);
+}
+
+const PlatformInfo &DeviceInventory::getPlatformInfo(const cl::Platform &platform) const {
+	for (unsigned int i = 0; i < platforms.size(); i++) {
+		if (platforms[i].platform() == platform())
+			return platforms[i];
+	}
+	throw Exception("The platform is not in the device inventory", __LINE__, __FILE__);
+}
+
+bool DeviceInventory::wasLoadedFromCache() const {
+	return loadedFromCache;
+}
+
+/**
+ * A hash of the ICD files and the environment variables of the ICD loader.
+ * Installing, removing or updating a driver changes its ICD file, or at
+ * least its modification time. Returns an empty string, which disables the
+ * cache, where the ICDs can't be listed.
+ */
+std::string DeviceInventory::getICDFingerprint() {
+#if defined(_WIN32)
+	return "";
+#else
+	std::string directory = "/etc/OpenCL/vendors";
+	std::string fingerprint;
+	const char * vendors = std::getenv("OCL_ICD_VENDORS");
+	if (vendors != NULL) {
+		directory = vendors;
+		fingerprint += directory + ";";
+	}
+	const char * filenames = std::getenv("OCL_ICD_FILENAMES");
+	if (filenames != NULL)
+		fingerprint += std::string(filenames) + ";";
+
+	DIR * dir = opendir(directory.c_str());
+	if (dir == NULL)
+		return "";
+	std::vector<std::string> files;
+	struct dirent * entry;
+	while ((entry = readdir(dir)) != NULL) {
+		std::string file = entry->d_name;
+		if (file.size() > 4 && file.substr(file.size()-4) == ".icd")
+			files.push_back(file);
+	}
+	closedir(dir);
+	std::sort(files.begin(), files.end());
+
+	for (unsigned int i = 0; i < files.size(); i++) {
+		std::string path = directory + "/" + files[i];
+		struct stat status;
+		if (stat(path.c_str(), &status) != 0)
+			continue;
+		std::ifstream file(path.c_str());
+		std::string library;
+		std::getline(file, library);
+		fingerprint += files[i] + ":" + library + ":" + number((long)status.st_size) + ":" + number((long)status.st_mtime) + ";";
+	}
+	return number(boost::hash<std::string>()(fingerprint));
+#endif
+}
+
+/**
+ * The file has the fingerprint on the first line, then one tab separated
+ * line per platform followed by one line per device of that platform.
+ */
+void DeviceInventory::save(std::string filename) const {
+	std::string fingerprint = getICDFingerprint();
+	if (fingerprint == "")
+		return;
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		reporter.report("Could not write the device inventory to " + filename, oul::WARNING);
+		return;
+	}
+	file << fingerprint << std::endl;
+	for (unsigned int i = 0; i < platforms.size(); i++) {
+		const PlatformInfo &platform = platforms[i];
+		file << "platform\t" << platform.name << "\t" << platform.vendor << "\t" << platform.devices.size() << std::endl;
+		for (unsigned int j = 0; j < platform.devices.size(); j++) {
+			const DeviceInfo &device = platform.devices[j];
+			file << "device\t" << device.name << "\t" << device.vendor << "\t" << device.version << "\t" <<
+					device.driverVersion << "\t" << device.type << "\t" << device.computeUnits << "\t" <<
+					device.globalMemory << "\t" << device.localMemory << "\t" << device.maxAllocation << "\t" <<
+					device.imageSupport << "\t" << device.extensions << std::endl;
+		}
+	}
+}
+
+static std::vector<std::string> splitTabs(const std::string &line) {
+	std::vector<std::string> fields;
+	std::stringstream stream(line);
+	std::string field;
+	while (std::getline(stream, field, '\t'))
+		fields.push_back(field);
+	return fields;
+}
+
+template <class T>
+static T parse(const std::string &value) {
+	T result = 0;
+	std::istringstream stream(value);
+	stream >> result;
+	return result;
+}
+
+/**
+ * The platform and device handles are still fetched, but only as long as
+ * the platforms and device counts match the file are the properties reused.
+ */
+bool DeviceInventory::load(std::string filename) {
+	std::ifstream file(filename.c_str());
+	std::string line;
+	std::string fingerprint = getICDFingerprint();
+	if (!file.is_open() || fingerprint == "" || !std::getline(file, line) || line != fingerprint)
+		return false;
+
+	std::vector<cl::Platform> handles;
+	cl::Platform::get(&handles);
+	std::vector<PlatformInfo> cached;
+	while (std::getline(file, line)) {
+		std::vector<std::string> fields = splitTabs(line);
+		if (fields.size() == 4 && fields[0] == "platform") {
+			PlatformInfo platform;
+			platform.name = fields[1];
+			platform.vendor = fields[2];
+			cached.push_back(platform);
+		} else if (fields.size() >= 11 && fields[0] == "device" && cached.size() > 0) {
+			DeviceInfo device;
+			device.name = fields[1];
+			device.vendor = fields[2];
+			device.version = fields[3];
+			device.driverVersion = fields[4];
+			device.type = parse<cl_device_type>(fields[5]);
+			device.computeUnits = parse<cl_uint>(fields[6]);
+			device.globalMemory = parse<cl_ulong>(fields[7]);
+			device.localMemory = parse<cl_ulong>(fields[8]);
+			device.maxAllocation = parse<cl_ulong>(fields[9]);
+			device.imageSupport = parse<int>(fields[10]) != 0;
+			device.extensions = fields.size() > 11 ? fields[11] : "";
+			cached.back().devices.push_back(device);
+		} else {
+			return false;
+		}
+	}
+	if (cached.size() != handles.size())
+		return false;
+
+	for (unsigned int i = 0; i < handles.size(); i++) {
+		std::vector<cl::Device> devices;
+		try {
+			handles[i].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+		} catch (cl::Error &error) {
+			// A platform without any devices
+		}
+		if (devices.size() != cached[i].devices.size())
+			return false;
+		cached[i].platform = handles[i];
+		for (unsigned int j = 0; j < devices.size(); j++)
+			cached[i].devices[j].device = devices[j];
+	}
+	platforms = cached;
+	loadedFromCache = true;
+	return true;
+}
+
+} //namespace oul
@@ -0,0 +1,76 @@
+#ifndef DEVICEINVENTORY_HPP_
+#define DEVICEINVENTORY_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <vector>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include "Reporter.hpp"
+
+namespace oul {
+
+typedef boost::shared_ptr<const class DeviceInventory> DeviceInventoryPtr;
+
+/**
+ * The properties of a device that device selection looks at
+ */
+struct DeviceInfo {
+	DeviceInfo();
+	static DeviceInfo describe(const cl::Device &device); //can throw cl::Error
+
+	cl::Device device;
+	std::string name;
+	std::string vendor;
+	std::string version;
+	std::string driverVersion;
+	std::string extensions;
+	cl_device_type type;
+	cl_uint computeUnits;
+	cl_ulong globalMemory;
+	cl_ulong localMemory;
+	cl_ulong maxAllocation;
+	bool imageSupport;
+};
+
+struct PlatformInfo {
+	cl::Platform platform;
+	std::string name;
+	std::string vendor;
+	std::vector<DeviceInfo> devices;
+};
+
+/**
+ * An immutable snapshot of all platforms and devices, with their properties
+ * fetched once. Platforms are probed in parallel, since with several ICDs
+ * installed the probing dominates startup.
+ *
+ * The snapshot can be persisted to a file together with a fingerprint of
+ * the installed ICDs. As long as the fingerprint and the number of devices
+ * on each platform match, the properties are read from the file instead.
+ */
+class DeviceInventory {
+
+public:
+	static DeviceInventoryPtr create(std::string cacheFilename = ""); //can throw cl::Error
+
+	const std::vector<PlatformInfo> &getPlatforms() const;
+	std::vector<cl::Platform> getPlatformList() const;
+	DeviceInfo getDeviceInfo(const cl::Device &device) const; //can throw cl::Error
+	const PlatformInfo &getPlatformInfo(const cl::Platform &platform) const; //can throw oul::Exception
+	bool wasLoadedFromCache() const;
+
+	static std::string getICDFingerprint();
+
+private:
+	DeviceInventory();
+	bool load(std::string filename);
+	void save(std::string filename) const;
+
+	std::vector<PlatformInfo> platforms;
+	bool loadedFromCache;
+	mutable Reporter reporter;
+};
+
+} //namespace oul
+
+#endif /* DEVICEINVENTORY_HPP_ */
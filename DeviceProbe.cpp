@@ -0,0 +1,226 @@
+#include "DeviceProbe.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <boost/chrono.hpp>
+#include "HelperFunctions.hpp"
+
+namespace oul {
+
+static const char * PROBE_CODE =
+	"__kernel void oulProbeEmpty(__global float * data) {}\n"
+	"__kernel void oulProbeCopy(__global const float * in, __global float * out) {\n"
+	"    int i = get_global_id(0);\n"
+	"    out[i] = in[i];\n"
+	"}\n"
+	"__kernel void oulProbeWork(__global float * data) {\n"
+	"    int i = get_global_id(0);\n"
+	"    float v = data[i];\n"
+	"    for(int j = 0; j < 16; j++)\n"
+	"        v = v*1.0001f + 1.0f;\n"
+	"    data[i] = v;\n"
+	"}\n";
+
+DeviceProbeResult::DeviceProbeResult() :
+		launchLatency(0.05),
+		memoryBandwidth(1.0e7),
+		transferBandwidth(5.0e6),
+		throughput(1.0e6)
+	{
+}
+
+/**
+ * One launch per level, the base volume uploaded as bytes, about two bytes
+ * of device memory traffic per voxel and one work item per 7 voxels
+ * for all the levels above the base.
+ */
+double DeviceProbeResult::getHistogramPyramid3DTime(int size) const {
+	double voxels = (double)size*size*size;
+	double levels = std::max(std::log((double)size) / std::log(2.0), 1.0);
+	return levels * launchLatency + voxels / transferBandwidth + 2.0 * voxels / memoryBandwidth + voxels / 7.0 / throughput;
+}
+
+/**
+ * Higher is better. The inverse of the predicted time for a 256^3 pyramid,
+ * which is representative of the workloads the library is used for.
+ */
+double DeviceProbeResult::getScore() const {
+	return 1.0e6 / getHistogramPyramid3DTime(256);
+}
+
+// A multiply and an add in each of the 16 iterations of oulProbeWork
+static const double PROBE_WORK_OPERATIONS = 32.0;
+
+double DeviceProbeResult::getPeakOperations() const {
+	return throughput * PROBE_WORK_OPERATIONS;
+}
+
+/**
+ * Measures launch latency, device memory bandwidth, host transfer bandwidth
+ * and kernel throughput on the first device of the context.
+ * Takes in the order of a hundred milliseconds.
+ */
+DeviceProbeResult probeDevice(Context &context) {
+	if (!context.hasProgram("oul::DeviceProbe"))
+		context.createProgramFromStringWithName("oul::DeviceProbe", PROBE_CODE);
+	cl::Program program = context.getProgram("oul::DeviceProbe");
+	cl::CommandQueue queue = context.getQueue(0);
+	RuntimeMeasurementsManagerPtr runtimeManager = context.getRunTimeMeasurementManager();
+
+	const size_t elements = 1024*1024;
+	const size_t bytes = sizeof(float)*elements;
+	std::vector<float> data(elements, 1.0f);
+	cl::Buffer buffer(context.getContext(), CL_MEM_READ_WRITE, bytes);
+	cl::Buffer copy(context.getContext(), CL_MEM_READ_WRITE, bytes);
+	cl::Kernel emptyKernel(program, "oulProbeEmpty");
+	cl::Kernel copyKernel(program, "oulProbeCopy");
+	cl::Kernel workKernel(program, "oulProbeWork");
+	emptyKernel.setArg(0, buffer);
+	copyKernel.setArg(0, buffer);
+	copyKernel.setArg(1, copy);
+	workKernel.setArg(0, buffer);
+
+	// Warm up, so that lazy allocation and kernel compilation is not measured
+	queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, bytes, &data[0]);
+	queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(elements), cl::NullRange);
+	queue.enqueueNDRangeKernel(workKernel, cl::NullRange, cl::NDRange(elements), cl::NullRange);
+	{
+		BlockingCall blockingCall(runtimeManager, "finish", __FILE__, __LINE__);
+		queue.finish();
+	}
+
+	DeviceProbeResult result;
+	const int launches = 10;
+	boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+	for (int i = 0; i < launches; i++) {
+		queue.enqueueNDRangeKernel(emptyKernel, cl::NullRange, cl::NDRange(1), cl::NullRange);
+		BlockingCall blockingCall(runtimeManager, "finish", __FILE__, __LINE__);
+		queue.finish();
+	}
+	result.launchLatency = millisecondsSince(start) / launches;
+
+	start = boost::chrono::steady_clock::now();
+	queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, bytes, &data[0]);
+	queue.enqueueReadBuffer(buffer, CL_TRUE, 0, bytes, &data[0]);
+	result.transferBandwidth = 2.0*bytes / std::max(millisecondsSince(start), 1.0e-3);
+
+	start = boost::chrono::steady_clock::now();
+	for (int i = 0; i < launches; i++)
+		queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(elements), cl::NullRange);
+	{
+		BlockingCall blockingCall(runtimeManager, "finish", __FILE__, __LINE__);
+		queue.finish();
+	}
+	double copyTime = std::max(millisecondsSince(start) - launches*result.launchLatency, 1.0e-3);
+	result.memoryBandwidth = 2.0*bytes*launches / copyTime;
+
+	start = boost::chrono::steady_clock::now();
+	queue.enqueueNDRangeKernel(workKernel, cl::NullRange, cl::NDRange(elements), cl::NullRange);
+	{
+		BlockingCall blockingCall(runtimeManager, "finish", __FILE__, __LINE__);
+		queue.finish();
+	}
+	result.throughput = elements / std::max(millisecondsSince(start) - result.launchLatency, 1.0e-3);
+
+	return result;
+}
+
+DeviceProbeCache::DeviceProbeCache(std::string filename) :
+		filename(filename),
+		loaded(false)
+	{
+}
+
+std::string DeviceProbeCache::getDefaultFilename() {
+	const char * filename = std::getenv("OUL_DEVICE_PROBE_CACHE");
+	if (filename != NULL)
+		return filename;
+#if defined(_WIN32)
+	const char * home = std::getenv("USERPROFILE");
+#else
+	const char * home = std::getenv("HOME");
+#endif
+	if (home == NULL)
+		return "";
+	return std::string(home) + "/.oul_device_probes";
+}
+
+/**
+ * A new driver may change the performance of a device, so the driver version is part of the key.
+ */
+std::string DeviceProbeCache::getKey(const cl::Device &device) {
+	cl::Platform platform = device.getInfo<CL_DEVICE_PLATFORM>();
+	return device.getInfo<CL_DEVICE_NAME>() + "|" + platform.getInfo<CL_PLATFORM_NAME>() + "|" +
+			device.getInfo<CL_DEVICE_VERSION>() + "|" + device.getInfo<CL_DRIVER_VERSION>() + "|" +
+			number(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+}
+
+bool DeviceProbeCache::has(const cl::Device &device) {
+	load();
+	return results.count(getKey(device)) > 0;
+}
+
+/**
+ * Returns the cached result for the device, or probes it and stores the result.
+ */
+DeviceProbeResult DeviceProbeCache::get(const cl::Device &device) {
+	load();
+	std::string key = getKey(device);
+	if (results.count(key) > 0)
+		return results[key];
+
+	reporter.report("Probing the throughput of device " + device.getInfo<CL_DEVICE_NAME>(), oul::INFO);
+	std::vector<cl::Device> devices(1, device);
+	Context context(devices, NULL, false);
+	DeviceProbeResult result = probeDevice(context);
+	put(device, result);
+	return result;
+}
+
+void DeviceProbeCache::put(const cl::Device &device, DeviceProbeResult result) {
+	load();
+	results[getKey(device)] = result;
+	save();
+}
+
+/**
+ * Each line holds the four measurements followed by the key.
+ */
+void DeviceProbeCache::load() {
+	if (loaded)
+		return;
+	loaded = true;
+	if (filename == "")
+		return;
+	std::ifstream file(filename.c_str());
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream stream(line);
+		DeviceProbeResult result;
+		std::string key;
+		if (stream >> result.launchLatency >> result.memoryBandwidth >> result.transferBandwidth >> result.throughput &&
+				std::getline(stream >> std::ws, key))
+			results[key] = result;
+	}
+}
+
+void DeviceProbeCache::save() {
+	if (filename == "")
+		return;
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		reporter.report("Could not write the device probe cache " + filename, oul::WARNING);
+		return;
+	}
+	std::map<std::string, DeviceProbeResult>::iterator it;
+	for (it = results.begin(); it != results.end(); ++it) {
+		const DeviceProbeResult &result = it->second;
+		file << result.launchLatency << " " << result.memoryBandwidth << " " << result.transferBandwidth << " " <<
+				result.throughput << " " << it->first << std::endl;
+	}
+}
+
+} //namespace oul
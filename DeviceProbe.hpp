@@ -0,0 +1,62 @@
+#ifndef DEVICEPROBE_HPP_
+#define DEVICEPROBE_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <map>
+#include <string>
+#include "Context.hpp"
+#include "Reporter.hpp"
+
+namespace oul {
+
+/**
+ * Measured performance of a device, from a few short probe kernels
+ */
+class DeviceProbeResult {
+
+public:
+	DeviceProbeResult();
+
+	double launchLatency; // ms per empty kernel
+	double memoryBandwidth; // bytes/ms within device memory
+	double transferBandwidth; // bytes/ms between host and device
+	double throughput; // work items/ms for a short arithmetic loop
+
+	double getHistogramPyramid3DTime(int size) const; // Predicted ms to build and sum a size^3 pyramid
+	double getScore() const;
+	double getPeakOperations() const; // operations/ms for the arithmetic loop
+};
+
+DeviceProbeResult probeDevice(Context &context); //can throw cl::Error
+
+/**
+ * Probe results stored on disk, keyed by device, platform and driver version,
+ * so that the probes only run the first time a device is seen.
+ * The file is given by the environment variable OUL_DEVICE_PROBE_CACHE,
+ * or defaults to .oul_device_probes in the home directory.
+ */
+class DeviceProbeCache {
+
+public:
+	DeviceProbeCache(std::string filename = getDefaultFilename());
+
+	static std::string getDefaultFilename();
+	static std::string getKey(const cl::Device &device);
+
+	bool has(const cl::Device &device);
+	DeviceProbeResult get(const cl::Device &device); //can throw cl::Error
+	void put(const cl::Device &device, DeviceProbeResult result);
+
+private:
+	void load();
+	void save();
+
+	std::string filename;
+	bool loaded;
+	std::map<std::string, DeviceProbeResult> results;
+	Reporter reporter;
+};
+
+} //namespace oul
+
+#endif /* DEVICEPROBE_HPP_ */
@@ -0,0 +1,131 @@
+#include "EventExecutor.hpp"
+
+#include "Reporter.hpp"
+
+namespace oul {
+
+struct ScheduledContinuation {
+	EventExecutor * executor;
+	Continuation continuation;
+};
+
+EventExecutor::EventExecutor(RuntimeMeasurementsManagerPtr manager) :
+		outstanding(0),
+		manager(manager)
+	{
+}
+
+EventExecutor::~EventExecutor() {
+	// The OpenCL runtime still holds a pointer to this object for every
+	// scheduled event, so wait for those callbacks before going away
+	boost::unique_lock<boost::mutex> lock(mutex);
+	while (outstanding > 0)
+		readyCondition.wait(lock);
+}
+
+void EventExecutor::schedule(cl::Event event, Continuation continuation) {
+	ScheduledContinuation * scheduled = new ScheduledContinuation;
+	scheduled->executor = this;
+	scheduled->continuation = continuation;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		outstanding++;
+	}
+	try {
+		event.setCallback(CL_COMPLETE, eventCompleteCallback, static_cast<void*>(scheduled));
+	} catch (cl::Error &error) {
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			outstanding--;
+		}
+		delete scheduled;
+		Reporter r;
+		r.report("Could not register event callback. Reason: " + std::string(error.what()), oul::ERROR);
+		throw;
+	}
+}
+
+void EventExecutor::post(Continuation continuation) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	readyQueue.push_back(continuation);
+	readyCondition.notify_all();
+}
+
+/**
+ * Runs all continuations that are ready, without blocking.
+ * Returns the number of continuations that were run.
+ */
+unsigned int EventExecutor::poll() {
+	unsigned int count = 0;
+	while (true) {
+		Continuation continuation;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if (readyQueue.empty())
+				break;
+			continuation = readyQueue.front();
+			readyQueue.pop_front();
+		}
+		continuation();
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Blocks until one continuation is ready and runs it.
+ * Returns false without blocking if nothing is ready and no events are outstanding.
+ */
+bool EventExecutor::runOne() {
+	Continuation continuation;
+	{
+		boost::unique_lock<boost::mutex> lock(mutex);
+		while (readyQueue.empty()) {
+			if (outstanding == 0)
+				return false;
+			BlockingCall blockingCall(manager, "event wait", __FILE__, __LINE__);
+			readyCondition.wait(lock);
+		}
+		continuation = readyQueue.front();
+		readyQueue.pop_front();
+	}
+	continuation();
+	return true;
+}
+
+/**
+ * Runs continuations until no events are outstanding and nothing is ready.
+ * Continuations may schedule new events, which are also waited for.
+ */
+unsigned int EventExecutor::run() {
+	unsigned int count = 0;
+	while (runOne())
+		count++;
+	return count;
+}
+
+unsigned int EventExecutor::getOutstandingCount() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	return outstanding;
+}
+
+RuntimeMeasurementsManagerPtr EventExecutor::getRunTimeMeasurementManager() {
+	return manager;
+}
+
+void CL_CALLBACK EventExecutor::eventCompleteCallback(cl_event event, cl_int status, void * user_data) {
+	ScheduledContinuation * scheduled = static_cast<ScheduledContinuation*>(user_data);
+	scheduled->executor->complete(scheduled->continuation);
+	delete scheduled;
+}
+
+void EventExecutor::complete(Continuation continuation) {
+	// Called from an OpenCL runtime thread. Only hand the continuation over,
+	// never run user code here, since callbacks must not block the runtime.
+	boost::lock_guard<boost::mutex> lock(mutex);
+	readyQueue.push_back(continuation);
+	outstanding--;
+	readyCondition.notify_all();
+}
+
+} //namespace oul
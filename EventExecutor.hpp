@@ -0,0 +1,60 @@
+#ifndef EVENTEXECUTOR_HPP_
+#define EVENTEXECUTOR_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <deque>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "RuntimeMeasurementManager.hpp"
+
+namespace oul {
+
+typedef boost::function<void ()> Continuation;
+
+/**
+ * Runs continuations on the host thread when OpenCL events complete.
+ * Completion is signalled by clSetEventCallback from the OpenCL runtime,
+ * which only moves the continuation to a ready queue. The continuations
+ * themselves are run by whichever host thread calls poll(), runOne() or run(),
+ * so one host thread can drive many independent command chains without
+ * blocking on any single one of them.
+ * The time spent blocked in runOne(), run() and Command::wait() is recorded
+ * as a blocking call in the given manager, which may be empty.
+ */
+class EventExecutor {
+
+public:
+	EventExecutor(RuntimeMeasurementsManagerPtr manager = RuntimeMeasurementsManagerPtr());
+	~EventExecutor();
+
+	void schedule(cl::Event event, Continuation continuation); //can throw cl::Error
+	void post(Continuation continuation);
+
+	unsigned int poll();
+	bool runOne();
+	unsigned int run();
+
+	unsigned int getOutstandingCount();
+	RuntimeMeasurementsManagerPtr getRunTimeMeasurementManager();
+
+private:
+	EventExecutor(const EventExecutor &other);
+	EventExecutor &operator=(const EventExecutor &other);
+
+	static void CL_CALLBACK eventCompleteCallback(cl_event event, cl_int status, void * user_data);
+	void complete(Continuation continuation);
+
+	boost::mutex mutex;
+	boost::condition_variable readyCondition;
+	std::deque<Continuation> readyQueue;
+	unsigned int outstanding;
+	RuntimeMeasurementsManagerPtr manager;
+};
+
+typedef boost::shared_ptr<class EventExecutor> EventExecutorPtr;
+
+} //namespace oul
+
+#endif /* EVENTEXECUTOR_HPP_ */
@@ -2,6 +2,7 @@
 #define EXCEPTIONS_HPP
 #include <exception>
 #include <cstdio>
+#include <string>
 namespace oul {
 
 class Exception : public std::exception {
@@ -26,13 +27,15 @@ class Exception : public std::exception {
             this->line = line;
             this->file = file;
         };
+        virtual ~Exception() throw() {};
         virtual const char * what() const throw() {
-            char * string = new char[255];
             if(line > -1) {
-                sprintf(string, "%s \nException thrown at line %d in file %s", message, line, file);
-                return string;
+                char lineString[16];
+                sprintf(lineString, "%d", line);
+                whatMessage = message + " \nException thrown at line " + lineString + " in file " + file;
+                return whatMessage.c_str();
             } else {
-                return message;
+                return message.c_str();
             }
         };
         void setLine(int line) {
@@ -45,9 +48,11 @@ class Exception : public std::exception {
             this->message = message;
         };
     private:
+        // Copies are kept, since messages are often built in temporary strings
         int line;
-        const char * file;
-        const char * message;
+        std::string file;
+        std::string message;
+        mutable std::string whatMessage;
 };
 
 class NoPlatformsInstalledException : public Exception {
@@ -190,4 +190,9 @@ std::string readFile(std::string filename) {
 
     return retval;
 }
+
+double millisecondsSince(boost::chrono::steady_clock::time_point start) {
+    boost::chrono::duration<double, boost::milli> elapsed = boost::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
 } //namespace oul
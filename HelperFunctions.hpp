@@ -2,6 +2,7 @@
 #define HELPER_FUNCTIONS_HPP
 
 #include <string>
+#include <boost/chrono.hpp>
 #include "CL/OpenCL.hpp"
 
 /*
@@ -16,6 +17,8 @@ std::string getCLErrorString(cl_int err);
 
 std::string readFile(std::string filename);
 
+double millisecondsSince(boost::chrono::steady_clock::time_point start);
+
 cl_context_properties * createInteropContextProperties(
         const cl::Platform &platform,
         cl_context_properties OpenGLContext,
@@ -20,22 +20,173 @@ void HistogramPyramid::compileCode(oul::Context &context) {
 HistogramPyramid2D::HistogramPyramid2D(oul::Context &context) {
     compileCode(context);
     this->context = context;
+    this->queue = context.getQueue(0);
 }
 HistogramPyramid3D::HistogramPyramid3D(oul::Context &context) {
     // TODO : check if device in context support writing to 3D images
     compileCode(context);
     this->context = context;
+    this->queue = context.getQueue(0);
 }
 HistogramPyramid3DBuffer::HistogramPyramid3DBuffer(oul::Context &context) {
     compileCode(context);
     this->context = context;
+    this->queue = context.getQueue(0);
+}
+
+HistogramPyramid::HistogramPyramid() : queueSelected(false), size(0), sum(0), sumPending(false), sumElements(0),
+        sumReadback(new std::vector<unsigned int>(8, 0)) {
+}
+
+/**
+ * The runtime may still be writing the sum to sumReadback
+ */
+HistogramPyramid::~HistogramPyramid() {
+    if(sumPending) {
+        try {
+            sumEvent.wait();
+        } catch(cl::Error &error) {
+        }
+    }
 }
 
 int HistogramPyramid::getSum() {
+    if(sumPending) {
+        {
+            BlockingCall blockingCall(context.getRunTimeMeasurementManager(), "sum readback", __FILE__, __LINE__);
+            sumEvent.wait();
+        }
+        sum = 0;
+        for(int i = 0; i < sumElements; i++)
+            sum += (*sumReadback)[i];
+        sumPending = false;
+    }
     return this->sum;
 }
 
+/**
+ * Selects the command queue that construction and traversal are enqueued on.
+ * By default the first queue of the context is used.
+ */
+void HistogramPyramid::setQueue(cl::CommandQueue queue) {
+    this->queue = queue;
+    queueSelected = true;
+}
+
+/**
+ * Fetches the first queue of the context again unless a queue was selected,
+ * so that a construction is profiled if profiling has been enabled since.
+ */
+void HistogramPyramid::updateQueue() {
+    if(!queueSelected)
+        queue = context.getQueue(0);
+}
+
+/**
+ * Bytes per element of a level. The base level is assumed to hold a byte per
+ * pixel, the 3D buffer levels above it use char, three times short and then
+ * int, and the image levels use two of each of uint8 and uint16 and then uint32.
+ */
+static double getLevelElementSize(int level, bool buffer) {
+    if(level == 0)
+        return 1;
+    if(buffer)
+        return level == 1 ? 1 : (level <= 4 ? 2 : 4);
+    return level <= 2 ? 1 : (level <= 4 ? 2 : 4);
+}
+
+/**
+ * Every work item sums the children of one element of the level above
+ */
+static KernelWork getConstructionWork(double workItems, int children, int level, bool buffer) {
+    return KernelWork(
+            workItems*children*getLevelElementSize(level, buffer),
+            workItems*getLevelElementSize(level+1, buffer),
+            workItems*(children-1));
+}
+
+/**
+ * Every work item reads and compares the children on each level on the way
+ * down, and writes one position
+ */
+static KernelWork getTraversalWork(double workItems, int levels, int children, int dimensions, bool buffer) {
+    double bytesRead = 0;
+    for(int level = 0; level < levels; level++)
+        bytesRead += children*getLevelElementSize(level, buffer);
+    return KernelWork(
+            workItems*bytesRead,
+            workItems*dimensions*sizeof(int),
+            workItems*levels*children*2);
+}
+
+/**
+ * Enqueues a kernel, and traces and times it if that is enabled.
+ * The work places instrumented launches on the roofline.
+ */
+void HistogramPyramid::enqueueKernel(cl::Kernel &kernel, cl::NDRange global, cl::NDRange local, KernelWork work) {
+    RuntimeMeasurementsManagerPtr runtimeManager = context.getRunTimeMeasurementManager();
+    if(!runtimeManager->isEnabled()) {
+        queue.enqueueNDRangeKernel(kernel, NullRange, global, local);
+        return;
+    }
+    context.recordKernelLaunch(kernel, global, local, queue);
+    if(!runtimeManager->isTracing() && !runtimeManager->isInstrumentingKernels()) {
+        queue.enqueueNDRangeKernel(kernel, NullRange, global, local);
+        return;
+    }
+    cl::Event event;
+    queue.enqueueNDRangeKernel(kernel, NullRange, global, local, NULL, &event);
+    if(runtimeManager->isTracing())
+        runtimeManager->traceCLCommand(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), "kernel", event, queue);
+    if(runtimeManager->isInstrumentingKernels())
+        runtimeManager->instrumentKernel(kernel, global, event, work);
+}
+
+/**
+ * Whether the levels of the last construction can be reused, which they can
+ * if they exist and the size is the same. A construction that is still
+ * pending on another queue is waited for, since the new one would otherwise
+ * race with it for the levels and the sum readback.
+ */
+bool HistogramPyramid::keepLevels(int previousSize, unsigned int levels) {
+    if(sumPending && sumEvent.getInfo<CL_EVENT_COMMAND_QUEUE>()() != queue())
+        getSum();
+    return levels > 0 && size == previousSize;
+}
+
+/**
+ * Host memory for the next sum readback. Memory that is shared with a copy
+ * is left to the copy.
+ */
+unsigned int * HistogramPyramid::getSumReadback() {
+    if(!sumReadback.unique())
+        sumReadback.reset(new std::vector<unsigned int>(8, 0));
+    return &(*sumReadback)[0];
+}
+
+Command HistogramPyramid::setPendingSum(cl::Event readEvent, int elements) {
+    sumEvent = readEvent;
+    sumElements = elements;
+    sumPending = true;
+    RuntimeMeasurementsManagerPtr runtimeManager = context.getRunTimeMeasurementManager();
+    if(runtimeManager->isTracing())
+        runtimeManager->traceCLCommand("sum readback", "transfer", readEvent, queue, sizeof(unsigned int)*elements);
+    runtimeManager->recordTransfer(TRANSFER_DEVICE_TO_HOST, sizeof(unsigned int)*elements, queue, "oul::HistogramPyramid sum", readEvent);
+    return Command(readEvent, context.getExecutor());
+}
+
 void HistogramPyramid3D::create(Image3D &baseLevel, int sizeX, int sizeY, int sizeZ) {
+    createAsync(baseLevel, sizeX, sizeY, sizeZ);
+    getSum();
+}
+
+/**
+ * Enqueues the construction and a non-blocking readback of the total sum.
+ * getSum() waits for the readback, so it is only blocking if called before the returned Command has completed.
+ */
+Command HistogramPyramid3D::createAsync(Image3D &baseLevel, int sizeX, int sizeY, int sizeZ) {
+    updateQueue();
+    int previousSize = size;
     // Make baseLevel into power of 2 in all dimensions
     if(sizeX == sizeY && sizeY == sizeZ && log2(sizeX) == round(log2(sizeX))) {
         size = sizeX;
@@ -49,69 +200,68 @@ void HistogramPyramid3D::create(Image3D &baseLevel, int sizeX, int sizeY, int si
     }
     std::cout << "3D HP size: " << size << std::endl;
 
-    // Create all levels
-    HPlevels.push_back(baseLevel);
-    int levelSize = size / 2;
-    HPlevels.push_back(Image3D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT8),
-                levelSize, levelSize, levelSize
-    ));
-    levelSize /= 2;
-    HPlevels.push_back(Image3D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT8),
-                levelSize, levelSize, levelSize
-    ));
-    levelSize /= 2;
-    // 16 bit
-    HPlevels.push_back(Image3D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT16),
-                levelSize, levelSize, levelSize
-    ));
-    levelSize /= 2;
-    HPlevels.push_back(Image3D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT16),
-                levelSize, levelSize, levelSize
-    ));
-    levelSize /= 2;
-
-    // The rest will use 32 bit
-    for(int i = 5; i < log2(size); i++) {
+    // Create all levels, or reuse those of the last construction
+    if(keepLevels(previousSize, HPlevels.size())) {
+        HPlevels[0] = baseLevel;
+    } else {
+        HPlevels.clear();
+        HPlevels.push_back(baseLevel);
+        int levelSize = size / 2;
+        HPlevels.push_back(Image3D(
+                    context.getContext(),
+                    CL_MEM_READ_WRITE,
+                    ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                    levelSize, levelSize, levelSize
+        ));
+        levelSize /= 2;
         HPlevels.push_back(Image3D(
                     context.getContext(),
                     CL_MEM_READ_WRITE,
-                    ImageFormat(CL_R, CL_UNSIGNED_INT32),
+                    ImageFormat(CL_R, CL_UNSIGNED_INT8),
                     levelSize, levelSize, levelSize
         ));
         levelSize /= 2;
+        // 16 bit
+        HPlevels.push_back(Image3D(
+                    context.getContext(),
+                    CL_MEM_READ_WRITE,
+                    ImageFormat(CL_R, CL_UNSIGNED_INT16),
+                    levelSize, levelSize, levelSize
+        ));
+        levelSize /= 2;
+        HPlevels.push_back(Image3D(
+                    context.getContext(),
+                    CL_MEM_READ_WRITE,
+                    ImageFormat(CL_R, CL_UNSIGNED_INT16),
+                    levelSize, levelSize, levelSize
+        ));
+        levelSize /= 2;
+
+        // The rest will use 32 bit
+        for(int i = 5; i < log2(size); i++) {
+            HPlevels.push_back(Image3D(
+                        context.getContext(),
+                        CL_MEM_READ_WRITE,
+                        ImageFormat(CL_R, CL_UNSIGNED_INT32),
+                        levelSize, levelSize, levelSize
+            ));
+            levelSize /= 2;
+        }
     }
 
     // Do construction iterations
     cl::Program program = context.getProgram("oul::HistogramPyramids");
-    cl::CommandQueue queue = context.getQueue(0);
     Kernel constructHPLevelKernel(program, "constructHPLevel3D");
-    levelSize = size;
+    int levelSize = size;
     for(int i = 0; i < log2((float)size)-1; i++) {
         constructHPLevelKernel.setArg(0, HPlevels[i]);
         constructHPLevelKernel.setArg(1, HPlevels[i+1]);
         levelSize /= 2;
-        queue.enqueueNDRangeKernel(
-            constructHPLevelKernel,
-            NullRange,
-            NDRange(levelSize, levelSize, levelSize),
-            NullRange
-        );
+        enqueueKernel(constructHPLevelKernel, NDRange(levelSize, levelSize, levelSize), NullRange,
+                getConstructionWork((double)levelSize*levelSize*levelSize, 8, i, false));
     }
 
-    // Get total sum and return it
-    int * sum = new int[8];
+    // Get total sum
     cl::size_t<3> offset;
     offset[0] = 0;
     offset[1] = 0;
@@ -120,13 +270,20 @@ void HistogramPyramid3D::create(Image3D &baseLevel, int sizeX, int sizeY, int si
     region[0] = 2;
     region[1] = 2;
     region[2] = 2;
-    queue.enqueueReadImage(HPlevels[HPlevels.size()-1], CL_TRUE, offset, region, 0, 0, sum);
-    //for(int i = 0; i < 8; i++)
-    //std::cout << sum[i] << std::endl;
-    this->sum = sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
+    cl::Event readEvent;
+    queue.enqueueReadImage(HPlevels[HPlevels.size()-1], CL_FALSE, offset, region, 0, 0, getSumReadback(), NULL, &readEvent);
+    queue.flush();
+    return setPendingSum(readEvent, 8);
 }
 
 void HistogramPyramid3DBuffer::create(Buffer &baseLevel, int sizeX, int sizeY, int sizeZ) {
+    createAsync(baseLevel, sizeX, sizeY, sizeZ);
+    getSum();
+}
+
+Command HistogramPyramid3DBuffer::createAsync(Buffer &baseLevel, int sizeX, int sizeY, int sizeZ) {
+    updateQueue();
+    int previousSize = size;
     this->sizeX = sizeX;
     this->sizeY = sizeY;
     this->sizeZ = sizeZ;
@@ -144,21 +301,27 @@ void HistogramPyramid3DBuffer::create(Buffer &baseLevel, int sizeX, int sizeY, i
     std::cout << "3D HP size: " << size << std::endl;
 
 
-    // Create all levels
-    HPlevels.push_back(baseLevel);
-    int levelSize = size*size*size / 8;
-    HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(char)*levelSize));
-    levelSize /= 8;
-    HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(short)*levelSize));
-    levelSize /= 8;
-    HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(short)*levelSize));
-    levelSize /= 8;
-    HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(short)*levelSize));
-    levelSize /= 8;
-    for(int i = 5; i < (log2((float)size)); i ++) {
-        HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(int)*levelSize));
+    // Create all levels, or reuse those of the last construction
+    if(keepLevels(previousSize, HPlevels.size())) {
+        HPlevels[0] = baseLevel;
+    } else {
+        HPlevels.clear();
+        HPlevels.push_back(baseLevel);
+        int levelSize = size*size*size / 8;
+        HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(char)*levelSize));
+        levelSize /= 8;
+        HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(short)*levelSize));
+        levelSize /= 8;
+        HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(short)*levelSize));
         levelSize /= 8;
+        HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(short)*levelSize));
+        levelSize /= 8;
+        for(int i = 5; i < (log2((float)size)); i ++) {
+            HPlevels.push_back(Buffer(context.getContext(), CL_MEM_READ_WRITE, sizeof(int)*levelSize));
+            levelSize /= 8;
+        }
     }
+
     cl::Program program = context.getProgram("oul::HistogramPyramids");
     Kernel constructHPLevelCharCharKernel = Kernel(program, "constructHPLevelCharChar");
     Kernel constructHPLevelCharShortKernel = Kernel(program, "constructHPLevelCharShort");
@@ -173,61 +336,40 @@ void HistogramPyramid3DBuffer::create(Buffer &baseLevel, int sizeX, int sizeY, i
     constructHPLevelCharCharKernel.setArg(3, sizeY);
     constructHPLevelCharCharKernel.setArg(4, sizeZ);
 
-    cl::CommandQueue queue = context.getQueue(0);
-    queue.enqueueNDRangeKernel(
-        constructHPLevelCharCharKernel,
-        NullRange,
-        NDRange(size/2, size/2, size/2),
-        NullRange
-    );
+    enqueueKernel(constructHPLevelCharCharKernel, NDRange(size/2, size/2, size/2), NullRange,
+            getConstructionWork(pow(size/2.0, 3), 8, 0, true));
 
     int previous = size / 2;
 
     constructHPLevelCharShortKernel.setArg(0, HPlevels[1]);
     constructHPLevelCharShortKernel.setArg(1, HPlevels[2]);
 
-    queue.enqueueNDRangeKernel(
-        constructHPLevelCharShortKernel,
-        NullRange,
-        NDRange(previous/2, previous/2, previous/2),
-        NullRange
-    );
+    enqueueKernel(constructHPLevelCharShortKernel, NDRange(previous/2, previous/2, previous/2), NullRange,
+            getConstructionWork(pow(previous/2.0, 3), 8, 1, true));
 
     previous /= 2;
 
     constructHPLevelShortShortKernel.setArg(0, HPlevels[2]);
     constructHPLevelShortShortKernel.setArg(1, HPlevels[3]);
 
-    queue.enqueueNDRangeKernel(
-        constructHPLevelShortShortKernel,
-        NullRange,
-        NDRange(previous/2, previous/2, previous/2),
-        NullRange
-    );
+    enqueueKernel(constructHPLevelShortShortKernel, NDRange(previous/2, previous/2, previous/2), NullRange,
+            getConstructionWork(pow(previous/2.0, 3), 8, 2, true));
 
     previous /= 2;
 
     constructHPLevelShortShortKernel.setArg(0, HPlevels[3]);
     constructHPLevelShortShortKernel.setArg(1, HPlevels[4]);
 
-    queue.enqueueNDRangeKernel(
-        constructHPLevelShortShortKernel,
-        NullRange,
-        NDRange(previous/2, previous/2, previous/2),
-        NullRange
-    );
+    enqueueKernel(constructHPLevelShortShortKernel, NDRange(previous/2, previous/2, previous/2), NullRange,
+            getConstructionWork(pow(previous/2.0, 3), 8, 3, true));
 
     previous /= 2;
 
     constructHPLevelShortIntKernel.setArg(0, HPlevels[4]);
     constructHPLevelShortIntKernel.setArg(1, HPlevels[5]);
 
-    queue.enqueueNDRangeKernel(
-        constructHPLevelShortIntKernel,
-        NullRange,
-        NDRange(previous/2, previous/2, previous/2),
-        NullRange
-    );
+    enqueueKernel(constructHPLevelShortIntKernel, NDRange(previous/2, previous/2, previous/2), NullRange,
+            getConstructionWork(pow(previous/2.0, 3), 8, 4, true));
 
     previous /= 2;
 
@@ -236,20 +378,24 @@ void HistogramPyramid3DBuffer::create(Buffer &baseLevel, int sizeX, int sizeY, i
         constructHPLevelKernel.setArg(0, HPlevels[i]);
         constructHPLevelKernel.setArg(1, HPlevels[i+1]);
         previous /= 2;
-        queue.enqueueNDRangeKernel(
-            constructHPLevelKernel,
-            NullRange,
-            NDRange(previous, previous, previous),
-            NullRange
-        );
+        enqueueKernel(constructHPLevelKernel, NDRange(previous, previous, previous), NullRange,
+                getConstructionWork(pow((double)previous, 3), 8, i, true));
     }
 
-    int * sum = new int[8];
-    queue.enqueueReadBuffer(HPlevels[HPlevels.size()-1], CL_TRUE, 0, sizeof(int)*8, sum);
-    this->sum = sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] + sum[7];
+    cl::Event readEvent;
+    queue.enqueueReadBuffer(HPlevels[HPlevels.size()-1], CL_FALSE, 0, sizeof(int)*8, getSumReadback(), NULL, &readEvent);
+    queue.flush();
+    return setPendingSum(readEvent, 8);
 }
 
 void HistogramPyramid2D::create(Image2D &baseLevel, int sizeX, int sizeY) {
+    createAsync(baseLevel, sizeX, sizeY);
+    getSum();
+}
+
+Command HistogramPyramid2D::createAsync(Image2D &baseLevel, int sizeX, int sizeY) {
+    updateQueue();
+    int previousSize = size;
     // Make baseLevel into power of 2 in all dimensions
     if(sizeX == sizeY && log2(sizeX) == round(log2(sizeX))) {
         size = sizeX;
@@ -263,69 +409,68 @@ void HistogramPyramid2D::create(Image2D &baseLevel, int sizeX, int sizeY) {
     }
     std::cout << "2D HP size: " << size << std::endl;
 
-    // Create all levels
-    HPlevels.push_back(baseLevel);
-    int levelSize = size / 2;
-    HPlevels.push_back(Image2D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT8),
-                levelSize, levelSize
-    ));
-    levelSize /= 2;
-    HPlevels.push_back(Image2D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT8),
-                levelSize, levelSize
-    ));
-    levelSize /= 2;
-    // 16 bit
-    HPlevels.push_back(Image2D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT16),
-                levelSize, levelSize
-    ));
-    levelSize /= 2;
-    HPlevels.push_back(Image2D(
-                context.getContext(),
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, CL_UNSIGNED_INT16),
-                levelSize, levelSize
-    ));
-    levelSize /= 2;
-
-    // The rest will use 32 bit
-    for(int i = 5; i < log2(size); i++) {
+    // Create all levels, or reuse those of the last construction
+    if(keepLevels(previousSize, HPlevels.size())) {
+        HPlevels[0] = baseLevel;
+    } else {
+        HPlevels.clear();
+        HPlevels.push_back(baseLevel);
+        int levelSize = size / 2;
         HPlevels.push_back(Image2D(
                     context.getContext(),
                     CL_MEM_READ_WRITE,
-                    ImageFormat(CL_R, CL_UNSIGNED_INT32),
+                    ImageFormat(CL_R, CL_UNSIGNED_INT8),
                     levelSize, levelSize
         ));
         levelSize /= 2;
+        HPlevels.push_back(Image2D(
+                    context.getContext(),
+                    CL_MEM_READ_WRITE,
+                    ImageFormat(CL_R, CL_UNSIGNED_INT8),
+                    levelSize, levelSize
+        ));
+        levelSize /= 2;
+        // 16 bit
+        HPlevels.push_back(Image2D(
+                    context.getContext(),
+                    CL_MEM_READ_WRITE,
+                    ImageFormat(CL_R, CL_UNSIGNED_INT16),
+                    levelSize, levelSize
+        ));
+        levelSize /= 2;
+        HPlevels.push_back(Image2D(
+                    context.getContext(),
+                    CL_MEM_READ_WRITE,
+                    ImageFormat(CL_R, CL_UNSIGNED_INT16),
+                    levelSize, levelSize
+        ));
+        levelSize /= 2;
+
+        // The rest will use 32 bit
+        for(int i = 5; i < log2(size); i++) {
+            HPlevels.push_back(Image2D(
+                        context.getContext(),
+                        CL_MEM_READ_WRITE,
+                        ImageFormat(CL_R, CL_UNSIGNED_INT32),
+                        levelSize, levelSize
+            ));
+            levelSize /= 2;
+        }
     }
 
     // Do construction iterations
     cl::Program program = context.getProgram("oul::HistogramPyramids");
-    cl::CommandQueue queue = context.getQueue(0);
     Kernel constructHPLevelKernel(program, "constructHPLevel2D");
-    levelSize = size;
+    int levelSize = size;
     for(int i = 0; i < log2((float)size)-1; i++) {
         constructHPLevelKernel.setArg(0, HPlevels[i]);
         constructHPLevelKernel.setArg(1, HPlevels[i+1]);
         levelSize /= 2;
-        queue.enqueueNDRangeKernel(
-            constructHPLevelKernel,
-            NullRange,
-            NDRange(levelSize, levelSize),
-            NullRange
-        );
+        enqueueKernel(constructHPLevelKernel, NDRange(levelSize, levelSize), NullRange,
+                getConstructionWork((double)levelSize*levelSize, 4, i, false));
     }
 
-    // Get total sum and return it
-    unsigned int * sum = new unsigned int[4];
+    // Get total sum
     cl::size_t<3> offset;
     offset[0] = 0;
     offset[1] = 0;
@@ -334,8 +479,10 @@ void HistogramPyramid2D::create(Image2D &baseLevel, int sizeX, int sizeY) {
     region[0] = 2;
     region[1] = 2;
     region[2] = 1;
-    queue.enqueueReadImage(HPlevels[HPlevels.size()-1], CL_TRUE, offset, region, 0, 0, sum);
-    this->sum = sum[0] + sum[1] + sum[2] + sum[3];
+    cl::Event readEvent;
+    queue.enqueueReadImage(HPlevels[HPlevels.size()-1], CL_FALSE, offset, region, 0, 0, getSumReadback(), NULL, &readEvent);
+    queue.flush();
+    return setPendingSum(readEvent, 4);
 }
 
 void HistogramPyramid2D::traverse(Kernel &kernel, int arguments) {
@@ -347,13 +494,15 @@ void HistogramPyramid2D::traverse(Kernel &kernel, int arguments) {
         kernel.setArg(i+arguments, HPlevels[l]);
     }
 
+    int sum = getSum();
     int global_work_size = sum + 64 - (sum - 64*(sum / 64));
-    context.getQueue(0).enqueueNDRangeKernel(kernel, NullRange, NDRange(global_work_size), NDRange(64));
+    enqueueKernel(kernel, NDRange(global_work_size), NDRange(64),
+            getTraversalWork(global_work_size, HPlevels.size(), 4, 2, false));
 }
 
 void HistogramPyramid3D::traverse(Kernel &kernel, int arguments) {
     kernel.setArg(arguments, this->size);
-    kernel.setArg(arguments+1, this->sum);
+    kernel.setArg(arguments+1, getSum());
     for(int i = 0; i < 10; i++) {
         int l = i;
         if(i >= HPlevels.size())
@@ -362,13 +511,15 @@ void HistogramPyramid3D::traverse(Kernel &kernel, int arguments) {
         kernel.setArg(i+arguments+2, HPlevels[l]);
     }
 
+    int sum = getSum();
     int global_work_size = sum + 64 - (sum - 64*(sum / 64));
-    context.getQueue(0).enqueueNDRangeKernel(kernel, NullRange, NDRange(global_work_size), NDRange(64));
+    enqueueKernel(kernel, NDRange(global_work_size), NDRange(64),
+            getTraversalWork(global_work_size, HPlevels.size(), 8, 3, false));
 }
 
 void HistogramPyramid3DBuffer::traverse(Kernel &kernel, int arguments) {
     kernel.setArg(arguments, this->size);
-    kernel.setArg(arguments+1, this->sum);
+    kernel.setArg(arguments+1, getSum());
     for(int i = 0; i < 10; i++) {
         int l = i;
         if(i >= HPlevels.size())
@@ -377,50 +528,71 @@ void HistogramPyramid3DBuffer::traverse(Kernel &kernel, int arguments) {
         kernel.setArg(i+arguments+2, HPlevels[l]);
     }
 
+    int sum = getSum();
     int global_work_size = sum + 64 - (sum - 64*(sum / 64));
-    context.getQueue(0).enqueueNDRangeKernel(kernel, NullRange, NDRange(global_work_size), NDRange(64));
+    enqueueKernel(kernel, NDRange(global_work_size), NDRange(64),
+            getTraversalWork(global_work_size, HPlevels.size(), 8, 3, true));
 }
 
 
+/**
+ * Subclasses that can't write into an existing buffer don't override this,
+ * and allocate a new one every time.
+ */
+Buffer HistogramPyramid::createPositionBuffer(Buffer previous) {
+    return createPositionBuffer();
+}
+
+/**
+ * The previous buffer if it has the size for the current sum, otherwise a
+ * new one
+ */
+Buffer HistogramPyramid::reusePositionBuffer(Buffer previous, int dimensions) {
+    ::size_t bytes = dimensions*sizeof(int)*getSum();
+    if(previous() != NULL && previous.getInfo<CL_MEM_SIZE>() == bytes)
+        return previous;
+    return Buffer(context.getContext(), CL_MEM_READ_WRITE, bytes);
+}
+
 Buffer HistogramPyramid2D::createPositionBuffer() {
-    Buffer * positions = new Buffer(
-            context.getContext(),
-            CL_MEM_READ_WRITE,
-            2*sizeof(int)*sum
-    );
+    return createPositionBuffer(Buffer());
+}
+
+Buffer HistogramPyramid2D::createPositionBuffer(Buffer previous) {
+    Buffer positions = reusePositionBuffer(previous, 2);
     Kernel kernel(context.getProgram("oul::HistogramPyramids"), "createPositions2D");
-    kernel.setArg(0, (*positions));
+    kernel.setArg(0, positions);
     kernel.setArg(1, this->size);
-    kernel.setArg(2, this->sum);
+    kernel.setArg(2, getSum());
     this->traverse(kernel, 3);
-    return *positions;
+    return positions;
 }
 
 Buffer HistogramPyramid3D::createPositionBuffer() {
-    Buffer * positions = new Buffer(
-            context.getContext(),
-            CL_MEM_READ_WRITE,
-            3*sizeof(int)*sum
-    );
+    return createPositionBuffer(Buffer());
+}
+
+Buffer HistogramPyramid3D::createPositionBuffer(Buffer previous) {
+    Buffer positions = reusePositionBuffer(previous, 3);
     Kernel kernel(context.getProgram("oul::HistogramPyramids"), "createPositions3D");
-    kernel.setArg(0, (*positions));
+    kernel.setArg(0, positions);
     this->traverse(kernel, 1);
-    return *positions;
+    return positions;
 }
 
 Buffer HistogramPyramid3DBuffer::createPositionBuffer() {
-    Buffer * positions = new Buffer(
-            context.getContext(),
-            CL_MEM_READ_WRITE,
-            3*sizeof(int)*sum
-    );
+    return createPositionBuffer(Buffer());
+}
+
+Buffer HistogramPyramid3DBuffer::createPositionBuffer(Buffer previous) {
+    Buffer positions = reusePositionBuffer(previous, 3);
     Kernel kernel(context.getProgram("oul::HistogramPyramids"), "createPositions3DBuffer");
     kernel.setArg(0, sizeX);
     kernel.setArg(1, sizeY);
     kernel.setArg(2, sizeZ);
-    kernel.setArg(3, (*positions));
+    kernel.setArg(3, positions);
     this->traverse(kernel, 4);
-    return *positions;
+    return positions;
 }
 
 void HistogramPyramid2D::deleteHPlevels() {
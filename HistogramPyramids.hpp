@@ -3,6 +3,7 @@
 
 #include "Context.hpp"
 #include <vector>
+#include <boost/shared_ptr.hpp>
 
 namespace oul {
 
@@ -11,14 +12,31 @@ namespace oul {
  */
 class HistogramPyramid {
     public:
+        HistogramPyramid();
+        virtual ~HistogramPyramid(); // Waits for a pending sum readback
         static void compileCode(oul::Context &context);
-        int getSum();
+        int getSum(); // Waits for the sum readback if created with createAsync
+        void setQueue(cl::CommandQueue queue);
         virtual cl::Buffer createPositionBuffer() = 0;
+        virtual cl::Buffer createPositionBuffer(cl::Buffer previous); // Reuses previous if it has the size for the sum
         virtual void deleteHPlevels() = 0;
     protected:
+        cl::Buffer reusePositionBuffer(cl::Buffer previous, int dimensions);
+        bool keepLevels(int previousSize, unsigned int levels);
+        Command setPendingSum(cl::Event readEvent, int elements);
+        void updateQueue();
+        unsigned int * getSumReadback();
+        void enqueueKernel(cl::Kernel &kernel, cl::NDRange global, cl::NDRange local, KernelWork work = KernelWork());
         oul::Context context; //this will call the default constructor in Context
+        cl::CommandQueue queue;
+        bool queueSelected;
         int size;
         int sum;
+        cl::Event sumEvent;
+        bool sumPending;
+        int sumElements;
+        // Host memory of the non-blocking sum readback, shared with copies
+        boost::shared_ptr<std::vector<unsigned int> > sumReadback;
 };
 
 /**
@@ -28,7 +46,9 @@ class HistogramPyramid2D : public HistogramPyramid {
     public:
         HistogramPyramid2D(oul::Context &context);
         void create(cl::Image2D &image, int, int);
+        Command createAsync(cl::Image2D &image, int, int);
         cl::Buffer createPositionBuffer();
+        cl::Buffer createPositionBuffer(cl::Buffer previous);
         void deleteHPlevels();
         void traverse(cl::Kernel &kernel, int);
     private:
@@ -42,7 +62,9 @@ class HistogramPyramid3D : public HistogramPyramid {
     public:
         HistogramPyramid3D(oul::Context &context);
         void create(cl::Image3D &image, int, int, int);
+        Command createAsync(cl::Image3D &image, int, int, int);
         cl::Buffer createPositionBuffer();
+        cl::Buffer createPositionBuffer(cl::Buffer previous);
         void deleteHPlevels();
         void traverse(cl::Kernel &kernel, int);
     private:
@@ -56,7 +78,9 @@ class HistogramPyramid3DBuffer : public HistogramPyramid {
     public:
         HistogramPyramid3DBuffer(oul::Context &context);
         void create(cl::Buffer &buffer, int, int, int);
+        Command createAsync(cl::Buffer &buffer, int, int, int);
         cl::Buffer createPositionBuffer();
+        cl::Buffer createPositionBuffer(cl::Buffer previous);
         void deleteHPlevels();
         void traverse(cl::Kernel &kernel, int);
     private:
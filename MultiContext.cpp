@@ -0,0 +1,305 @@
+#include "MultiContext.hpp"
+
+#include <cstring>
+#include <boost/bind.hpp>
+#include "OpenCLManager.hpp"
+#include "HelperFunctions.hpp"
+#include "Exceptions.hpp"
+
+namespace oul {
+
+/**
+ * Creates one context for each platform with devices that match the criteria.
+ * Preferences, device counts and partitioning are applied within each platform.
+ */
+MultiContext::MultiContext(const DeviceCriteria &criteria) :
+		outstanding(0),
+		stopping(false),
+		started(false)
+	{
+	std::vector<PlatformDevices> platformDevices = opencl()->getDevices(criteria);
+	for (unsigned int i = 0; i < platformDevices.size(); i++) {
+		std::vector<PlatformDevices> platform(1, platformDevices[i]);
+		std::vector<cl::Device> devices = opencl()->getDevicesForBestPlatform(criteria, platform);
+		devices = opencl()->partitionDevices(criteria, devices);
+		contexts.push_back(opencl()->createContext(devices));
+	}
+	if (contexts.size() == 0)
+		throw NoValidPlatformsException();
+	setup();
+}
+
+MultiContext::MultiContext(std::vector<Context> contexts) :
+		contexts(contexts),
+		outstanding(0),
+		stopping(false),
+		started(false)
+	{
+	if (contexts.size() == 0)
+		throw NoValidPlatformsException();
+	setup();
+}
+
+/**
+ * Waits for the queued jobs to run before the workers are stopped
+ */
+MultiContext::~MultiContext() {
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		stopping = true;
+	}
+	jobAvailable.notify_all();
+	workers.join_all();
+}
+
+void MultiContext::setup() {
+	for (unsigned int i = 0; i < contexts.size(); i++) {
+		// Seed the cost model with the (cached) probe results of the first device
+		DeviceProbeResult probe = opencl()->getDeviceProbeResult(contexts[i].getDevice(0));
+		DeviceCostModel model;
+		model.setLaunchLatency(probe.launchLatency);
+		model.setTransferBandwidth(probe.transferBandwidth);
+		model.setThroughput(probe.throughput);
+		models.push_back(model);
+
+		PlatformThroughput throughput;
+		throughput.platformName = contexts[i].getPlatform().getInfo<CL_PLATFORM_NAME>();
+		throughput.jobs = 0;
+		throughput.workItems = 0;
+		throughput.busyTime = 0;
+		throughputs.push_back(throughput);
+	}
+	queues.resize(contexts.size());
+	predictedBacklog.resize(contexts.size(), 0.0);
+	for (unsigned int i = 0; i < contexts.size(); i++)
+		workers.create_thread(boost::bind(&MultiContext::work, this, i));
+}
+
+/**
+ * Places the job on the platform where it is predicted to finish first,
+ * and returns the index of that platform. The job runs asynchronously.
+ */
+unsigned int MultiContext::submit(const DispatchJob &job, DispatchFunction function) {
+	unsigned int best = 0;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for (unsigned int i = 1; i < contexts.size(); i++) {
+			if (predictedBacklog[i] + models[i].predict(job) < predictedBacklog[best] + models[best].predict(job))
+				best = i;
+		}
+		QueuedJob queued;
+		queued.job = job;
+		queued.function = function;
+		queued.prediction = models[best].predict(job);
+		queues[best].push_back(queued);
+		predictedBacklog[best] += queued.prediction;
+		outstanding++;
+		if (!started) {
+			firstSubmit = boost::chrono::steady_clock::now();
+			started = true;
+		}
+	}
+	jobAvailable.notify_all();
+	return best;
+}
+
+/**
+ * Waits for all submitted jobs. If any of them failed, the first error is thrown.
+ */
+void MultiContext::finish() {
+	boost::mutex::scoped_lock lock(mutex);
+	while (outstanding > 0)
+		jobCompleted.wait(lock);
+	if (error != "") {
+		std::string msg = "A MultiContext job failed: " + error;
+		error = "";
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+}
+
+void MultiContext::work(unsigned int platform) {
+	while (true) {
+		QueuedJob queued;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			while (queues[platform].empty() && !stopping)
+				jobAvailable.wait(lock);
+			if (queues[platform].empty())
+				return;
+			queued = queues[platform].front();
+			queues[platform].pop_front();
+		}
+
+		std::string failure;
+		boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+		try {
+			queued.function(contexts[platform]);
+			contexts[platform].finish();
+		} catch (cl::Error &error) {
+			failure = std::string(error.what()) + " (" + getCLErrorString(error.err()) + ")";
+		} catch (std::exception &exception) {
+			failure = exception.what();
+		} catch (...) {
+			failure = "unknown exception";
+		}
+		if (failure != "")
+			reporter.report("Job on platform " + oul::number(platform) + " failed: " + failure, oul::ERROR);
+		double runtime = millisecondsSince(start);
+
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			models[platform].update(queued.job, runtime);
+			predictedBacklog[platform] -= queued.prediction;
+			throughputs[platform].jobs++;
+			throughputs[platform].workItems += queued.job.workItems;
+			throughputs[platform].busyTime += runtime;
+			lastCompletion = boost::chrono::steady_clock::now();
+			if (failure != "" && error == "")
+				error = failure;
+			outstanding--;
+		}
+		jobCompleted.notify_all();
+	}
+}
+
+unsigned int MultiContext::getNumberOfPlatforms() const {
+	return contexts.size();
+}
+
+Context MultiContext::getContext(unsigned int platform) {
+	return contexts.at(platform);
+}
+
+unsigned int MultiContext::getPlatformIndex(Context &context) {
+	for (unsigned int i = 0; i < contexts.size(); i++) {
+		if (contexts[i].getContext()() == context.getContext()())
+			return i;
+	}
+	throw Exception("The context is not part of the MultiContext", __LINE__, __FILE__);
+}
+
+DeviceCostModel MultiContext::getCostModel(unsigned int platform) {
+	boost::mutex::scoped_lock lock(mutex);
+	return models.at(platform);
+}
+
+PlatformThroughput MultiContext::getPlatformThroughput(unsigned int platform) {
+	boost::mutex::scoped_lock lock(mutex);
+	return throughputs.at(platform);
+}
+
+/**
+ * Work items completed on all platforms together, per ms of wall time
+ * from the first submit to the last completed job.
+ */
+double MultiContext::getThroughput() {
+	boost::mutex::scoped_lock lock(mutex);
+	double workItems = 0;
+	for (unsigned int i = 0; i < throughputs.size(); i++)
+		workItems += throughputs[i].workItems;
+	boost::chrono::duration<double, boost::milli> elapsed = lastCompletion - firstSubmit;
+	if (!started || elapsed.count() <= 0)
+		return 0;
+	return workItems / elapsed.count();
+}
+
+void MultiContext::printThroughput() {
+	for (unsigned int i = 0; i < contexts.size(); i++) {
+		PlatformThroughput throughput = getPlatformThroughput(i);
+		double rate = throughput.busyTime > 0 ? throughput.workItems / throughput.busyTime : 0;
+		reporter.report("Platform " + oul::number(i) + " (" + throughput.platformName + "): " +
+				oul::number(throughput.jobs) + " jobs, " + oul::number(throughput.busyTime) + " ms busy, " +
+				oul::number(rate) + " work items/ms", oul::INFO);
+	}
+	reporter.report("Aggregate throughput: " + oul::number(getThroughput()) + " work items/ms", oul::INFO);
+}
+
+MultiContextBuffer::MultiContextBuffer(MultiContext &multiContext, size_t size, cl_mem_flags flags) :
+		multiContext(multiContext),
+		size(size),
+		host(size, 0),
+		hostValid(true),
+		stagedCopies(0)
+	{
+	for (unsigned int i = 0; i < multiContext.getNumberOfPlatforms(); i++) {
+		buffers.push_back(cl::Buffer(multiContext.getContext(i).getContext(), flags, size));
+		valid.push_back(false);
+	}
+}
+
+/**
+ * The buffer in the given context, with the latest data in it
+ */
+cl::Buffer MultiContextBuffer::get(Context &context) {
+	unsigned int platform = multiContext.getPlatformIndex(context);
+	boost::mutex::scoped_lock lock(mutex);
+	stageTo(platform);
+	return buffers[platform];
+}
+
+/**
+ * Tells the buffer that a job has written to it in the given context,
+ * which makes the copies in all other contexts out of date.
+ */
+void MultiContextBuffer::setModified(Context &context) {
+	unsigned int platform = multiContext.getPlatformIndex(context);
+	boost::mutex::scoped_lock lock(mutex);
+	for (unsigned int i = 0; i < valid.size(); i++)
+		valid[i] = (i == platform);
+	hostValid = false;
+}
+
+void MultiContextBuffer::write(const void * data) {
+	boost::mutex::scoped_lock lock(mutex);
+	std::memcpy(&host[0], data, size);
+	hostValid = true;
+	for (unsigned int i = 0; i < valid.size(); i++)
+		valid[i] = false;
+}
+
+void MultiContextBuffer::read(void * data) {
+	boost::mutex::scoped_lock lock(mutex);
+	if (!hostValid) {
+		for (unsigned int i = 0; i < valid.size(); i++) {
+			if (valid[i]) {
+				BlockingCall blockingCall(multiContext.getContext(i).getRunTimeMeasurementManager(), "blocking read", __FILE__, __LINE__);
+				multiContext.getContext(i).getQueue(0).enqueueReadBuffer(buffers[i], CL_TRUE, 0, size, &host[0]);
+				break;
+			}
+		}
+		hostValid = true;
+	}
+	std::memcpy(data, &host[0], size);
+}
+
+size_t MultiContextBuffer::getSize() const {
+	return size;
+}
+
+/**
+ * How many times data has been copied into a context through host memory
+ */
+unsigned int MultiContextBuffer::getNumberOfStagedCopies() const {
+	return stagedCopies;
+}
+
+void MultiContextBuffer::stageTo(unsigned int platform) {
+	if (valid[platform])
+		return;
+	if (!hostValid) {
+		for (unsigned int i = 0; i < valid.size(); i++) {
+			if (valid[i]) {
+				BlockingCall blockingCall(multiContext.getContext(i).getRunTimeMeasurementManager(), "blocking read", __FILE__, __LINE__);
+				multiContext.getContext(i).getQueue(0).enqueueReadBuffer(buffers[i], CL_TRUE, 0, size, &host[0]);
+				break;
+			}
+		}
+		hostValid = true;
+	}
+	BlockingCall blockingCall(multiContext.getContext(platform).getRunTimeMeasurementManager(), "blocking write", __FILE__, __LINE__);
+	multiContext.getContext(platform).getQueue(0).enqueueWriteBuffer(buffers[platform], CL_TRUE, 0, size, &host[0]);
+	valid[platform] = true;
+	stagedCopies++;
+}
+
+} //namespace oul
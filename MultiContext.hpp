@@ -0,0 +1,126 @@
+#ifndef MULTICONTEXT_HPP_
+#define MULTICONTEXT_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <vector>
+#include <deque>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/chrono.hpp>
+#include "Context.hpp"
+#include "DeviceCriteria.hpp"
+#include "DeviceDispatcher.hpp"
+#include "Reporter.hpp"
+
+namespace oul {
+
+/**
+ * Statistics for the jobs a MultiContext has run on one platform
+ */
+struct PlatformThroughput {
+	std::string platformName;
+	unsigned int jobs;
+	double workItems;
+	double busyTime; // ms
+};
+
+/**
+ * Spans one Context per OpenCL platform, since devices of different platforms
+ * can't share a cl::Context. Every platform gets a worker thread that runs the
+ * jobs placed on it, and each job is placed on the platform with the earliest
+ * predicted finish time: the predicted time of the jobs already waiting there
+ * plus the predicted time of the job itself, from a cost model per platform.
+ *
+ * Jobs are given the Context of the platform they run on, and get their data
+ * through MultiContextBuffers, so they don't need to know which platform that is.
+ */
+class MultiContext {
+
+public:
+	MultiContext(const DeviceCriteria &criteria); //can throw cl::Error and oul::Exception
+	MultiContext(std::vector<Context> contexts);
+	~MultiContext();
+
+	unsigned int submit(const DispatchJob &job, DispatchFunction function);
+	void finish(); //can throw oul::Exception
+
+	unsigned int getNumberOfPlatforms() const;
+	Context getContext(unsigned int platform);
+	unsigned int getPlatformIndex(Context &context); //can throw oul::Exception
+	DeviceCostModel getCostModel(unsigned int platform);
+
+	PlatformThroughput getPlatformThroughput(unsigned int platform);
+	double getThroughput(); // Work items per ms, over all platforms
+	void printThroughput();
+
+private:
+	struct QueuedJob {
+		DispatchJob job;
+		DispatchFunction function;
+		double prediction;
+	};
+
+	MultiContext(const MultiContext &other);
+	MultiContext &operator=(const MultiContext &other);
+
+	void setup();
+	void work(unsigned int platform);
+
+	std::vector<Context> contexts;
+	std::vector<DeviceCostModel> models;
+	std::vector<std::deque<QueuedJob> > queues;
+	std::vector<double> predictedBacklog; // ms of work queued or running on each platform
+	std::vector<PlatformThroughput> throughputs;
+	unsigned int outstanding;
+	bool stopping;
+	std::string error;
+
+	bool started;
+	boost::chrono::steady_clock::time_point firstSubmit;
+	boost::chrono::steady_clock::time_point lastCompletion;
+
+	boost::mutex mutex;
+	boost::condition_variable jobAvailable;
+	boost::condition_variable jobCompleted;
+	boost::thread_group workers;
+	Reporter reporter;
+};
+
+typedef boost::shared_ptr<class MultiContext> MultiContextPtr;
+
+/**
+ * A buffer that exists in every context of a MultiContext. get() returns the
+ * buffer in the given context, first copying the latest data there through
+ * host memory if another context has modified it since.
+ */
+class MultiContextBuffer {
+
+public:
+	MultiContextBuffer(MultiContext &multiContext, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE); //can throw cl::Error
+
+	cl::Buffer get(Context &context); //can throw cl::Error and oul::Exception
+	void setModified(Context &context); //can throw oul::Exception
+	void write(const void * data);
+	void read(void * data); //can throw cl::Error
+	size_t getSize() const;
+	unsigned int getNumberOfStagedCopies() const;
+
+private:
+	void stageTo(unsigned int platform); //can throw cl::Error
+
+	MultiContext &multiContext;
+	size_t size;
+	std::vector<cl::Buffer> buffers;
+	std::vector<bool> valid;
+	std::vector<char> host;
+	bool hostValid;
+	unsigned int stagedCopies;
+	boost::mutex mutex;
+};
+
+typedef boost::shared_ptr<class MultiContextBuffer> MultiContextBufferPtr;
+
+} //namespace oul
+
+#endif /* MULTICONTEXT_HPP_ */
@@ -4,6 +4,10 @@
 #include "HelperFunctions.hpp"
 #include <iostream>
 #include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <boost/thread/mutex.hpp>
 #include "HelperFunctions.hpp"
 
 #if defined(__APPLE__) || defined(__MACOSX)
@@ -19,21 +23,198 @@
 
 namespace oul {
 
+// Guards creation and deletion of the singleton
+static boost::mutex instanceMutex;
+
 OpenCLManager* OpenCLManager::getInstance() {
+    boost::mutex::scoped_lock lock(instanceMutex);
     if (instance == NULL) {
         instance = new OpenCLManager();
     }
     return instance;
 }
 
+/**
+ * Waits for the work in all pooled contexts to finish and deletes the manager.
+ * Contexts that are still leased stay valid until their last ContextPtr is gone,
+ * but are not returned to a pool any more.
+ */
 void OpenCLManager::shutdown() {
-    //TODO make sure all opencl threads  are finished before returning
-
+    boost::mutex::scoped_lock lock(instanceMutex);
     delete instance;
     instance = NULL;
 }
 
+OpenCLManager::~OpenCLManager() {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    std::multimap<std::string, PooledContext>::iterator it;
+    for (it = contextPool.begin(); it != contextPool.end(); ++it) {
+        try {
+            it->second.context->finish();
+        } catch (cl::Error &error) {
+            reporter.report("Could not finish a pooled context: " + getCLErrorString(error.err()), oul::WARNING);
+        }
+    }
+}
+
+/**
+ * The deleter of a leased ContextPtr. Holds on to the context,
+ * and gives it back to the pool when the last copy of the lease is gone,
+ * unless a copy of the Context itself is still around.
+ */
+class ContextLease {
+public:
+    ContextLease(ContextPtr context) : context(context) {
+    }
+    void operator()(Context *) {
+        OpenCLManager::releaseLease(context);
+    }
+private:
+    ContextPtr context;
+};
+
+static std::string getContextPoolKey(const std::vector<cl::Device> &devices, unsigned long * OpenGLContext, bool enableProfiling, const DeviceCriteria * partitioning) {
+    std::stringstream key;
+    for (int i = 0; i < devices.size(); i++)
+        key << devices[i]() << ",";
+    key << "profiling:" << enableProfiling << ";interop:" << OpenGLContext;
+    if (partitioning != NULL && partitioning->getPartitioning() != DEVICE_PARTITION_NONE) {
+        key << ";partition:" << partitioning->getPartitioning() << ":" << partitioning->getPartitionComputeUnits() <<
+                ":" << partitioning->getPartitionAffinityDomain();
+        for (int i = 0; i < partitioning->getPartitionCounts().size(); i++)
+            key << ":" << partitioning->getPartitionCounts()[i];
+    }
+    return key.str();
+}
+
+/**
+ * Like createContextPtr, but reuses an idle context with the same devices,
+ * profiling and interop settings if the pool has one, with all the programs
+ * already built in it. The lease is exclusive: the context goes back to the
+ * pool when the last copy of the returned ContextPtr is destroyed.
+ */
+ContextPtr OpenCLManager::acquireContext(const DeviceCriteria &deviceCriteria, unsigned long * OpenGLContext, bool enableProfiling) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    std::vector<PlatformDevices> platformDevices = getDevices(deviceCriteria);
+    std::vector<cl::Device> validDevices = getDevicesForBestPlatform(deviceCriteria, platformDevices);
+    // Sub-devices are new devices every time, so the pool is keyed on the devices they are partitioned from
+    std::string key = getContextPoolKey(validDevices, OpenGLContext, enableProfiling, &deviceCriteria);
+    return acquireContext(key, validDevices, &deviceCriteria, OpenGLContext, enableProfiling);
+}
+
+ContextPtr OpenCLManager::acquireContext(std::vector<cl::Device> devices, unsigned long * OpenGLContext, bool enableProfiling) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    std::string key = getContextPoolKey(devices, OpenGLContext, enableProfiling, NULL);
+    return acquireContext(key, devices, NULL, OpenGLContext, enableProfiling);
+}
+
+ContextPtr OpenCLManager::acquireContext(std::string key, std::vector<cl::Device> devices, const DeviceCriteria * partitioning, unsigned long * OpenGLContext, bool enableProfiling) {
+    reclaimIdleContexts();
+
+    std::multimap<std::string, PooledContext>::iterator it;
+    for (it = contextPool.lower_bound(key); it != contextPool.upper_bound(key); ++it) {
+        if (!it->second.leased) {
+            it->second.leased = true;
+            reporter.report("Reusing a pooled context.", oul::INFO);
+            return ContextPtr(it->second.context.get(), ContextLease(it->second.context));
+        }
+    }
+
+    if (partitioning != NULL)
+        devices = partitionDevices(*partitioning, devices);
+    PooledContext pooled;
+    pooled.context = ContextPtr(new Context(devices, OpenGLContext, enableProfiling));
+    pooled.leased = true;
+    contextPool.insert(std::make_pair(key, pooled));
+    reporter.report("Created a new pooled context, the pool now has " + oul::number(contextPool.size()) + " contexts.", oul::INFO);
+    return ContextPtr(pooled.context.get(), ContextLease(pooled.context));
+}
+
+void OpenCLManager::releaseLease(ContextPtr context) {
+    boost::mutex::scoped_lock lock(instanceMutex);
+    if (instance != NULL)
+        instance->returnContext(context);
+}
+
+/**
+ * Runs in the deleter of the last ContextPtr of a lease, so it must not throw.
+ * Every oul::Context that still shares the context counts as a copy, including
+ * the ones held by objects created from the lease such as HistogramPyramids.
+ * Those have to be destroyed before the lease ends, or the context is taken
+ * out of the pool.
+ */
+void OpenCLManager::returnContext(ContextPtr context) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    std::multimap<std::string, PooledContext>::iterator it;
+    for (it = contextPool.begin(); it != contextPool.end(); ++it) {
+        if (it->second.context == context) {
+            // A copy of the Context outlived the lease. The copy keeps the
+            // context alive, but it can't be handed out to anyone else.
+            if (context->getNumberOfHandles() > 1) {
+                reporter.report("A copy of a pooled context is still in use, it is taken out of the pool.", oul::WARNING);
+                contextPool.erase(it);
+                break;
+            }
+            it->second.leased = false;
+            it->second.lastReleased = boost::chrono::steady_clock::now();
+            break;
+        }
+    }
+    reclaimIdleContexts();
+}
+
+/**
+ * Contexts that have been idle for longer than this are released
+ */
+void OpenCLManager::setContextPoolTimeToLive(double seconds) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    contextPoolTimeToLive = seconds;
+}
+
+/**
+ * Releases the idle contexts that have outlived the time to live, after waiting
+ * for their queues. Returns how many were released.
+ */
+unsigned int OpenCLManager::reclaimIdleContexts() {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+    unsigned int reclaimed = 0;
+    std::multimap<std::string, PooledContext>::iterator it = contextPool.begin();
+    while (it != contextPool.end()) {
+        boost::chrono::duration<double> idle = now - it->second.lastReleased;
+        if (!it->second.leased && idle.count() >= contextPoolTimeToLive) {
+            try {
+                it->second.context->finish();
+            } catch (cl::Error &error) {
+                reporter.report("Could not finish an idle pooled context: " + getCLErrorString(error.err()), oul::WARNING);
+            }
+            contextPool.erase(it++);
+            reclaimed++;
+        } else {
+            ++it;
+        }
+    }
+    if (reclaimed > 0)
+        reporter.report("Reclaimed " + oul::number(reclaimed) + " idle contexts.", oul::INFO);
+    return reclaimed;
+}
+
+unsigned int OpenCLManager::getNumberOfPooledContexts() {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    return contextPool.size();
+}
+
+/**
+ * Probing needs a GL context, so the result is kept for the lifetime of the manager.
+ */
 bool OpenCLManager::deviceHasOpenGLInteropCapability(const cl::Device &device) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    if (openGLInteropCapability.count(device()) == 0)
+        openGLInteropCapability[device()] = probeOpenGLInteropCapability(device);
+    return openGLInteropCapability[device()];
+}
+
+bool OpenCLManager::probeOpenGLInteropCapability(const cl::Device &device) {
     // Get the cl_device_id of the device
     cl_device_id deviceID = device();
     // Get the platform of device
@@ -109,79 +290,166 @@ bool OpenCLManager::deviceHasOpenGLInteropCapability(const cl::Device &device) {
 #endif
 }
 
+/**
+ * Launch latency, bandwidth and throughput of the device, as measured by probe kernels.
+ * The probes only run the first time a device (and driver version) is seen,
+ * after that the results are read from the probe cache on disk.
+ */
+DeviceProbeResult OpenCLManager::getDeviceProbeResult(const cl::Device &device) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    return probeCache.get(device);
+}
+
+/**
+ * Checks the hard minimums of the criteria, and reports the first one the device fails
+ */
+bool OpenCLManager::deviceSatisfiesMinimums(const cl::Device &device, const DeviceCriteria &criteria) {
+    DeviceInfo info = getInventory()->getDeviceInfo(device);
+    if (info.localMemory < criteria.getMinimumLocalMemoryCriteria()) {
+        reporter.report("The device has too little local memory.", oul::INFO);
+        return false;
+    }
+    if (info.maxAllocation < criteria.getMinimumMaxAllocationCriteria()) {
+        reporter.report("The device has a too small max allocation size.", oul::INFO);
+        return false;
+    }
+    // The version string is "OpenCL <major>.<minor> <vendor specific>"
+    unsigned int major = 0, minor = 0;
+    sscanf(info.version.c_str(), "OpenCL %u.%u", &major, &minor);
+    if (major*10 + minor < criteria.getMinimumOpenCLVersionCriteria()) {
+        reporter.report("The device supports OpenCL " + oul::number(major) + "." + oul::number(minor) + " only.", oul::INFO);
+        return false;
+    }
+    return true;
+}
+
 bool OpenCLManager::devicePlatformMismatch(
         const cl::Device &device,
         const cl::Platform &platform) {
-    std::string platformVendorStr = platform.getInfo<CL_PLATFORM_VENDOR>();
+    std::string platformVendorStr = getInventory()->getPlatformInfo(platform).vendor;
     DevicePlatform platformVendor = getDevicePlatform(platformVendorStr);
 
-    std::string deviceVendorStr = device.getInfo<CL_DEVICE_VENDOR>();
+    std::string deviceVendorStr = getInventory()->getDeviceInfo(device).vendor;
     DevicePlatform deviceVendor = getDevicePlatform(deviceVendorStr);
 
     return platformVendor != deviceVendor;
 }
 
-typedef struct deviceAndScore {
-        int score;
-        cl::Device device;
-} deviceAndScore;
-bool compareScores(deviceAndScore a, deviceAndScore b) {
+bool compareRankings(const DeviceRanking &a, const DeviceRanking &b) {
     return (a.score > b.score);
 }
-;
+
+/**
+ * The raw value of a device for a preference. Higher is better.
+ */
+double OpenCLManager::getPreferenceValue(const cl::Device &device, DevicePreference preference) {
+    switch (preference) {
+    case DEVICE_PREFERENCE_NOT_CONNECTED_TO_SCREEN:
+        return deviceHasOpenGLInteropCapability(device) ? 0.0 : 1.0;
+    case DEVICE_PREFERENCE_COMPUTE_UNITS:
+        return getInventory()->getDeviceInfo(device).computeUnits;
+    case DEVICE_PREFERENCE_GLOBAL_MEMORY:
+        return getInventory()->getDeviceInfo(device).globalMemory / (1024 * 1024); // In MBs
+    case DEVICE_PREFERENCE_MEASURED_THROUGHPUT:
+        return getDeviceProbeResult(device).getScore();
+    case DEVICE_PREFERENCE_NONE:
+        break;
+    }
+    return 0.0;
+}
+
+std::string OpenCLManager::getPreferenceName(DevicePreference preference) {
+    switch (preference) {
+    case DEVICE_PREFERENCE_NOT_CONNECTED_TO_SCREEN:
+        return "not connected to screen";
+    case DEVICE_PREFERENCE_COMPUTE_UNITS:
+        return "compute units";
+    case DEVICE_PREFERENCE_GLOBAL_MEMORY:
+        return "global memory (MB)";
+    case DEVICE_PREFERENCE_MEASURED_THROUGHPUT:
+        return "measured throughput";
+    case DEVICE_PREFERENCE_NONE:
+        break;
+    }
+    return "none";
+}
+
+/**
+ * Scores the devices on the preferences of the criteria and returns them ranked, best first.
+ * Each preference value is normalized to the best of the devices, so that
+ * metrics of different magnitude can be weighted against each other.
+ * The explanation of each ranking lists the terms the score was summed from.
+ */
+std::vector<DeviceRanking> OpenCLManager::rankDevices(
+        const DeviceCriteria &deviceCriteria,
+        const std::vector<cl::Device> &devices) {
+    const std::vector<WeightedDevicePreference> &preferences = deviceCriteria.getDevicePreferences();
+
+    std::vector<std::vector<double> > values(devices.size(), std::vector<double>(preferences.size()));
+    std::vector<double> bestValues(preferences.size(), 0.0);
+    for (int i = 0; i < devices.size(); i++) {
+        for (int j = 0; j < preferences.size(); j++) {
+            values[i][j] = getPreferenceValue(devices[i], preferences[j].first);
+            bestValues[j] = std::max(bestValues[j], values[i][j]);
+        }
+    }
+
+    std::vector<DeviceRanking> rankings;
+    for (int i = 0; i < devices.size(); i++) {
+        DeviceRanking ranking;
+        ranking.device = devices[i];
+        ranking.score = 0.0;
+        for (int j = 0; j < preferences.size(); j++) {
+            double normalized = bestValues[j] > 0.0 ? values[i][j] / bestValues[j] : 0.0;
+            ranking.score += preferences[j].second * normalized;
+            if (j > 0)
+                ranking.explanation += " + ";
+            ranking.explanation += getPreferenceName(preferences[j].first) + " " + oul::number(values[i][j]) +
+                    " (" + oul::number(normalized) + " x " + oul::number(preferences[j].second) + ")";
+        }
+        if (preferences.size() == 0)
+            ranking.explanation = "no preferences";
+        reporter.report("The device " + getInventory()->getDeviceInfo(devices[i]).name + " got a score of " +
+                oul::number(ranking.score) + ": " + ranking.explanation, oul::INFO);
+        rankings.push_back(ranking);
+    }
+    std::stable_sort(rankings.begin(), rankings.end(), compareRankings);
+    return rankings;
+}
+
+/**
+ * Devices are ranked together across all platforms, so that the normalized
+ * scores of different platforms can be compared.
+ */
 void OpenCLManager::sortDevicesAccordingToPreference(
-        int numberOfPlatforms,
         int maxNumberOfDevices,
         std::vector<PlatformDevices> platformDevices,
-        DevicePreference preference,
+        const DeviceCriteria &deviceCriteria,
         std::vector<cl::Device> * sortedPlatformDevices,
-        int * platformScores) {
-    for (int i = 0; i < numberOfPlatforms; i++) {
+        double * platformScores) {
+    std::vector<cl::Device> allDevices;
+    for (int i = 0; i < platformDevices.size(); i++)
+        allDevices.insert(allDevices.end(), platformDevices[i].second.begin(), platformDevices[i].second.end());
+    std::vector<DeviceRanking> rankings = rankDevices(deviceCriteria, allDevices);
+
+    for (int i = 0; i < platformDevices.size(); i++) {
         if (platformDevices[i].second.size() == 0)
             continue;
-        // Go through each device and give it a score based on the preference
-        std::vector<deviceAndScore> deviceScores;
-        for (int j = 0; j < platformDevices[i].second.size(); j++) {
-            cl::Device device = platformDevices[i].second[j];
-            deviceAndScore das;
-            das.device = device;
-            switch (preference) {
-            case DEVICE_PREFERENCE_NOT_CONNECTED_TO_SCREEN:
-                if (!deviceHasOpenGLInteropCapability(device)) {
-                    das.score = 1;
-                } else {
-                    das.score = 0;
+
+        // Pick the best devices of this platform, and sum their scores
+        double platformScore = 0;
+        for (int j = 0; j < rankings.size() && sortedPlatformDevices[i].size() < maxNumberOfDevices; j++) {
+            for (int k = 0; k < platformDevices[i].second.size(); k++) {
+                if (platformDevices[i].second[k]() == rankings[j].device()) {
+                    sortedPlatformDevices[i].push_back(rankings[j].device);
+                    platformScore += rankings[j].score;
+                    break;
                 }
-                break;
-            case DEVICE_PREFERENCE_COMPUTE_UNITS:
-                das.score = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-                break;
-            case DEVICE_PREFERENCE_GLOBAL_MEMORY:
-                das.score = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()
-                        / (1024 * 1024); // In MBs
-                break;
-            default:
-                // Do nothing
-                reporter.report("No valid preference selected.", oul::INFO);
-                break;
             }
-            reporter.report("The device "  +  device.getInfo<CL_DEVICE_NAME>() + " got a score of " + oul::number(das.score), oul::INFO);
-            deviceScores.push_back(das);
-        }
-
-        // Sort devices according to the scores
-        std::sort(deviceScores.begin(), deviceScores.end(), compareScores);
-
-        // put devices back to vector and calculate scores
-        int platformScore = 0;
-        for (int j = 0; j < std::min(maxNumberOfDevices, (int) platformDevices[i].second.size()); j++) {
-            sortedPlatformDevices[i].push_back(deviceScores[j].device);
-            platformScore += deviceScores[j].score;
         }
         platformScores[i] = platformScore;
 
-		cl::Platform platform = sortedPlatformDevices[i][0].getInfo<CL_DEVICE_PLATFORM>();
-		reporter.report("The platform " + platform.getInfo<CL_PLATFORM_NAME>() + " got a score of " + oul::number(platformScore), oul::INFO);
+		reporter.report("The platform " + getInventory()->getPlatformInfo(platformDevices[i].first).name + " got a score of " + oul::number(platformScore), oul::INFO);
     }
 }
 
@@ -239,15 +507,15 @@ std::vector<cl::Device> OpenCLManager::getDevicesForBestPlatform(
     }
 
     std::vector<cl::Device>* sortedPlatformDevices = new std::vector<cl::Device>[platformDevices.size()];
-    int* platformScores = new int[platformDevices.size()]();
-    if (deviceCriteria.getDevicePreference() == DEVICE_PREFERENCE_NONE) {
+    double* platformScores = new double[platformDevices.size()]();
+    if (deviceCriteria.getDevicePreferences().empty()) {
         for(int i = 0; i < platformDevices.size(); i++) {
             sortedPlatformDevices[i] = platformDevices[i].second;
         }
     } else {
-        sortDevicesAccordingToPreference(platformDevices.size(),
+        sortDevicesAccordingToPreference(
                 deviceCriteria.getDeviceCountMaxCriteria(), platformDevices,
-                deviceCriteria.getDevicePreference(), sortedPlatformDevices,
+                deviceCriteria, sortedPlatformDevices,
                 platformScores);
     }
     // Now, finally, select the best platform and its devices by inspecting the platformDevices list
@@ -272,6 +540,7 @@ std::vector<cl::Device> OpenCLManager::getDevicesForBestPlatform(
         }
     }
     delete[] devicePlatformVendorMismatch;
+    delete[] platformScores;
 
     std::vector<cl::Device> validDevices;
     if (bestPlatform == -1) {
@@ -292,13 +561,107 @@ std::vector<cl::Device> OpenCLManager::getDevicesForBestPlatform(
     return validDevices;
 }
 
+/**
+ * Splits each device into sub-devices as requested by the partitioning criteria.
+ * Each sub-device gets its own queue in the context, so that work submitted
+ * to different queues runs on separate groups of compute units.
+ * Devices that can't be partitioned in the requested way are used as they are.
+ */
+std::vector<cl::Device> OpenCLManager::partitionDevices(
+        const DeviceCriteria &deviceCriteria,
+        const std::vector<cl::Device> &devices) {
+    if (deviceCriteria.getPartitioning() == DEVICE_PARTITION_NONE)
+        return devices;
+
+#if defined(CL_VERSION_1_2)
+    std::vector<cl_device_partition_property> properties;
+    switch (deviceCriteria.getPartitioning()) {
+    case DEVICE_PARTITION_EQUALLY:
+        properties.push_back(CL_DEVICE_PARTITION_EQUALLY);
+        properties.push_back(deviceCriteria.getPartitionComputeUnits());
+        break;
+    case DEVICE_PARTITION_BY_COUNTS:
+        properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+        for (int i = 0; i < deviceCriteria.getPartitionCounts().size(); i++)
+            properties.push_back(deviceCriteria.getPartitionCounts()[i]);
+        properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+        break;
+    case DEVICE_PARTITION_BY_AFFINITY_DOMAIN: {
+        properties.push_back(CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN);
+        cl_device_affinity_domain domain = CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE;
+        switch (deviceCriteria.getPartitionAffinityDomain()) {
+        case DEVICE_AFFINITY_NUMA:
+            domain = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+            break;
+        case DEVICE_AFFINITY_L4_CACHE:
+            domain = CL_DEVICE_AFFINITY_DOMAIN_L4_CACHE;
+            break;
+        case DEVICE_AFFINITY_L3_CACHE:
+            domain = CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE;
+            break;
+        case DEVICE_AFFINITY_L2_CACHE:
+            domain = CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE;
+            break;
+        case DEVICE_AFFINITY_L1_CACHE:
+            domain = CL_DEVICE_AFFINITY_DOMAIN_L1_CACHE;
+            break;
+        case DEVICE_AFFINITY_NEXT_PARTITIONABLE:
+            break;
+        }
+        properties.push_back(domain);
+        break;
+    }
+    case DEVICE_PARTITION_NONE:
+        break;
+    }
+    properties.push_back(0);
+
+    std::vector<cl::Device> partitionedDevices;
+    for (int i = 0; i < devices.size(); i++) {
+        cl::Device device = devices[i];
+        std::string name = device.getInfo<CL_DEVICE_NAME>();
+
+        // Devices of OpenCL 1.1 platforms don't know about partitioning
+        std::string version = device.getInfo<CL_DEVICE_VERSION>();
+        bool supported = version.find("OpenCL 1.0") == std::string::npos && version.find("OpenCL 1.1") == std::string::npos;
+        if (supported) {
+            // CL_DEVICE_PARTITION_MAX_SUB_DEVICES is not wrapped by cl.hpp
+            cl_uint maxSubDevices = 0;
+            clGetDeviceInfo(device(), CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(cl_uint), &maxSubDevices, NULL);
+            std::vector<cl_device_partition_property> supportedProperties = device.getInfo<CL_DEVICE_PARTITION_PROPERTIES>();
+            supported = maxSubDevices > 1 &&
+                    std::find(supportedProperties.begin(), supportedProperties.end(), properties[0]) != supportedProperties.end();
+        }
+        if (!supported) {
+            reporter.report("The device " + name + " does not support the requested partitioning and is used as it is.", oul::WARNING);
+            partitionedDevices.push_back(device);
+            continue;
+        }
+
+        std::vector<cl::Device> subDevices;
+        device.createSubDevices(&properties[0], &subDevices);
+        reporter.report("The device " + name + " was partitioned into " + oul::number(subDevices.size()) + " sub-devices.", oul::INFO);
+        for (int j = 0; j < subDevices.size(); j++) {
+            reporter.report("Sub-device " + oul::number(j) + " has " + oul::number(subDevices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) + " compute units.", oul::INFO);
+            partitionedDevices.push_back(subDevices[j]);
+        }
+    }
+    return partitionedDevices;
+#else
+    reporter.report("Device partitioning requires OpenCL 1.2. The devices are used as they are.", oul::WARNING);
+    return devices;
+#endif
+}
+
 std::vector<PlatformDevices> OpenCLManager::getDevices(
         const DeviceCriteria &deviceCriteria) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
 
-    if (platforms.size() == 0)
+    DeviceInventoryPtr deviceInventory = getInventory();
+    if (deviceInventory->getPlatforms().size() == 0)
         throw NoPlatformsInstalledException();
 
-    reporter.report("Found " + oul::number(platforms.size()) + " OpenCL platforms.", oul::INFO);
+    reporter.report("Found " + oul::number(deviceInventory->getPlatforms().size()) + " OpenCL platforms.", oul::INFO);
 
     // First, get all the platforms that fit the platform criteria
     std::vector<cl::Platform> validPlatforms = this->getPlatforms(deviceCriteria.getPlatformCriteria());
@@ -307,10 +670,11 @@ std::vector<PlatformDevices> OpenCLManager::getDevices(
     // Create a vector of devices for each platform
     std::vector<PlatformDevices> platformDevices;
     for (int i = 0; i < validPlatforms.size(); i++) {
-    	reporter.report("Platform " + oul::number(i) + ": " +  validPlatforms[i].getInfo<CL_PLATFORM_VENDOR>(), oul::INFO);
+        const PlatformInfo &platformInfo = deviceInventory->getPlatformInfo(validPlatforms[i]);
+    	reporter.report("Platform " + oul::number(i) + ": " +  platformInfo.vendor, oul::INFO);
 
         // Next, get all devices of correct type for each of those platforms
-        std::vector<cl::Device> devices;
+        std::vector<DeviceInfo> devices;
         cl_device_type deviceType;
         if (deviceCriteria.getTypeCriteria() == DEVICE_TYPE_ANY) {
             deviceType = CL_DEVICE_TYPE_ALL;
@@ -322,28 +686,35 @@ std::vector<PlatformDevices> OpenCLManager::getDevices(
             deviceType = CL_DEVICE_TYPE_CPU;
             reporter.report("Looking for CPU devices only.", oul::INFO);
         }
-        try {
-            validPlatforms[i].getDevices(deviceType, &devices);
-        } catch (cl::Error &error) {
-            // Do nothing?
+        for (int j = 0; j < platformInfo.devices.size(); j++) {
+            if (platformInfo.devices[j].type & deviceType)
+                devices.push_back(platformInfo.devices[j]);
         }
         reporter.report(oul::number(devices.size()) + " devices found for this platform.", oul::INFO);
 
         // Go through each device and see if they have the correct capabilities (if any)
         std::vector<cl::Device> acceptedDevices;
         for (int j = 0; j < devices.size(); j++) {
-        	reporter.report("Inspecting device " + oul::number(j) + " with the name " + devices[j].getInfo<CL_DEVICE_NAME>(), oul::INFO);
+        	reporter.report("Inspecting device " + oul::number(j) + " with the name " + devices[j].name, oul::INFO);
             std::vector<DeviceCapability> capabilityCriteria = deviceCriteria.getCapabilityCriteria();
             bool accepted = true;
             for (int k = 0; k < capabilityCriteria.size(); k++) {
                 if (capabilityCriteria[k] == DEVICE_CAPABILITY_OPENGL_INTEROP) {
-                    if (!deviceHasOpenGLInteropCapability(devices[j]))
+                    if (!deviceHasOpenGLInteropCapability(devices[j].device))
+                        accepted = false;
+                } else if (capabilityCriteria[k] == DEVICE_CAPABILITY_IMAGES) {
+                    if (!devices[j].imageSupport)
+                        accepted = false;
+                } else if (capabilityCriteria[k] == DEVICE_CAPABILITY_3D_IMAGE_WRITES) {
+                    if (devices[j].extensions.find("cl_khr_3d_image_writes") == std::string::npos)
                         accepted = false;
                 }
             }
+            if (accepted)
+                accepted = deviceSatisfiesMinimums(devices[j].device, deviceCriteria);
             if (accepted) {
             	reporter.report("The device was accepted.", oul::INFO);
-                acceptedDevices.push_back(devices[j]);
+                acceptedDevices.push_back(devices[j].device);
             }
         }
         if(acceptedDevices.size() > 0)
@@ -356,15 +727,16 @@ std::vector<PlatformDevices> OpenCLManager::getDevices(
 std::vector<cl::Platform> OpenCLManager::getPlatforms(
         oul::DevicePlatform platformCriteria) {
 
+    const std::vector<PlatformInfo> &platforms = getInventory()->getPlatforms();
     std::vector<cl::Platform> retval;
     if (platformCriteria == DEVICE_PLATFORM_ANY) {
-        retval = this->platforms;
+        retval = getInventory()->getPlatformList();
     } else {
         // Find the correct platform and add to validPlatforms
         std::string find = getDevicePlatform(platformCriteria);
         for (int i = 0; i < platforms.size(); i++) {
-            if (platforms[i].getInfo<CL_PLATFORM_VENDOR>().find(find) != std::string::npos) {
-                retval.push_back(platforms[i]);
+            if (platforms[i].vendor.find(find) != std::string::npos) {
+                retval.push_back(platforms[i].platform);
                 break;
             }
         }
@@ -372,8 +744,34 @@ std::vector<cl::Platform> OpenCLManager::getPlatforms(
     return retval;
 }
 
-OpenCLManager::OpenCLManager() {
-    cl::Platform::get(&platforms);
+/**
+ * The platforms and devices are probed the first time they are needed.
+ * If the environment variable OUL_DEVICE_INVENTORY_CACHE names a file,
+ * the inventory is persisted there between runs.
+ */
+OpenCLManager::OpenCLManager() :
+        contextPoolTimeToLive(60.0)
+    {
+    const char * cacheFilename = getenv("OUL_DEVICE_INVENTORY_CACHE");
+    if (cacheFilename != NULL)
+        inventoryCacheFilename = cacheFilename;
+}
+
+DeviceInventoryPtr OpenCLManager::getInventory() {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    if (!inventory)
+        inventory = DeviceInventory::create(inventoryCacheFilename);
+    return inventory;
+}
+
+/**
+ * Sets the file the inventory is persisted in, and probes the devices again
+ * the next time they are needed. An empty filename disables persistence.
+ */
+void OpenCLManager::setInventoryCacheFilename(std::string filename) {
+    boost::recursive_mutex::scoped_lock lock(mutex);
+    inventoryCacheFilename = filename;
+    inventory.reset();
 }
 
 Context OpenCLManager::createContext(
@@ -384,16 +782,30 @@ Context OpenCLManager::createContext(
     return Context(devices, OpenGLContext, enableProfiling);
 }
 
+/**
+ * A sub-device count from the command line, which must be positive
+ */
+static unsigned int parsePartitionCount(std::string value) {
+    int count = atoi(value.c_str());
+    if (count <= 0) {
+        std::string msg = "Invalid sub-device count in --partition: " + value;
+        throw Exception(msg.c_str(), __LINE__, __FILE__);
+    }
+    return count;
+}
+
 /**
  * This method parses program arguments into device criteria and returns a context.
  * If some arguments are not used, the criteria supplied in the defaultCriteria object are used.
  * Possible arguments are:
  * --device any|gpu|cpu
  * --platform any|amd|apple|intel|nvidia
- * --capability opengl-interop
- * --preference none|no-screen|compute-units|global-memory
+ * --capability opengl-interop|images|3d-image-writes
+ * --preference none|no-screen|compute-units|global-memory|measured-throughput
  * --device-min-count x
  * --device-max-count x
+ * --partition equally:n|counts:a,b,..|numa|l4-cache|l3-cache|l2-cache|l1-cache|next
+ * Sub-device counts that are not positive throw oul::Exception.
  */
 Context OpenCLManager::createContext(
         int argc,
@@ -429,6 +841,12 @@ Context OpenCLManager::createContext(
             if (value == "opengl-interop") {
                 defaultCriteria.setCapabilityCriteria(
                         DEVICE_CAPABILITY_OPENGL_INTEROP);
+            } else if (value == "images") {
+                defaultCriteria.setCapabilityCriteria(
+                        DEVICE_CAPABILITY_IMAGES);
+            } else if (value == "3d-image-writes") {
+                defaultCriteria.setCapabilityCriteria(
+                        DEVICE_CAPABILITY_3D_IMAGE_WRITES);
             }
         } else if (token == "--preference") {
             if (value == "none") {
@@ -442,6 +860,9 @@ Context OpenCLManager::createContext(
             } else if (value == "global-memory") {
                 defaultCriteria.setDevicePreference(
                         DEVICE_PREFERENCE_GLOBAL_MEMORY);
+            } else if (value == "measured-throughput") {
+                defaultCriteria.setDevicePreference(
+                        DEVICE_PREFERENCE_MEASURED_THROUGHPUT);
             }
         } else if (token == "--device-min-count") {
             unsigned int count = atoi(value.c_str());
@@ -451,6 +872,29 @@ Context OpenCLManager::createContext(
             unsigned int count = atoi(value.c_str());
             defaultCriteria.setDeviceCountCriteria(
                     defaultCriteria.getDeviceCountMinCriteria(), count);
+        } else if (token == "--partition") {
+            if (value.find("equally:") == 0) {
+                defaultCriteria.setPartitionEqually(parsePartitionCount(value.substr(8)));
+            } else if (value.find("counts:") == 0) {
+                std::vector<unsigned int> counts;
+                std::stringstream list(value.substr(7));
+                std::string count;
+                while (std::getline(list, count, ','))
+                    counts.push_back(parsePartitionCount(count));
+                defaultCriteria.setPartitionByCounts(counts);
+            } else if (value == "numa") {
+                defaultCriteria.setPartitionByAffinityDomain(DEVICE_AFFINITY_NUMA);
+            } else if (value == "l4-cache") {
+                defaultCriteria.setPartitionByAffinityDomain(DEVICE_AFFINITY_L4_CACHE);
+            } else if (value == "l3-cache") {
+                defaultCriteria.setPartitionByAffinityDomain(DEVICE_AFFINITY_L3_CACHE);
+            } else if (value == "l2-cache") {
+                defaultCriteria.setPartitionByAffinityDomain(DEVICE_AFFINITY_L2_CACHE);
+            } else if (value == "l1-cache") {
+                defaultCriteria.setPartitionByAffinityDomain(DEVICE_AFFINITY_L1_CACHE);
+            } else if (value == "next") {
+                defaultCriteria.setPartitionByAffinityDomain(DEVICE_AFFINITY_NEXT_PARTITIONABLE);
+            }
         }
     }
 
@@ -464,6 +908,7 @@ Context OpenCLManager::createContext(
 Context OpenCLManager::createContext(const DeviceCriteria &deviceCriteria, unsigned long * OpenGLContext, bool enableProfiling) {
     std::vector<PlatformDevices> platformDevices = getDevices(deviceCriteria);
     std::vector<cl::Device> validDevices = getDevicesForBestPlatform(deviceCriteria, platformDevices);
+    validDevices = partitionDevices(deviceCriteria, validDevices);
 
     return oul::Context(validDevices, OpenGLContext, enableProfiling);
 }
@@ -471,6 +916,7 @@ Context OpenCLManager::createContext(const DeviceCriteria &deviceCriteria, unsig
 ContextPtr OpenCLManager::createContextPtr(const DeviceCriteria &deviceCriteria, unsigned long * OpenGLContext, bool enableProfiling) {
     std::vector<PlatformDevices> platformDevices = getDevices(deviceCriteria);
     std::vector<cl::Device> validDevices = getDevicesForBestPlatform(deviceCriteria, platformDevices);
+    validDevices = partitionDevices(deviceCriteria, validDevices);
 
 	return ContextPtr(new oul::Context(validDevices, OpenGLContext, enableProfiling));
 }
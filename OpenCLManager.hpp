@@ -5,14 +5,38 @@
 #include <vector>
 #include "Context.hpp"
 #include "DeviceCriteria.hpp"
+#include "DeviceProbe.hpp"
+#include "DeviceInventory.hpp"
 #include "Exceptions.hpp"
 #include "Reporter.hpp"
 #include <utility>
+#include <map>
+#include <string>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/chrono.hpp>
 
 namespace oul {
 
 typedef std::pair<cl::Platform, std::vector<cl::Device> > PlatformDevices;
 
+/**
+ * A device with its weighted score, and an explanation of the terms it was summed from
+ */
+struct DeviceRanking {
+    cl::Device device;
+    double score;
+    std::string explanation;
+};
+
+/**
+ * A context kept by the manager for reuse, with the programs built in it
+ */
+struct PooledContext {
+    ContextPtr context;
+    bool leased;
+    boost::chrono::steady_clock::time_point lastReleased;
+};
+
 /**
  * Singleton class which is used mainly for creating OpenCL contexts in an easy way
  * In the long run this object will contain the state of OpenCL in an application.
@@ -37,12 +61,21 @@ class OpenCLManager {
 
         ContextPtr createContextPtr(const DeviceCriteria &criteria, unsigned long * OpenGLContext = NULL, bool enableProfiling = false);
 
+        ContextPtr acquireContext(const DeviceCriteria &criteria, unsigned long * OpenGLContext = NULL, bool enableProfiling = false); //can throw cl::Error
+        ContextPtr acquireContext(std::vector<cl::Device> devices, unsigned long * OpenGLContext = NULL, bool enableProfiling = false); //can throw cl::Error
+        void setContextPoolTimeToLive(double seconds);
+        unsigned int reclaimIdleContexts();
+        unsigned int getNumberOfPooledContexts();
+
 
         std::vector<PlatformDevices> getDevices(const DeviceCriteria &criteria);
         std::vector<cl::Platform> getPlatforms(
                 oul::DevicePlatform platformCriteria);
+        DeviceInventoryPtr getInventory(); //can throw cl::Error
+        void setInventoryCacheFilename(std::string filename);
 
         bool deviceHasOpenGLInteropCapability(const cl::Device &device);
+        DeviceProbeResult getDeviceProbeResult(const cl::Device &device); //can throw cl::Error
         bool devicePlatformMismatch(
                 const cl::Device &device,
                 const cl::Platform &platform);
@@ -50,23 +83,48 @@ class OpenCLManager {
         std::vector<cl::Device> getDevicesForBestPlatform(
                 const DeviceCriteria& deviceCriteria,
                std::vector<PlatformDevices> &platformDevices);
+        std::vector<DeviceRanking> rankDevices(
+                const DeviceCriteria &deviceCriteria,
+                const std::vector<cl::Device> &devices);
+        bool deviceSatisfiesMinimums(
+                const cl::Device &device,
+                const DeviceCriteria &deviceCriteria);
+        std::vector<cl::Device> partitionDevices(
+                const DeviceCriteria &deviceCriteria,
+                const std::vector<cl::Device> &devices); //can throw cl::Error
 
     private:
         OpenCLManager();
+        ~OpenCLManager();
+
+        ContextPtr acquireContext(std::string key, std::vector<cl::Device> devices, const DeviceCriteria * partitioning, unsigned long * OpenGLContext, bool enableProfiling);
+        void returnContext(ContextPtr context);
+        static void releaseLease(ContextPtr context);
+        friend class ContextLease;
 
         void sortDevicesAccordingToPreference(
-                int numberOfPlatforms,
                 int maxNumberOfDevices,
                 std::vector<PlatformDevices> platformDevices,
-                DevicePreference preference,
+                const DeviceCriteria &deviceCriteria,
                 std::vector<cl::Device> * sortedPlatformDevices,
-                int * platformScores);
+                double * platformScores);
+        double getPreferenceValue(const cl::Device &device, DevicePreference preference);
+        std::string getPreferenceName(DevicePreference preference);
         DevicePlatform getDevicePlatform(std::string platformVendor);
         std::string getDevicePlatform(DevicePlatform devicePlatform);
 
-        std::vector<cl::Platform> platforms;
+        bool probeOpenGLInteropCapability(const cl::Device &device);
+
+        DeviceInventoryPtr inventory;
+        std::string inventoryCacheFilename;
+        std::map<cl_device_id, bool> openGLInteropCapability;
+        DeviceProbeCache probeCache;
         Reporter reporter;
 
+        std::multimap<std::string, PooledContext> contextPool;
+        double contextPoolTimeToLive; // seconds
+        boost::recursive_mutex mutex;
+
         static OpenCLManager * instance;
 };
 
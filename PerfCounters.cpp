@@ -0,0 +1,289 @@
+#include "PerfCounters.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <set>
+#include <fstream>
+#include <sstream>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cerrno>
+#include <stdint.h>
+#endif
+
+namespace oul {
+
+PerfCounters::PerfCounters() {
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++) {
+		available[i] = false;
+		retired[i] = 0;
+	}
+}
+
+PerfCounters::~PerfCounters() {
+	close();
+}
+
+std::string PerfCounters::getName(PerfCounter counter) {
+	switch (counter) {
+	case PERF_CYCLES:
+		return "cycles";
+	case PERF_INSTRUCTIONS:
+		return "instructions";
+	case PERF_CACHE_MISSES:
+		return "LLC misses";
+	case PERF_BRANCH_MISSES:
+		return "branch misses";
+	default:
+		return "unknown";
+	}
+}
+
+bool PerfCounters::isOpen() const {
+	boost::mutex::scoped_lock lock(mutex);
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++) {
+		if (available[i])
+			return true;
+	}
+	return false;
+}
+
+bool PerfCounters::isAvailable(PerfCounter counter) const {
+	boost::mutex::scoped_lock lock(mutex);
+	return available[counter];
+}
+
+std::string PerfCounters::getError() const {
+	boost::mutex::scoped_lock lock(mutex);
+	return error;
+}
+
+unsigned int PerfCounters::getNumberOfThreads() const {
+	boost::mutex::scoped_lock lock(mutex);
+	return descriptors.size();
+}
+
+#if defined(__linux__)
+
+static int openCounter(int thread, PerfCounter counter) {
+	static const unsigned long long configs[PERF_NUMBER_OF_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	struct perf_event_attr attributes;
+	std::memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.config = configs[counter];
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(__NR_perf_event_open, &attributes, thread, -1, -1, 0);
+}
+
+static std::vector<int> getThreads() {
+	std::vector<int> threads;
+	DIR * directory = opendir("/proc/self/task");
+	if (directory == NULL)
+		return threads;
+	struct dirent * entry;
+	while ((entry = readdir(directory)) != NULL) {
+		int thread = std::atoi(entry->d_name);
+		if (thread > 0)
+			threads.push_back(thread);
+	}
+	closedir(directory);
+	return threads;
+}
+
+/**
+ * When the thread started, in clock ticks since boot, or 0 if it has exited.
+ * Tells a new thread apart from an exited one that had the same id.
+ */
+static unsigned long long getThreadStartTime(int thread) {
+	std::ostringstream path;
+	path << "/proc/self/task/" << thread << "/stat";
+	std::ifstream file(path.str().c_str());
+	std::string stat;
+	if (!std::getline(file, stat))
+		return 0;
+	// The name in parentheses may contain spaces, the fields after it don't
+	std::string::size_type nameEnd = stat.rfind(')');
+	if (nameEnd == std::string::npos)
+		return 0;
+	std::istringstream fields(stat.substr(nameEnd+1));
+	std::string field;
+	for (int i = 3; i <= 22; i++) { // The start time is field 22
+		if (!(fields >> field))
+			return 0;
+	}
+	return std::strtoull(field.c_str(), NULL, 10);
+}
+
+/**
+ * The count scaled up by how long the counter was multiplexed out
+ */
+static bool readCounter(int descriptor, double &count) {
+	uint64_t values[3]; // Count, time enabled and time running
+	if (descriptor < 0 || ::read(descriptor, values, sizeof(values)) != sizeof(values))
+		return false;
+	count = values[2] > 0 ? values[0] * ((double)values[1] / values[2]) : 0;
+	return true;
+}
+
+/**
+ * The first thread decides which counters are available, later threads
+ * only open those
+ */
+void PerfCounters::openThread(int thread, bool all) {
+	std::vector<int> threadDescriptors(PERF_NUMBER_OF_COUNTERS, -1);
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++) {
+		if (!all && !available[i])
+			continue;
+		threadDescriptors[i] = openCounter(thread, (PerfCounter)i);
+		if (threadDescriptors[i] >= 0) {
+			available[i] = true;
+		} else if (all && error == "") {
+			error = "perf_event_open failed for " + getName((PerfCounter)i) + ": " + std::strerror(errno);
+			if (errno == EACCES || errno == EPERM)
+				error += " (see /proc/sys/kernel/perf_event_paranoid)";
+			else if (errno == ENOENT || errno == ENODEV || errno == EOPNOTSUPP)
+				error += " (the CPU or virtual machine has no such counter)";
+		}
+	}
+	descriptors[thread] = threadDescriptors;
+	startTimes[thread] = getThreadStartTime(thread);
+}
+
+/**
+ * Keeps the final counts of a thread that has exited and closes its counters
+ */
+void PerfCounters::retireThread(int thread) {
+	std::vector<int> &threadDescriptors = descriptors[thread];
+	for (unsigned int i = 0; i < threadDescriptors.size(); i++) {
+		double count;
+		if (readCounter(threadDescriptors[i], count))
+			retired[i] += count;
+		if (threadDescriptors[i] >= 0)
+			::close(threadDescriptors[i]);
+	}
+	descriptors.erase(thread);
+	startTimes.erase(thread);
+}
+
+bool PerfCounters::open() {
+	close();
+	boost::mutex::scoped_lock lock(mutex);
+	error = "";
+	std::vector<int> threads = getThreads();
+	if (threads.empty()) {
+		error = "Could not list the threads in /proc/self/task";
+		return false;
+	}
+	openThread(threads[0], true);
+	bool any = false;
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++)
+		any = any || available[i];
+	if (!any) {
+		descriptors.clear();
+		return false;
+	}
+	for (unsigned int i = 1; i < threads.size(); i++)
+		openThread(threads[i], false);
+	return true;
+}
+
+/**
+ * Also retires the threads that have exited, so that their descriptors are
+ * closed and a new thread that reuses the id is counted
+ */
+void PerfCounters::addNewThreads() {
+	boost::mutex::scoped_lock lock(mutex);
+	if (descriptors.empty())
+		return;
+	std::vector<int> threads = getThreads();
+	std::set<int> running(threads.begin(), threads.end());
+	std::vector<int> exited;
+	std::map<int, std::vector<int> >::iterator it;
+	for (it = descriptors.begin(); it != descriptors.end(); ++it) {
+		if (running.count(it->first) == 0 || getThreadStartTime(it->first) != startTimes[it->first])
+			exited.push_back(it->first);
+	}
+	for (unsigned int i = 0; i < exited.size(); i++)
+		retireThread(exited[i]);
+	for (unsigned int i = 0; i < threads.size(); i++) {
+		if (descriptors.count(threads[i]) == 0)
+			openThread(threads[i], false);
+	}
+}
+
+void PerfCounters::close() {
+	boost::mutex::scoped_lock lock(mutex);
+	std::map<int, std::vector<int> >::iterator it;
+	for (it = descriptors.begin(); it != descriptors.end(); ++it) {
+		for (unsigned int i = 0; i < it->second.size(); i++) {
+			if (it->second[i] >= 0)
+				::close(it->second[i]);
+		}
+	}
+	descriptors.clear();
+	startTimes.clear();
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++) {
+		available[i] = false;
+		retired[i] = 0;
+	}
+}
+
+/**
+ * Counters of threads that have exited keep their final count
+ */
+std::vector<double> PerfCounters::read() {
+	boost::mutex::scoped_lock lock(mutex);
+	std::vector<double> totals(PERF_NUMBER_OF_COUNTERS, -1);
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++) {
+		if (available[i])
+			totals[i] = retired[i];
+	}
+	std::map<int, std::vector<int> >::iterator it;
+	for (it = descriptors.begin(); it != descriptors.end(); ++it) {
+		for (unsigned int i = 0; i < it->second.size(); i++) {
+			double count;
+			if (readCounter(it->second[i], count))
+				totals[i] += count;
+		}
+	}
+	return totals;
+}
+
+#else
+
+void PerfCounters::openThread(int thread, bool all) {
+}
+
+void PerfCounters::retireThread(int thread) {
+}
+
+bool PerfCounters::open() {
+	boost::mutex::scoped_lock lock(mutex);
+	error = "Hardware counters are only supported on Linux";
+	return false;
+}
+
+void PerfCounters::addNewThreads() {
+}
+
+void PerfCounters::close() {
+}
+
+std::vector<double> PerfCounters::read() {
+	return std::vector<double>(PERF_NUMBER_OF_COUNTERS, -1);
+}
+
+#endif
+
+} //namespace oul
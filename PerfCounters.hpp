@@ -0,0 +1,68 @@
+#ifndef PERFCOUNTERS_HPP_
+#define PERFCOUNTERS_HPP_
+
+#include <vector>
+#include <map>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace oul {
+
+enum PerfCounter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES, // Last level cache on most CPUs
+	PERF_BRANCH_MISSES,
+	PERF_NUMBER_OF_COUNTERS
+};
+
+/**
+ * Linux perf_event hardware counters of all threads of the process, which
+ * includes the worker threads an OpenCL CPU device runs kernels on.
+ * Threads started after the counters were opened are added, and threads that
+ * have exited are closed, by addNewThreads().
+ * Only user space is counted, which perf_event_paranoid up to 2 permits.
+ * On other systems, or when perf_event_open is not permitted, open() fails
+ * and read() returns no counts.
+ */
+class PerfCounters {
+
+public:
+	PerfCounters();
+	~PerfCounters();
+
+	bool open(); // Returns false if none of the counters could be opened
+	void addNewThreads();
+	void close();
+	bool isOpen() const;
+	bool isAvailable(PerfCounter counter) const;
+	std::string getError() const;
+	unsigned int getNumberOfThreads() const; // That have counters open
+
+	// The total of each counter over all threads, scaled up if the counter
+	// was multiplexed, and negative for counters that are not available
+	std::vector<double> read();
+
+	static std::string getName(PerfCounter counter);
+
+private:
+	PerfCounters(const PerfCounters &other);
+	PerfCounters &operator=(const PerfCounters &other);
+
+	void openThread(int thread, bool all);
+	void retireThread(int thread);
+
+	mutable boost::mutex mutex; // read() is called from OpenCL runtime threads
+	std::map<int, std::vector<int> > descriptors; // By thread id, -1 where a counter is not open
+	std::map<int, unsigned long long> startTimes; // By thread id
+	double retired[PERF_NUMBER_OF_COUNTERS]; // The final counts of threads that have exited
+	bool available[PERF_NUMBER_OF_COUNTERS];
+	std::string error;
+};
+
+typedef boost::shared_ptr<PerfCounters> PerfCountersPtr;
+
+} //namespace oul
+
+#endif /* PERFCOUNTERS_HPP_ */
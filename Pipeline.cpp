@@ -0,0 +1,426 @@
+#include "Pipeline.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include "Exceptions.hpp"
+
+namespace oul {
+
+PipelineFrame::PipelineFrame() :
+		frameNumber(0),
+		slot(0),
+		input(NULL),
+		output(NULL)
+	{
+}
+
+unsigned int PipelineFrame::getFrameNumber() const {
+	return frameNumber;
+}
+
+unsigned int PipelineFrame::getSlot() const {
+	return slot;
+}
+
+const void * PipelineFrame::getInput() const {
+	return input;
+}
+
+void * PipelineFrame::getOutput() const {
+	return output;
+}
+
+void PipelineFrame::setBuffer(std::string name, cl::Buffer buffer) {
+	buffers[name] = buffer;
+}
+
+cl::Buffer PipelineFrame::getBuffer(std::string name) {
+	if (buffers.count(name) == 0) {
+		std::string msg = "Could not find pipeline buffer with the name " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return buffers[name];
+}
+
+bool PipelineFrame::hasBuffer(std::string name) const {
+	return buffers.count(name) > 0;
+}
+
+void PipelineFrame::setValue(std::string name, int value) {
+	values[name] = value;
+}
+
+int PipelineFrame::getValue(std::string name) {
+	if (values.count(name) == 0) {
+		std::string msg = "Could not find pipeline value with the name " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return values[name];
+}
+
+void PipelineFrame::setObject(std::string name, boost::shared_ptr<void> object) {
+	objects[name] = object;
+}
+
+boost::shared_ptr<void> PipelineFrame::getObjectPointer(std::string name) {
+	if (objects.count(name) == 0) {
+		std::string msg = "Could not find pipeline object with the name " + name;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return objects[name];
+}
+
+PipelineStage::PipelineStage(std::string name) :
+		name(name)
+	{
+}
+
+PipelineStage::~PipelineStage() {
+}
+
+std::string PipelineStage::getName() const {
+	return name;
+}
+
+void PipelineStage::setup(Context &context, PipelineFrame &frame) {
+}
+
+Pipeline::Pipeline(Context context, unsigned int framesInFlight) :
+		context(context),
+		framesInFlight(framesInFlight),
+		initialized(false),
+		framesSubmitted(0),
+		framesCompleted(0),
+		firstStart(0),
+		lastEnd(0),
+		frameLatency(new RuntimeMeasurement("Pipeline frame latency"))
+	{
+}
+
+void Pipeline::addStage(PipelineStagePtr stage) {
+	if (initialized)
+		throw Exception("Stages must be added before the first frame is pushed", __LINE__, __FILE__);
+	stages.push_back(stage);
+	stageLatencies[stage->getName()] = RuntimeMeasurementPtr(new RuntimeMeasurement(stage->getName()));
+}
+
+void Pipeline::setFrameCompletedCallback(FrameCompletedCallback callback) {
+	frameCompleted = callback;
+}
+
+void Pipeline::setup() {
+	if (stages.size() == 0)
+		throw Exception("Pipeline has no stages", __LINE__, __FILE__);
+
+	// The wavefront keeps one frame per stage in flight, so the ring can't be smaller than that
+	if (framesInFlight < stages.size()) {
+		reporter.report("Pipeline ring increased from " + oul::number(framesInFlight) + " to " + oul::number(stages.size()) + " frames, one per stage.", oul::INFO);
+		framesInFlight = stages.size();
+	}
+
+	cl::Device device = context.getDevice(0);
+	for (unsigned int i = 0; i < stages.size(); i++)
+		queues.push_back(cl::CommandQueue(context.getContext(), device, CL_QUEUE_PROFILING_ENABLE));
+
+	slots.resize(framesInFlight);
+	nextStage.resize(framesInFlight, 0);
+	occupied.resize(framesInFlight, false);
+	beginEvents.resize(framesInFlight, std::vector<cl::Event>(stages.size()));
+	endEvents.resize(framesInFlight, std::vector<cl::Event>(stages.size()));
+	for (unsigned int i = 0; i < framesInFlight; i++) {
+		slots[i].slot = i;
+		for (unsigned int j = 0; j < stages.size(); j++)
+			stages[j]->setup(context, slots[i]);
+	}
+	initialized = true;
+}
+
+/**
+ * Submits a frame. Both pointers must stay valid until the frame has completed.
+ * Blocks only when the ring is full, until the oldest frame in it has completed.
+ * Returns the frame number.
+ */
+unsigned int Pipeline::push(const void * input, void * output) {
+	if (!initialized)
+		setup();
+
+	unsigned int frameNumber = framesSubmitted;
+	unsigned int slot = frameNumber % slots.size();
+	retire(slot);
+
+	slots[slot].frameNumber = frameNumber;
+	slots[slot].input = input;
+	slots[slot].output = output;
+	nextStage[slot] = 0;
+	occupied[slot] = true;
+	framesSubmitted++;
+
+	step(frameNumber);
+	return frameNumber;
+}
+
+/**
+ * Issues the remaining stages of all frames and waits for them to complete.
+ */
+void Pipeline::finish() {
+	if (!initialized || framesSubmitted == 0)
+		return;
+
+	int newestFrame = framesSubmitted - 1;
+	for (unsigned int i = 1; i < stages.size(); i++)
+		step(newestFrame + i);
+
+	unsigned int oldestFrame = framesSubmitted > slots.size() ? framesSubmitted - slots.size() : 0;
+	for (unsigned int frame = oldestFrame; frame < framesSubmitted; frame++)
+		retire(frame % slots.size());
+}
+
+void Pipeline::step(int newestFrame) {
+	for (unsigned int stage = 0; stage < stages.size(); stage++) {
+		int frame = newestFrame - (int)stage;
+		if (frame < 0)
+			break;
+		if (frame >= (int)framesSubmitted)
+			continue;
+		unsigned int slot = frame % slots.size();
+		if (occupied[slot] && slots[slot].frameNumber == (unsigned int)frame && nextStage[slot] == stage)
+			issueStage(frame, stage);
+	}
+}
+
+void Pipeline::issueStage(unsigned int frameNumber, unsigned int stage) {
+	unsigned int slot = frameNumber % slots.size();
+	cl::CommandQueue queue = queues[stage];
+
+	std::vector<cl::Event> waitFor;
+	if (stage > 0)
+		waitFor.push_back(endEvents[slot][stage-1]);
+
+#if !defined(CL_VERSION_1_2) || defined(CL_USE_DEPRECATED_OPENCL_1_1_APIS)
+	if (waitFor.size() > 0)
+		queue.enqueueWaitForEvents(waitFor);
+	beginEvents[slot][stage] = enqueueMarker(queue);
+#else
+	queue.enqueueBarrierWithWaitList(&waitFor, &beginEvents[slot][stage]);
+#endif
+
+	stages[stage]->process(context, queue, slots[slot]);
+
+	endEvents[slot][stage] = enqueueMarker(queue);
+	queue.flush();
+	nextStage[slot]++;
+}
+
+void Pipeline::retire(unsigned int slot) {
+	if (!occupied[slot])
+		return;
+
+	{
+		BlockingCall blockingCall(context.getRunTimeMeasurementManager(), "frame wait", __FILE__, __LINE__);
+		endEvents[slot][stages.size()-1].wait();
+	}
+
+	// Stage latency is measured from when the stage could start to when its last command ended
+	for (unsigned int i = 0; i < stages.size(); i++) {
+		cl_ulong begin = beginEvents[slot][i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		cl_ulong end = endEvents[slot][i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		stageLatencies[stages[i]->getName()]->addSample((end - begin) * 1.0e-6);
+	}
+	cl_ulong start = beginEvents[slot][0].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	cl_ulong end = endEvents[slot][stages.size()-1].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	frameLatency->addSample((end - start) * 1.0e-6);
+	if (framesCompleted == 0 || start < firstStart)
+		firstStart = start;
+	lastEnd = std::max(lastEnd, end);
+
+	occupied[slot] = false;
+	framesCompleted++;
+	if (frameCompleted)
+		frameCompleted(slots[slot]);
+}
+
+cl::Event Pipeline::enqueueMarker(cl::CommandQueue queue) {
+	cl::Event event;
+#if !defined(CL_VERSION_1_2) || defined(CL_USE_DEPRECATED_OPENCL_1_1_APIS)
+	// Use deprecated API
+	queue.enqueueMarker(&event);
+#else
+	queue.enqueueMarkerWithWaitList(NULL, &event);
+#endif
+	return event;
+}
+
+unsigned int Pipeline::getFramesSubmitted() const {
+	return framesSubmitted;
+}
+
+unsigned int Pipeline::getFramesCompleted() const {
+	return framesCompleted;
+}
+
+RuntimeMeasurementPtr Pipeline::getStageMeasurement(std::string stageName) {
+	if (stageLatencies.count(stageName) == 0) {
+		std::string msg = "Could not find pipeline stage with the name " + stageName;
+		throw Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+	return stageLatencies[stageName];
+}
+
+RuntimeMeasurement Pipeline::getStageLatency(std::string stageName) {
+	return *getStageMeasurement(stageName);
+}
+
+/**
+ * The number of frames per second the stage could sustain on its own,
+ * based on the device time it has been busy.
+ */
+double Pipeline::getStageThroughput(std::string stageName) {
+	RuntimeMeasurementPtr latency = getStageMeasurement(stageName);
+	if (latency->getSum() <= 0.0)
+		return 0.0;
+	return framesCompleted / (latency->getSum() * 1.0e-3);
+}
+
+RuntimeMeasurement Pipeline::getFrameLatency() {
+	return *frameLatency;
+}
+
+/**
+ * The number of frames per second the pipeline has sustained, measured on the device
+ * from the start of the first frame to the end of the last completed frame.
+ */
+double Pipeline::getThroughput() const {
+	if (framesCompleted == 0 || lastEnd <= firstStart)
+		return 0.0;
+	return framesCompleted / ((lastEnd - firstStart) * 1.0e-9);
+}
+
+void Pipeline::printStatistics() {
+	std::string slowestStage;
+	double slowestThroughput = -1.0;
+	for (unsigned int i = 0; i < stages.size(); i++) {
+		double throughput = getStageThroughput(stages[i]->getName());
+		if (slowestThroughput < 0.0 || throughput < slowestThroughput) {
+			slowestThroughput = throughput;
+			slowestStage = stages[i]->getName();
+		}
+	}
+
+	std::cout << "Pipeline with " << stages.size() << " stages and " << slots.size() << " frames in flight" << std::endl;
+	std::cout << "----------------------------------------------------" << std::endl;
+	for (unsigned int i = 0; i < stages.size(); i++) {
+		std::string name = stages[i]->getName();
+		std::cout << name << ": " << getStageMeasurement(name)->getAverage() << " ms per frame, "
+				<< getStageThroughput(name) << " frames/s";
+		if (name == slowestStage)
+			std::cout << " (slowest)";
+		std::cout << std::endl;
+	}
+	std::cout << "Frame latency: " << frameLatency->getAverage() << " ms" << std::endl;
+	std::cout << "Throughput: " << getThroughput() << " frames/s over " << framesCompleted << " frames" << std::endl;
+	std::cout << "----------------------------------------------------" << std::endl;
+}
+
+UploadStage::UploadStage(std::string bufferName, size_t bytes, cl_mem_flags flags) :
+		PipelineStage("upload " + bufferName),
+		bufferName(bufferName),
+		bytes(bytes),
+		flags(flags)
+	{
+}
+
+void UploadStage::setup(Context &context, PipelineFrame &frame) {
+	frame.setBuffer(bufferName, cl::Buffer(context.getContext(), flags, bytes));
+}
+
+void UploadStage::process(Context &context, cl::CommandQueue queue, PipelineFrame &frame) {
+	queue.enqueueWriteBuffer(frame.getBuffer(bufferName), CL_FALSE, 0, bytes, frame.getInput());
+}
+
+KernelStage::KernelStage(std::string name, cl::Kernel kernel, std::vector<std::string> inputNames,
+		cl::NDRange global, cl::NDRange local,
+		std::string outputName, size_t outputBytes) :
+		PipelineStage(name),
+		kernel(kernel),
+		inputNames(inputNames),
+		global(global),
+		local(local),
+		outputName(outputName),
+		outputBytes(outputBytes)
+	{
+}
+
+void KernelStage::setup(Context &context, PipelineFrame &frame) {
+	if (outputName != "")
+		frame.setBuffer(outputName, cl::Buffer(context.getContext(), CL_MEM_READ_WRITE, outputBytes));
+}
+
+void KernelStage::process(Context &context, cl::CommandQueue queue, PipelineFrame &frame) {
+	unsigned int argument = 0;
+	for (unsigned int i = 0; i < inputNames.size(); i++)
+		kernel.setArg(argument++, frame.getBuffer(inputNames[i]));
+	if (outputName != "")
+		kernel.setArg(argument++, frame.getBuffer(outputName));
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+}
+
+HistogramPyramid3DBufferStage::HistogramPyramid3DBufferStage(std::string inputName, int sizeX, int sizeY, int sizeZ, std::string name) :
+		PipelineStage(name),
+		inputName(inputName),
+		sizeX(sizeX),
+		sizeY(sizeY),
+		sizeZ(sizeZ)
+	{
+}
+
+void HistogramPyramid3DBufferStage::setup(Context &context, PipelineFrame &frame) {
+	// Stored as the base class, so that any traversal stage can use it
+	boost::shared_ptr<HistogramPyramid> hp(new HistogramPyramid3DBuffer(context));
+	frame.setObject(getName(), hp);
+}
+
+void HistogramPyramid3DBufferStage::process(Context &context, cl::CommandQueue queue, PipelineFrame &frame) {
+	boost::shared_ptr<HistogramPyramid3DBuffer> hp = boost::static_pointer_cast<HistogramPyramid3DBuffer>(
+			frame.getObject<HistogramPyramid>(getName()));
+	cl::Buffer input = frame.getBuffer(inputName);
+	hp->setQueue(queue);
+	hp->createAsync(input, sizeX, sizeY, sizeZ);
+}
+
+TraverseStage::TraverseStage(std::string pyramidName, std::string outputName) :
+		PipelineStage("traverse " + pyramidName),
+		pyramidName(pyramidName),
+		outputName(outputName)
+	{
+}
+
+void TraverseStage::process(Context &context, cl::CommandQueue queue, PipelineFrame &frame) {
+	boost::shared_ptr<HistogramPyramid> hp = frame.getObject<HistogramPyramid>(pyramidName);
+	hp->setQueue(queue);
+	// The position buffer is sized by the sum, so this waits for the readback of the pyramid stage.
+	// The buffer of the last frame in this slot is reused if the sum is the same.
+	cl::Buffer previous;
+	if (frame.hasBuffer(outputName))
+		previous = frame.getBuffer(outputName);
+	frame.setBuffer(outputName, hp->createPositionBuffer(previous));
+	frame.setValue("sum", hp->getSum());
+}
+
+DownloadStage::DownloadStage(std::string bufferName, size_t bytes) :
+		PipelineStage("download " + bufferName),
+		bufferName(bufferName),
+		bytes(bytes)
+	{
+}
+
+void DownloadStage::process(Context &context, cl::CommandQueue queue, PipelineFrame &frame) {
+	if (frame.getOutput() == NULL)
+		throw Exception("DownloadStage needs an output pointer for the frame", __LINE__, __FILE__);
+	cl::Buffer buffer = frame.getBuffer(bufferName);
+	size_t size = buffer.getInfo<CL_MEM_SIZE>();
+	if (bytes > 0 && bytes < size)
+		size = bytes;
+	queue.enqueueReadBuffer(buffer, CL_FALSE, 0, size, frame.getOutput());
+}
+
+} //namespace oul
@@ -0,0 +1,234 @@
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include "CL/OpenCL.hpp"
+#include <vector>
+#include <map>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include "Context.hpp"
+#include "HistogramPyramids.hpp"
+#include "Reporter.hpp"
+#include "RuntimeMeasurement.hpp"
+
+namespace oul {
+
+/**
+ * One slot in the ring of frames a Pipeline keeps in flight.
+ * Stages put the device buffers and objects they produce here,
+ * so that later stages can pick them up for the same frame.
+ */
+class PipelineFrame {
+
+public:
+	PipelineFrame();
+
+	unsigned int getFrameNumber() const;
+	unsigned int getSlot() const;
+	const void * getInput() const;
+	void * getOutput() const;
+
+	void setBuffer(std::string name, cl::Buffer buffer);
+	cl::Buffer getBuffer(std::string name); //can throw oul::Exception
+	bool hasBuffer(std::string name) const;
+
+	void setValue(std::string name, int value);
+	int getValue(std::string name); //can throw oul::Exception
+
+	void setObject(std::string name, boost::shared_ptr<void> object);
+	template <class T>
+	boost::shared_ptr<T> getObject(std::string name) {
+		return boost::static_pointer_cast<T>(getObjectPointer(name));
+	}
+
+private:
+	friend class Pipeline;
+	boost::shared_ptr<void> getObjectPointer(std::string name); //can throw oul::Exception
+
+	unsigned int frameNumber;
+	unsigned int slot;
+	const void * input;
+	void * output;
+	std::map<std::string, cl::Buffer> buffers;
+	std::map<std::string, int> values;
+	std::map<std::string, boost::shared_ptr<void> > objects;
+};
+
+/**
+ * A stage in a Pipeline. setup() is called once for every slot in the ring,
+ * and is the place to allocate device buffers that are reused from frame to frame.
+ * process() enqueues the work of the stage for one frame on the given queue.
+ * It should not block, except for when it needs a result from an earlier stage.
+ */
+class PipelineStage {
+
+public:
+	PipelineStage(std::string name);
+	virtual ~PipelineStage();
+
+	std::string getName() const;
+
+	virtual void setup(Context &context, PipelineFrame &frame);
+	virtual void process(Context &context, cl::CommandQueue queue, PipelineFrame &frame) = 0;
+
+private:
+	std::string name;
+};
+
+typedef boost::shared_ptr<class PipelineStage> PipelineStagePtr;
+
+typedef boost::function<void (PipelineFrame &)> FrameCompletedCallback;
+
+/**
+ * Processes a continuous stream of frames through a sequence of stages.
+ * Every stage has its own command queue and consecutive stages are connected
+ * through a bounded ring of frame slots, so several frames are in flight at
+ * once: while one frame is downloaded, the next is traversed and a third is
+ * uploaded. Sustained throughput is then set by the slowest stage, not by the
+ * sum of all stages.
+ *
+ * Stages are issued as a wavefront: pushing frame f issues stage 0 of f,
+ * stage 1 of f-1 and so on. A stage that has to wait on the host for an earlier
+ * stage (like a traversal needing the pyramid sum) therefore waits for an older
+ * frame, while the device already has work queued for the newer ones.
+ */
+class Pipeline {
+
+public:
+	Pipeline(Context context, unsigned int framesInFlight = 3);
+
+	void addStage(PipelineStagePtr stage);
+	void setFrameCompletedCallback(FrameCompletedCallback callback);
+
+	unsigned int push(const void * input, void * output = NULL); //can throw cl::Error
+	void finish(); //can throw cl::Error
+
+	unsigned int getFramesSubmitted() const;
+	unsigned int getFramesCompleted() const;
+
+	RuntimeMeasurement getStageLatency(std::string stageName); //can throw oul::Exception
+	double getStageThroughput(std::string stageName); //can throw oul::Exception
+	RuntimeMeasurement getFrameLatency();
+	double getThroughput() const;
+	void printStatistics();
+
+private:
+	void setup();
+	void step(int newestFrame);
+	void issueStage(unsigned int frameNumber, unsigned int stage);
+	void retire(unsigned int slot);
+	cl::Event enqueueMarker(cl::CommandQueue queue);
+	RuntimeMeasurementPtr getStageMeasurement(std::string stageName);
+
+	Context context;
+	Reporter reporter;
+	unsigned int framesInFlight;
+	bool initialized;
+	std::vector<PipelineStagePtr> stages;
+	std::vector<cl::CommandQueue> queues;
+	std::vector<PipelineFrame> slots;
+	std::vector<unsigned int> nextStage;
+	std::vector<bool> occupied;
+	std::vector<std::vector<cl::Event> > beginEvents;
+	std::vector<std::vector<cl::Event> > endEvents;
+	FrameCompletedCallback frameCompleted;
+
+	unsigned int framesSubmitted;
+	unsigned int framesCompleted;
+	cl_ulong firstStart;
+	cl_ulong lastEnd;
+	std::map<std::string, RuntimeMeasurementPtr> stageLatencies;
+	RuntimeMeasurementPtr frameLatency;
+};
+
+typedef boost::shared_ptr<class Pipeline> PipelinePtr;
+
+/**
+ * Copies the frame input from the host to a device buffer.
+ */
+class UploadStage : public PipelineStage {
+
+public:
+	UploadStage(std::string bufferName, size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE);
+	void setup(Context &context, PipelineFrame &frame);
+	void process(Context &context, cl::CommandQueue queue, PipelineFrame &frame);
+
+private:
+	std::string bufferName;
+	size_t bytes;
+	cl_mem_flags flags;
+};
+
+/**
+ * Runs a kernel with frame buffers as its first arguments.
+ * If outputName is set, an output buffer of outputBytes is allocated per slot
+ * and passed as the last of the buffer arguments.
+ */
+class KernelStage : public PipelineStage {
+
+public:
+	KernelStage(std::string name, cl::Kernel kernel, std::vector<std::string> inputNames,
+			cl::NDRange global, cl::NDRange local = cl::NullRange,
+			std::string outputName = "", size_t outputBytes = 0);
+	void setup(Context &context, PipelineFrame &frame);
+	void process(Context &context, cl::CommandQueue queue, PipelineFrame &frame);
+
+private:
+	cl::Kernel kernel;
+	std::vector<std::string> inputNames;
+	cl::NDRange global;
+	cl::NDRange local;
+	std::string outputName;
+	size_t outputBytes;
+};
+
+/**
+ * Builds a HistogramPyramid3DBuffer from a frame buffer.
+ * The pyramid is stored in the frame as an object with the stage name.
+ */
+class HistogramPyramid3DBufferStage : public PipelineStage {
+
+public:
+	HistogramPyramid3DBufferStage(std::string inputName, int sizeX, int sizeY, int sizeZ, std::string name = "pyramid");
+	void setup(Context &context, PipelineFrame &frame);
+	void process(Context &context, cl::CommandQueue queue, PipelineFrame &frame);
+
+private:
+	std::string inputName;
+	int sizeX, sizeY, sizeZ;
+};
+
+/**
+ * Traverses a pyramid built by an earlier stage into a position buffer.
+ * The number of positions is stored in the frame as the value "sum".
+ */
+class TraverseStage : public PipelineStage {
+
+public:
+	TraverseStage(std::string pyramidName = "pyramid", std::string outputName = "positions");
+	void process(Context &context, cl::CommandQueue queue, PipelineFrame &frame);
+
+private:
+	std::string pyramidName;
+	std::string outputName;
+};
+
+/**
+ * Copies a frame buffer back to the frame output on the host.
+ * If bytes is 0 the whole buffer is read.
+ */
+class DownloadStage : public PipelineStage {
+
+public:
+	DownloadStage(std::string bufferName, size_t bytes = 0);
+	void process(Context &context, cl::CommandQueue queue, PipelineFrame &frame);
+
+private:
+	std::string bufferName;
+	size_t bytes;
+};
+
+} //namespace oul
+
+#endif /* PIPELINE_HPP_ */
@@ -1,19 +1,159 @@
 #include "RuntimeMeasurement.hpp"
 #include <iostream>
+#include <cmath>
+#include <algorithm>
 
 using namespace oul;
 
+// The histogram covers 1 ns to about 4.9 hours (2^44 ns), in ms
+static const double HISTOGRAM_MINIMUM = 1.0e-6;
+static const unsigned int SUB_BUCKETS = 16;
+static const unsigned int OCTAVES = 44;
+
 RuntimeMeasurement::RuntimeMeasurement(){}
 
-RuntimeMeasurement::RuntimeMeasurement(std::string name) {
+RuntimeMeasurement::RuntimeMeasurement(std::string name, unsigned int reservoirSize) {
 	sum = 0.0f;
 	samples = 0;
 	this->name = name;
+	mean = 0.0;
+	m2 = 0.0;
+	minimum = 0.0;
+	maximum = 0.0;
+	histogram.resize(SUB_BUCKETS*OCTAVES, 0);
+	this->reservoirSize = reservoirSize;
+	random = 2463534242u;
 }
 
 void RuntimeMeasurement::addSample(double runtime) {
 	samples++;
 	sum += runtime;
+
+	double delta = runtime - mean;
+	mean += delta / samples;
+	m2 += delta * (runtime - mean);
+
+	if (samples == 1 || runtime < minimum)
+		minimum = runtime;
+	if (samples == 1 || runtime > maximum)
+		maximum = runtime;
+
+	histogram[getBucket(runtime)]++;
+
+	// Reservoir sampling, each sample is kept with probability reservoirSize/samples
+	if (reservoir.size() < reservoirSize) {
+		reservoir.push_back(runtime);
+	} else if (reservoirSize > 0) {
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		unsigned int i = random % samples;
+		if (i < reservoirSize)
+			reservoir[i] = runtime;
+	}
+}
+
+unsigned int RuntimeMeasurement::getBucket(double runtime) {
+	if (runtime <= HISTOGRAM_MINIMUM)
+		return 0;
+	double position = std::log(runtime / HISTOGRAM_MINIMUM) / std::log(2.0) * SUB_BUCKETS;
+	return std::min((unsigned int)position, SUB_BUCKETS*OCTAVES - 1);
+}
+
+/**
+ * The geometric middle of the bucket
+ */
+double RuntimeMeasurement::getBucketValue(unsigned int bucket) {
+	return HISTOGRAM_MINIMUM * std::pow(2.0, (bucket + 0.5) / SUB_BUCKETS);
+}
+
+double RuntimeMeasurement::getSum() const {
+	return sum;
+}
+
+double RuntimeMeasurement::getAverage() const {
+	return sum / samples;
+}
+
+double RuntimeMeasurement::getVariance() const {
+	if (samples < 2)
+		return 0.0;
+	return m2 / (samples - 1);
+}
+
+double RuntimeMeasurement::getStdDeviation() const {
+	return std::sqrt(getVariance());
+}
+
+double RuntimeMeasurement::getMin() const {
+	return minimum;
+}
+
+double RuntimeMeasurement::getMax() const {
+	return maximum;
+}
+
+/**
+ * The smallest bucket value that at least the given percent of the samples
+ * are at or below, kept within the measured minimum and maximum.
+ */
+double RuntimeMeasurement::getPercentile(double percent) const {
+	if (samples == 0)
+		return 0.0;
+	double rank = std::max(std::ceil(percent / 100.0 * samples), 1.0);
+	double count = 0;
+	for (unsigned int i = 0; i < histogram.size(); i++) {
+		count += histogram[i];
+		if (count >= rank)
+			return std::min(std::max(getBucketValue(i), minimum), maximum);
+	}
+	return maximum;
+}
+
+unsigned int RuntimeMeasurement::getNumberOfSamples() const {
+	return samples;
+}
+
+std::string RuntimeMeasurement::getName() const {
+	return name;
+}
+
+/**
+ * Setting a smaller size drops the samples past the new size
+ */
+void RuntimeMeasurement::setReservoirSize(unsigned int size) {
+	reservoirSize = size;
+	if (reservoir.size() > size)
+		reservoir.resize(size);
+}
+
+std::vector<double> RuntimeMeasurement::getReservoir() const {
+	return reservoir;
+}
+
+void RuntimeMeasurement::addCounterSample(std::string counter, double value) {
+	counterSums[counter] += value;
+	counterSamples[counter]++;
+}
+
+double RuntimeMeasurement::getCounterAverage(std::string counter) const {
+	std::map<std::string, double>::const_iterator it = counterSums.find(counter);
+	if (it == counterSums.end())
+		return 0;
+	return it->second / counterSamples.find(counter)->second;
+}
+
+unsigned int RuntimeMeasurement::getNumberOfCounterSamples(std::string counter) const {
+	std::map<std::string, unsigned int>::const_iterator it = counterSamples.find(counter);
+	return it == counterSamples.end() ? 0 : it->second;
+}
+
+std::vector<std::string> RuntimeMeasurement::getCounterNames() const {
+	std::vector<std::string> names;
+	std::map<std::string, double>::const_iterator it;
+	for (it = counterSums.begin(); it != counterSums.end(); ++it)
+		names.push_back(it->first);
+	return names;
 }
 
 void RuntimeMeasurement::print() const {
@@ -26,10 +166,17 @@ void RuntimeMeasurement::print() const {
 	} else {
 		std::cout << "Total: " << sum << " ms" << std::endl;
 		std::cout << "Average: " << sum / samples << " ms" << std::endl;
-		std::cout << "Standard deviation: " << "TODO" << " ms" << std::endl; //TODO
+		std::cout << "Standard deviation: " << getStdDeviation() << " ms" << std::endl;
+		std::cout << "Min / max: " << minimum << " / " << maximum << " ms" << std::endl;
+		std::cout << "p50 / p90 / p99 / p99.9: " << getPercentile(50) << " / " << getPercentile(90) << " / " <<
+				getPercentile(99) << " / " << getPercentile(99.9) << " ms" << std::endl;
 		std::cout << "Number of samples: " << samples << std::endl;
 	}
+	std::map<std::string, double>::const_iterator it;
+	for (it = counterSums.begin(); it != counterSums.end(); ++it)
+		std::cout << "Average " << it->first << ": " << getCounterAverage(it->first) << std::endl;
+	if (counterSums.count("cycles") > 0 && counterSums.count("instructions") > 0 && getCounterAverage("cycles") > 0)
+		std::cout << "Instructions per cycle: " << getCounterAverage("instructions") / getCounterAverage("cycles") << std::endl;
 	std::cout << "----------------------------------------------------"
 			<< std::endl;
 }
-
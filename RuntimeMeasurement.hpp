@@ -2,28 +2,68 @@
 #define TIMING_HPP_
 
 #include <string>
+#include <vector>
+#include <map>
 #include <boost/shared_ptr.hpp>
 
 namespace oul {
 /**
  * A class for a runtime measurement
+ *
+ * Keeps streaming statistics of the samples in fixed memory: the mean and
+ * variance (Welford), the minimum and maximum, and a histogram with
+ * logarithmically sized buckets for percentiles. The buckets are 1/16 of
+ * a power of two wide, which bounds the relative error of a percentile to
+ * about 4%. Optionally a bounded, uniformly drawn reservoir of the raw
+ * samples is kept as well.
  */
 class RuntimeMeasurement {
 
 public:
-	RuntimeMeasurement(std::string name);
+	RuntimeMeasurement(std::string name, unsigned int reservoirSize = 0);
 	void addSample(double runtime);
 	double getSum() const;
 	double getAverage() const;
+	double getVariance() const;
 	double getStdDeviation() const;
+	double getMin() const;
+	double getMax() const;
+	double getPercentile(double percent) const; // Percent in [0, 100]
+	unsigned int getNumberOfSamples() const;
+	std::string getName() const;
+
+	void setReservoirSize(unsigned int size);
+	std::vector<double> getReservoir() const;
+
+	// Counts sampled along with the runtime, such as hardware counters
+	void addCounterSample(std::string counter, double value);
+	double getCounterAverage(std::string counter) const; // 0 if never sampled
+	unsigned int getNumberOfCounterSamples(std::string counter) const;
+	std::vector<std::string> getCounterNames() const;
+
 	void print() const;
 
 private:
 	RuntimeMeasurement();
+	static unsigned int getBucket(double runtime);
+	static double getBucketValue(unsigned int bucket);
 
 	double sum;
 	unsigned int samples;
 	std::string name;
+
+	double mean;
+	double m2; // Sum of squared differences from the mean
+	double minimum;
+	double maximum;
+	std::vector<unsigned int> histogram;
+
+	unsigned int reservoirSize;
+	std::vector<double> reservoir;
+	unsigned int random;
+
+	std::map<std::string, double> counterSums;
+	std::map<std::string, unsigned int> counterSamples;
 };
 
 typedef boost::shared_ptr<class RuntimeMeasurement> RuntimeMeasurementPtr;
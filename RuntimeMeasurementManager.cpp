@@ -1,14 +1,41 @@
 #include "RuntimeMeasurementManager.hpp"
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/thread/tss.hpp>
 #include "Exceptions.hpp"
+#include "Reporter.hpp"
+#include "HelperFunctions.hpp"
+#include "DeviceProbe.hpp"
 
 namespace oul {
 
 void RuntimeMeasurementsManager::enable() {
+	boost::mutex::scoped_lock lock(switchMutex);
+	if (enabled)
+		return;
+	for (unsigned int i = 0; i < profilingSwitches.size(); i++)
+		profilingSwitches[i](true);
 	enabled = true;
 }
 
 void RuntimeMeasurementsManager::disable() {
+	boost::mutex::scoped_lock lock(switchMutex);
+	if (!enabled)
+		return;
 	enabled = false;
+	for (unsigned int i = 0; i < profilingSwitches.size(); i++)
+		profilingSwitches[i](false);
+}
+
+void RuntimeMeasurementsManager::addProfilingSwitch(ProfilingSwitch profilingSwitch) {
+	boost::mutex::scoped_lock lock(switchMutex);
+	profilingSwitches.push_back(profilingSwitch);
 }
 
 void RuntimeMeasurementsManager::startCLTimer(std::string name, cl::CommandQueue queue) {
@@ -17,66 +44,369 @@ void RuntimeMeasurementsManager::startCLTimer(std::string name, cl::CommandQueue
 
 	this->verifyQueueProfilingIsEnabled(queue);
 
-	cl::Event startEvent = this->enqueueNewMarker(queue);
-	startEvents.insert(std::make_pair(name, startEvent));
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	startEvents[name] = this->enqueueNewMarker(queue);
 }
 
+/**
+ * Enqueues the end marker without waiting for it. The timing is read when
+ * both markers have completed, at the latest when the timings are requested.
+ */
 void RuntimeMeasurementsManager::stopCLTimer(std::string name, cl::CommandQueue queue) {
 	if (!enabled)
 		return;
 
 	this->verifyQueueProfilingIsEnabled(queue);
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
 	this->verifyThatEventExists(name);
 
-	cl::Event startEvent = startEvents.at(name);
-	cl_ulong start = startEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-    startEvents.erase(name);
+	PendingCLTimer timer;
+	timer.name = name;
+	timer.start = startEvents.at(name);
+	timer.end = this->enqueueNewMarker(queue);
+	timer.isTransfer = false;
+	startEvents.erase(name);
+	this->addPendingCLTimer(timer);
+}
+
+/**
+ * Times a command, such as a kernel, from the event it was enqueued with.
+ * The queue must have profiling enabled.
+ */
+void RuntimeMeasurementsManager::addCLEvent(std::string name, cl::Event event) {
+	if (!enabled)
+		return;
+
+	PendingCLTimer timer;
+	timer.name = name;
+	timer.start = event;
+	timer.end = event;
+	timer.isTransfer = false;
+	this->addPendingCLTimer(timer);
+}
 
-	cl::Event endEvent = this->enqueueNewMarker(queue);
-	cl_ulong end = endEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+// Completed timers are collected this often, so the pending list stays short
+// even if the timings are never requested
+static const unsigned int PENDING_CL_TIMERS_RESOLVE_INTERVAL = 64;
+
+void RuntimeMeasurementsManager::addPendingCLTimer(const PendingCLTimer &timer) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	pendingCLTimers.push_back(timer);
+	pendingCLTimerInsertions++;
+	if (pendingCLTimerInsertions % PENDING_CL_TIMERS_RESOLVE_INTERVAL == 0)
+		this->resolvePendingCLTimers(false);
+}
+
+/**
+ * Adds the samples of the pending CL timers. Without waiting, only the
+ * timers where both events have completed are read. The events are waited
+ * for without holding the timer mutex, so that other threads can go on
+ * enqueueing meanwhile. Timers added during the wait are left pending.
+ */
+void RuntimeMeasurementsManager::resolvePendingCLTimers(bool wait) {
+	if (wait) {
+		std::vector<cl::Event> events;
+		{
+			boost::recursive_mutex::scoped_lock lock(timerMutex);
+			std::list<PendingCLTimer>::iterator it;
+			for (it = pendingCLTimers.begin(); it != pendingCLTimers.end(); ++it) {
+				events.push_back(it->start);
+				if (it->end() != it->start())
+					events.push_back(it->end);
+			}
+		}
+		for (unsigned int i = 0; i < events.size(); i++) {
+			boost::chrono::steady_clock::time_point waitStart = boost::chrono::steady_clock::now();
+			events[i].wait();
+			this->recordBlockingCall("timer readback", __FILE__, __LINE__, waitStart, boost::chrono::steady_clock::now());
+		}
+	}
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::list<PendingCLTimer>::iterator it = pendingCLTimers.begin();
+	while (it != pendingCLTimers.end()) {
+		if (!(isComplete(it->start) && isComplete(it->end))) {
+			++it;
+			continue;
+		}
+		cl_ulong start, end;
+		try {
+			start = it->start.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			if (it->start() == it->end())
+				end = it->end.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			else
+				end = it->end.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		} catch (cl::Error &error) {
+			if (error.err() != CL_PROFILING_INFO_NOT_AVAILABLE)
+				throw;
+			// Enqueued on a queue without profiling, there is nothing to measure
+			it = pendingCLTimers.erase(it);
+			continue;
+		}
+
+		double runtime_ms = (end - start) * 1.0e-6; //converting from nano- to milliseconds
+		if (it->isTransfer) {
+			it->transfer.runtime = runtime_ms;
+			this->addTimedTransfer(it->transfer);
+		} else {
+			this->addSampleToRuntimeMeasurement(it->name, runtime_ms);
+			if (it->counters)
+				this->addCounterSamples(it->name, *it->counters);
+			if (!it->work.isEmpty()) {
+				KernelRoofline &roofline = rooflines[it->name];
+				roofline.name = it->name;
+				roofline.launches++;
+				roofline.runtime += runtime_ms;
+				roofline.bytes += it->work.bytesRead + it->work.bytesWritten;
+				roofline.operations += it->work.operations;
+			}
+		}
+		it = pendingCLTimers.erase(it);
+	}
+}
+
+unsigned int RuntimeMeasurementsManager::getNumberOfPendingCLTimers() const {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	return pendingCLTimers.size();
+}
 
-	double runtime_ms = (end - start) * 1.0e-6; //converting from nano- to milliseconds
-	this->addSampleToRuntimeMeasurement(name, runtime_ms);
+bool RuntimeMeasurementsManager::isComplete(cl::Event event) {
+	return event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
 }
 
+/**
+ * Regular timers measure host time with the monotonic steady clock
+ */
 void RuntimeMeasurementsManager::startRegularTimer(std::string name) {
 	if (!enabled)
 		return;
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	startTimes[name] = boost::chrono::steady_clock::now();
 }
 
 void RuntimeMeasurementsManager::stopRegularTimer(std::string name) {
 	if (!enabled)
 		return;
+
+	boost::chrono::steady_clock::time_point end = boost::chrono::steady_clock::now();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	if (startTimes.count(name) == 0)
+		throw oul::Exception("Unknown regular timer", __LINE__, __FILE__);
+
+	boost::chrono::duration<double, boost::milli> runtime = end - startTimes[name];
+	if (tracing) {
+		TraceEvent span;
+		span.name = name;
+		span.category = "host";
+		span.track = this->getHostThreadTrack();
+		span.bytes = 0;
+		span.hostStart = startTimes[name];
+		span.hostEnd = end;
+		traceEvents.push_back(span);
+	}
+	startTimes.erase(name);
+	this->addSampleToRuntimeMeasurement(name, runtime.count());
 }
 
 void RuntimeMeasurementsManager::startNumberedCLTimer(std::string name, cl::CommandQueue queue) {
 	if (!enabled)
 		return;
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	numberings[name]++;
+	this->startCLTimer(this->getNumberedName(name), queue);
 }
 
 void RuntimeMeasurementsManager::stopNumberedCLTimer(std::string name, cl::CommandQueue queue) {
 	if (!enabled)
 		return;
+
+	this->stopCLTimer(this->getNumberedName(name), queue);
 }
 
 void RuntimeMeasurementsManager::startNumberedRegularTimer(std::string name) {
 	if (!enabled)
 		return;
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	numberings[name]++;
+	this->startRegularTimer(this->getNumberedName(name));
 }
 
 void RuntimeMeasurementsManager::stopNumberedRegularTimer(std::string name) {
 	if (!enabled)
 		return;
+
+	this->stopRegularTimer(this->getNumberedName(name));
+}
+
+/**
+ * The number of the last started timer in the series, 0 if none was started
+ */
+unsigned int RuntimeMeasurementsManager::getNumbering(std::string name) const {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::map<std::string, unsigned int>::const_iterator it = numberings.find(name);
+	return it == numberings.end() ? 0 : it->second;
+}
+
+std::string RuntimeMeasurementsManager::getNumberedName(std::string name) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	if (numberings.count(name) == 0)
+		throw oul::Exception("Unknown numbered timer", __LINE__, __FILE__);
+	return name + "#" + oul::number(numberings[name]);
+}
+
+/**
+ * Returns the handle for the name, creating it the first time
+ */
+TimerHandle RuntimeMeasurementsManager::timer(std::string name) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	if (timerIds.count(name) == 0) {
+		timerNames.push_back(name);
+		timerIds[name] = timerNames.size(); // Ids start at 1
+	}
+	return TimerHandle(timerIds[name]);
+}
+
+boost::thread_specific_ptr<RuntimeMeasurementsManager::ThreadLocalSamples> RuntimeMeasurementsManager::threadLocalSamples(
+		&RuntimeMeasurementsManager::releaseThreadSamples);
+// Never destroyed, as the samples of the main thread are released after the
+// static objects have been destroyed
+static boost::mutex * serialMutex = new boost::mutex(); // Guards the serials and the live managers
+static unsigned int nextSerial = 0;
+static std::map<unsigned int, RuntimeMeasurementsManager *> * liveManagers = new std::map<unsigned int, RuntimeMeasurementsManager *>(); // By serial
+
+/**
+ * Only the first call from a thread takes the lock, to register the thread
+ */
+RuntimeMeasurementsManager::ThreadSamples &RuntimeMeasurementsManager::getThreadSamples() {
+	if (threadLocalSamples.get() == NULL)
+		threadLocalSamples.reset(new ThreadLocalSamples());
+	ThreadLocalSamples &samples = *threadLocalSamples;
+	ThreadLocalSamples::iterator it = samples.find(serial);
+	if (it != samples.end())
+		return *static_cast<ThreadSamples *>(it->second.get());
+
+	boost::shared_ptr<ThreadSamples> thread(new ThreadSamples());
+	{
+		boost::recursive_mutex::scoped_lock lock(timerMutex);
+		threadSamples.push_back(thread);
+	}
+	samples[serial] = thread;
+	return *thread;
+}
+
+/**
+ * Called when a thread exits. Its samples are merged into the managers that
+ * still exist, which then let go of its buffers.
+ */
+void RuntimeMeasurementsManager::releaseThreadSamples(ThreadLocalSamples * samples) {
+	{
+		boost::mutex::scoped_lock lock(*serialMutex);
+		ThreadLocalSamples::iterator it;
+		for (it = samples->begin(); it != samples->end(); ++it) {
+			std::map<unsigned int, RuntimeMeasurementsManager *>::iterator manager = liveManagers->find(it->first);
+			if (manager != liveManagers->end())
+				manager->second->removeThreadSamples(static_cast<ThreadSamples *>(it->second.get()));
+		}
+	}
+	delete samples;
+}
+
+void RuntimeMeasurementsManager::removeThreadSamples(ThreadSamples * thread) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	this->mergeThreadSamples(*thread);
+	for (unsigned int i = 0; i < threadSamples.size(); i++) {
+		if (threadSamples[i].get() == thread) {
+			threadSamples.erase(threadSamples.begin() + i);
+			break;
+		}
+	}
+}
+
+void RuntimeMeasurementsManager::startTimer(TimerHandle timer) {
+	if (!enabled || !timer.isValid())
+		return;
+
+	ThreadSamples &thread = this->getThreadSamples();
+	if (thread.starts.size() < timer.getId())
+		thread.starts.resize(timer.getId());
+	thread.starts[timer.getId()-1] = boost::chrono::steady_clock::now();
+}
+
+void RuntimeMeasurementsManager::stopTimer(TimerHandle timer) {
+	if (!enabled || !timer.isValid())
+		return;
+
+	boost::chrono::steady_clock::time_point end = boost::chrono::steady_clock::now();
+	ThreadSamples &thread = this->getThreadSamples();
+	if (thread.starts.size() < timer.getId() || thread.starts[timer.getId()-1] == boost::chrono::steady_clock::time_point())
+		throw oul::Exception("The timer was not started in this thread", __LINE__, __FILE__);
+	boost::chrono::duration<double, boost::milli> runtime = end - thread.starts[timer.getId()-1];
+	thread.starts[timer.getId()-1] = boost::chrono::steady_clock::time_point();
+	this->addSample(timer, runtime.count());
+}
+
+/**
+ * If the thread's buffer is full, the thread merges it itself
+ */
+void RuntimeMeasurementsManager::addSample(TimerHandle timer, double runtime) {
+	if (!enabled || !timer.isValid())
+		return;
+
+	ThreadSamples &thread = this->getThreadSamples();
+	HandleSample sample;
+	sample.timer = timer.getId();
+	sample.runtime = runtime;
+	while (!thread.samples.push(sample)) {
+		boost::recursive_mutex::scoped_lock lock(timerMutex);
+		this->mergeThreadSamples(thread);
+	}
+}
+
+void RuntimeMeasurementsManager::mergeThreadSamples() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	for (unsigned int i = 0; i < threadSamples.size(); i++)
+		this->mergeThreadSamples(*threadSamples[i]);
+}
+
+void RuntimeMeasurementsManager::mergeThreadSamples(ThreadSamples &thread) {
+	HandleSample sample;
+	while (thread.samples.pop(sample))
+		this->addSampleToRuntimeMeasurement(timerNames[sample.timer-1], sample.runtime);
 }
 
 RuntimeMeasurement RuntimeMeasurementsManager::getTiming(std::string name) {
+	this->mergeThreadSamples();
+	this->resolvePendingCLTimers();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
 	return *timings.at(name).get();
 }
 
+/**
+ * Applies to the timings that exist already as well as to new ones
+ */
+void RuntimeMeasurementsManager::setReservoirSize(unsigned int size) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	reservoirSize = size;
+	std::map<std::string, RuntimeMeasurementPtr>::iterator it;
+	for (it = timings.begin(); it != timings.end(); it++)
+		it->second->setReservoirSize(size);
+}
+
+unsigned int RuntimeMeasurementsManager::getReservoirSize() const {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	return reservoirSize;
+}
+
 void RuntimeMeasurementsManager::print(std::string name) {
 	if (!enabled)
 		return;
 
+	this->mergeThreadSamples();
+	this->resolvePendingCLTimers();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
 	timings.at(name)->print();
 }
 
@@ -84,26 +414,1019 @@ void RuntimeMeasurementsManager::printAll() {
 	if (!enabled)
 		return;
 
+	this->mergeThreadSamples();
+	this->resolvePendingCLTimers();
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
 	std::map<std::string, RuntimeMeasurementPtr>::iterator it;
 	for (it = timings.begin(); it != timings.end(); it++) {
 		it->second->print();
 	}
 }
 
-RuntimeMeasurementsManager::RuntimeMeasurementsManager() {
+RuntimeMeasurementsManager::RuntimeMeasurementsManager() :
+		enabled(false),
+		reservoirSize(0),
+		pendingCLTimerInsertions(0),
+		tracing(false),
+		instrumentingKernels(false),
+		peakBandwidth(0),
+		peakOperationRate(0),
+		launchLatency(0),
+		samplingPerfCounters(false),
+		detectingStalls(false),
+		regressionThreshold(0.1),
+		measuredPeakTransferBandwidth(0),
+		peakTransferBandwidth(0)
+	{
+	boost::mutex::scoped_lock lock(*serialMutex);
+	serial = nextSerial++;
+	(*liveManagers)[serial] = this;
+}
+
+RuntimeMeasurementsManager::~RuntimeMeasurementsManager() {
+	boost::mutex::scoped_lock lock(*serialMutex);
+	liveManagers->erase(serial);
+}
+
+TransferStatistics::TransferStatistics() :
+		transfers(0),
+		slowTransfers(0),
+		timedBytes(0),
+		timedRuntime(0)
+	{
+	bytes[TRANSFER_HOST_TO_DEVICE] = 0;
+	bytes[TRANSFER_DEVICE_TO_HOST] = 0;
+	bytes[TRANSFER_DEVICE_TO_DEVICE] = 0;
+}
+
+double TransferStatistics::getBandwidth() const {
+	if (timedRuntime <= 0)
+		return 0;
+	return timedBytes / (timedRuntime * 1.0e6);
+}
+
+void RuntimeMeasurementsManager::recordTransfer(TransferDirection direction, size_t bytes, cl::CommandQueue queue, std::string bufferName, cl::Event event) {
+	if (!enabled)
+		return;
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	TransferRecord transfer;
+	transfer.direction = direction;
+	transfer.bytes = bytes;
+	transfer.queue = queue() == NULL ? "No queue" : "Queue " + oul::number(this->getQueueTrack(queue));
+	transfer.bufferName = bufferName == "" ? "Unnamed" : bufferName;
+	transfer.runtime = -1;
+
+	if (event() != NULL) {
+		PendingCLTimer timer;
+		timer.start = event;
+		timer.end = event;
+		timer.isTransfer = true;
+		timer.transfer = transfer;
+		this->addPendingCLTimer(timer);
+	} else {
+		// Untimed transfers are never slow, so they can be counted at once
+		this->countTransfer(transfer, 0);
+	}
+}
+
+void RuntimeMeasurementsManager::setPeakTransferBandwidth(double gigabytesPerSecond) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	peakTransferBandwidth = gigabytesPerSecond;
+}
+
+// Smaller transfers are dominated by latency and are never flagged as slow
+static const size_t SLOW_TRANSFER_MINIMUM_BYTES = 64*1024;
+static const double SLOW_TRANSFER_FRACTION = 0.25;
+// Timed transfers are only judged against the peak when they leave a window
+// of this many, so that a peak measured shortly after them still counts
+static const unsigned int TRANSFER_WINDOW = 256;
+
+double RuntimeMeasurementsManager::getPeakTransferBandwidth() {
+	{
+		boost::recursive_mutex::scoped_lock lock(timerMutex);
+		if (peakTransferBandwidth > 0)
+			return peakTransferBandwidth;
+	}
+	this->resolvePendingCLTimers();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	return measuredPeakTransferBandwidth;
+}
+
+/**
+ * Called when the timing of a transfer has been read. Only the transfers in
+ * the window are kept, older ones are folded into the statistics.
+ */
+void RuntimeMeasurementsManager::addTimedTransfer(const TransferRecord &transfer) {
+	if (transfer.runtime > 0 && transfer.bytes >= SLOW_TRANSFER_MINIMUM_BYTES)
+		measuredPeakTransferBandwidth = std::max(measuredPeakTransferBandwidth, transfer.bytes / (transfer.runtime * 1.0e6));
+	recentTransfers.push_back(transfer);
+	if (recentTransfers.size() > TRANSFER_WINDOW) {
+		double peak = peakTransferBandwidth > 0 ? peakTransferBandwidth : measuredPeakTransferBandwidth;
+		this->countTransfer(recentTransfers.front(), peak);
+		recentTransfers.pop_front();
+	}
+}
+
+void RuntimeMeasurementsManager::countTransfer(const TransferRecord &transfer, double peak) {
+	this->addTransfer(transferTotal, transfer, peak);
+	this->addTransfer(queueTransfers[transfer.queue], transfer, peak);
+	this->addTransfer(bufferTransfers[transfer.bufferName], transfer, peak);
+}
+
+void RuntimeMeasurementsManager::addTransfer(TransferStatistics &statistics, const TransferRecord &transfer, double peak) const {
+	statistics.bytes[transfer.direction] += transfer.bytes;
+	statistics.transfers++;
+	if (transfer.runtime > 0) {
+		statistics.timedBytes += transfer.bytes;
+		statistics.timedRuntime += transfer.runtime;
+		double bandwidth = transfer.bytes / (transfer.runtime * 1.0e6);
+		if (transfer.bytes >= SLOW_TRANSFER_MINIMUM_BYTES && bandwidth < SLOW_TRANSFER_FRACTION * peak)
+			statistics.slowTransfers++;
+	}
+}
+
+TransferStatistics RuntimeMeasurementsManager::getTransferStatistics() {
+	this->resolvePendingCLTimers();
+	double peak = this->getPeakTransferBandwidth();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	TransferStatistics statistics = transferTotal;
+	for (unsigned int i = 0; i < recentTransfers.size(); i++)
+		this->addTransfer(statistics, recentTransfers[i], peak);
+	return statistics;
+}
+
+std::map<std::string, TransferStatistics> RuntimeMeasurementsManager::getTransferStatistics(bool perQueue) {
+	this->resolvePendingCLTimers();
+	double peak = this->getPeakTransferBandwidth();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::map<std::string, TransferStatistics> statistics = perQueue ? queueTransfers : bufferTransfers;
+	for (unsigned int i = 0; i < recentTransfers.size(); i++)
+		this->addTransfer(statistics[perQueue ? recentTransfers[i].queue : recentTransfers[i].bufferName], recentTransfers[i], peak);
+	return statistics;
+}
+
+std::map<std::string, TransferStatistics> RuntimeMeasurementsManager::getTransferStatisticsPerQueue() {
+	return this->getTransferStatistics(true);
+}
+
+std::map<std::string, TransferStatistics> RuntimeMeasurementsManager::getTransferStatisticsPerBuffer() {
+	return this->getTransferStatistics(false);
+}
+
+static void printTransferStatistics(std::string name, const TransferStatistics &statistics) {
+	std::cout << name << ": " <<
+			statistics.bytes[TRANSFER_HOST_TO_DEVICE] << " B host to device, " <<
+			statistics.bytes[TRANSFER_DEVICE_TO_HOST] << " B device to host, " <<
+			statistics.bytes[TRANSFER_DEVICE_TO_DEVICE] << " B device to device in " <<
+			statistics.transfers << " transfers";
+	if (statistics.timedRuntime > 0)
+		std::cout << ", " << statistics.getBandwidth() << " GB/s";
+	if (statistics.slowTransfers > 0)
+		std::cout << ", " << statistics.slowTransfers << " SLOW";
+	std::cout << std::endl;
+}
+
+void RuntimeMeasurementsManager::printTransfers() {
+	if (!enabled)
+		return;
+
+	std::cout << "Transfers" << std::endl;
+	std::cout << "----------------------------------------------------" << std::endl;
+	std::cout << "Peak bandwidth: " << this->getPeakTransferBandwidth() << " GB/s" << std::endl;
+	printTransferStatistics("Total", this->getTransferStatistics());
+	std::map<std::string, TransferStatistics> statistics = this->getTransferStatisticsPerQueue();
+	std::map<std::string, TransferStatistics>::iterator it;
+	for (it = statistics.begin(); it != statistics.end(); ++it)
+		printTransferStatistics(it->first, it->second);
+	statistics = this->getTransferStatisticsPerBuffer();
+	for (it = statistics.begin(); it != statistics.end(); ++it)
+		printTransferStatistics("Buffer " + it->first, it->second);
+	std::cout << "----------------------------------------------------" << std::endl;
+}
+
+void RuntimeMeasurementsManager::enableKernelInstrumentation() {
+	instrumentingKernels = true;
+}
+
+void RuntimeMeasurementsManager::disableKernelInstrumentation() {
+	instrumentingKernels = false;
+}
+
+bool RuntimeMeasurementsManager::isInstrumentingKernels() {
+	return enabled && instrumentingKernels;
+}
+
+/**
+ * Adds the launch as a pending timing, so nothing waits for the kernel
+ */
+void RuntimeMeasurementsManager::instrumentKernel(cl::Kernel kernel, cl::NDRange global, cl::Event event, KernelWork work) {
+	if (!this->isInstrumentingKernels())
+		return;
+
+	std::string key = getKernelKey(kernel, global);
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	kernelKeys.insert(key);
+	PendingCLTimer timer;
+	timer.name = key;
+	timer.start = event;
+	timer.end = event;
+	timer.isTransfer = false;
+	timer.work = work;
+	if (samplingPerfCounters && this->canSamplePerfCounters(event))
+		this->addPerfCounterSample(event, timer);
+	this->addPendingCLTimer(timer);
+}
+
+/**
+ * Leaves the counters off and reports why if they can't be opened, or if
+ * no CPU device can be sampled
+ */
+bool RuntimeMeasurementsManager::enablePerfCounters() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	Reporter reporter;
+	bool supported = false;
+	std::vector<cl::Platform> platforms;
+	try {
+		cl::Platform::get(&platforms);
+	} catch (cl::Error &error) {
+	}
+	for (unsigned int i = 0; i < platforms.size() && !supported; i++) {
+		std::vector<cl::Device> devices;
+		try {
+			platforms[i].getDevices(CL_DEVICE_TYPE_CPU, &devices);
+		} catch (cl::Error &error) {
+			continue; // No CPU devices on the platform
+		}
+		for (unsigned int j = 0; j < devices.size() && !supported; j++)
+			supported = canSamplePerfCounters(devices[j]);
+	}
+	if (!supported) {
+		reporter.report("Hardware counters are not available: no OpenCL 2.0 CPU device to sample", oul::WARNING);
+		samplingPerfCounters = false;
+		return false;
+	}
+
+	if (!perfCounters)
+		perfCounters = PerfCountersPtr(new PerfCounters());
+	if (!perfCounters->isOpen() && !perfCounters->open()) {
+		reporter.report("Hardware counters are not available: " + perfCounters->getError(), oul::WARNING);
+		samplingPerfCounters = false;
+		return false;
+	}
+	lastThreadScan = boost::chrono::steady_clock::now();
+	samplingPerfCounters = true;
+	return true;
+}
+
+void RuntimeMeasurementsManager::disablePerfCounters() {
+	samplingPerfCounters = false;
 }
 
-double RuntimeMeasurement::getSum() const {
-	return sum;
+bool RuntimeMeasurementsManager::isSamplingPerfCounters() {
+	return this->isInstrumentingKernels() && samplingPerfCounters;
 }
 
-double RuntimeMeasurement::getAverage() const {
-	return sum / samples;
+static bool isVersion2(std::string version) {
+	// "OpenCL <major>.<minor> ..."
+	return version.size() > 7 && std::atoi(version.substr(7).c_str()) >= 2;
 }
 
-double RuntimeMeasurement::getStdDeviation() const {
-	// TODO: implement
-    return -1;
+/**
+ * Before OpenCL 2.0, clSetEventCallback only accepts CL_COMPLETE, so there
+ * is no callback when the kernel starts running
+ */
+bool RuntimeMeasurementsManager::canSamplePerfCounters(cl::Device device) {
+	if ((device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) == 0)
+		return false;
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+	return isVersion2(device.getInfo<CL_DEVICE_VERSION>()) && isVersion2(platform.getInfo<CL_PLATFORM_VERSION>());
+}
+
+bool RuntimeMeasurementsManager::canSamplePerfCounters(cl::Event event) {
+	cl::CommandQueue queue = event.getInfo<CL_EVENT_COMMAND_QUEUE>();
+	if (perfCounterQueues.count(queue()) == 0)
+		perfCounterQueues[queue()] = canSamplePerfCounters(queue.getInfo<CL_QUEUE_DEVICE>());
+	return perfCounterQueues[queue()];
+}
+
+// Scanning for new threads reads /proc and opens counters for them, so it
+// is done at most this often on the enqueue path
+static const boost::chrono::milliseconds PERF_THREAD_SCAN_INTERVAL(100);
+
+/**
+ * Each callback owns a reference to the sample until it has run. If the
+ * callbacks can't be registered, the launch is timed without counters and
+ * sampling is turned off.
+ */
+void RuntimeMeasurementsManager::addPerfCounterSample(cl::Event event, PendingCLTimer &timer) {
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+	if (now - lastThreadScan >= PERF_THREAD_SCAN_INTERVAL) {
+		perfCounters->addNewThreads();
+		lastThreadScan = now;
+	}
+	boost::shared_ptr<PerfCounterSample> sample(new PerfCounterSample());
+	sample->counters = perfCounters;
+	boost::shared_ptr<PerfCounterSample> * running = new boost::shared_ptr<PerfCounterSample>(sample);
+	boost::shared_ptr<PerfCounterSample> * complete = new boost::shared_ptr<PerfCounterSample>(sample);
+	try {
+		event.setCallback(CL_RUNNING, perfCounterCallback, static_cast<void*>(running));
+	} catch (cl::Error &error) {
+		delete running;
+		delete complete;
+		this->reportPerfCounterFailure(error);
+		return;
+	}
+	try {
+		event.setCallback(CL_COMPLETE, perfCounterCallback, static_cast<void*>(complete));
+	} catch (cl::Error &error) {
+		delete complete;
+		this->reportPerfCounterFailure(error);
+		return;
+	}
+	timer.counters = sample;
+}
+
+void RuntimeMeasurementsManager::reportPerfCounterFailure(cl::Error &error) {
+	Reporter reporter;
+	reporter.report("Hardware counter sampling is turned off, the kernel callbacks could not be set: " +
+			std::string(error.what()) + " (" + getCLErrorString(error.err()) + ")", oul::WARNING);
+	samplingPerfCounters = false;
+}
+
+/**
+ * Called from an OpenCL runtime thread. The callbacks may run in any order,
+ * and with a negative status if the kernel failed.
+ */
+void CL_CALLBACK RuntimeMeasurementsManager::perfCounterCallback(cl_event event, cl_int status, void * user_data) {
+	boost::shared_ptr<PerfCounterSample> * sample = static_cast<boost::shared_ptr<PerfCounterSample>*>(user_data);
+	std::vector<double> values = (*sample)->counters->read();
+	{
+		boost::mutex::scoped_lock lock((*sample)->mutex);
+		if (status < 0)
+			(*sample)->failed = true;
+		else if (status == CL_RUNNING)
+			(*sample)->start = values;
+		else
+			(*sample)->end = values;
+		(*sample)->completed.notify_all();
+	}
+	delete sample;
+}
+
+/**
+ * The kernel has completed, but its callbacks may not have run yet. They
+ * are waited for briefly, and the sample is dropped if they don't run.
+ */
+void RuntimeMeasurementsManager::addCounterSamples(std::string name, PerfCounterSample &sample) {
+	boost::mutex::scoped_lock lock(sample.mutex);
+	boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(100);
+	while (!sample.failed && (sample.start.empty() || sample.end.empty())) {
+		if (sample.completed.wait_until(lock, deadline) == boost::cv_status::timeout)
+			return;
+	}
+	if (sample.failed)
+		return;
+
+	boost::recursive_mutex::scoped_lock timerLock(timerMutex);
+	for (int i = 0; i < PERF_NUMBER_OF_COUNTERS; i++) {
+		if (sample.start[i] >= 0 && sample.end[i] >= sample.start[i])
+			timings[name]->addCounterSample(PerfCounters::getName((PerfCounter)i), sample.end[i] - sample.start[i]);
+	}
+}
+
+/**
+ * The timings of all instrumented kernels, ordered by key
+ */
+std::vector<RuntimeMeasurement> RuntimeMeasurementsManager::getKernelTimings() {
+	this->resolvePendingCLTimers();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::vector<RuntimeMeasurement> kernelTimings;
+	std::set<std::string>::iterator it;
+	for (it = kernelKeys.begin(); it != kernelKeys.end(); ++it) {
+		if (timings.count(*it) > 0)
+			kernelTimings.push_back(*timings[*it]);
+	}
+	return kernelTimings;
+}
+
+/**
+ * The function name and the global size rounded up to a power of two, such as
+ * "constructHPLevel3D [2^18]", so that launches of very different sizes are
+ * not mixed in the same statistics.
+ */
+std::string RuntimeMeasurementsManager::getKernelKey(cl::Kernel kernel, cl::NDRange global) {
+	double workItems = 1;
+	const size_t * sizes = global;
+	for (unsigned int i = 0; i < global.dimensions(); i++)
+		workItems *= sizes[i];
+	unsigned int sizeClass = 0;
+	while (std::pow(2.0, (double)sizeClass) < workItems)
+		sizeClass++;
+	return kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() + " [2^" + oul::number(sizeClass) + "]";
+}
+
+KernelWork::KernelWork() :
+		bytesRead(0),
+		bytesWritten(0),
+		operations(0)
+	{
+}
+
+KernelWork::KernelWork(double bytesRead, double bytesWritten, double operations) :
+		bytesRead(bytesRead),
+		bytesWritten(bytesWritten),
+		operations(operations)
+	{
+}
+
+bool KernelWork::isEmpty() const {
+	return bytesRead <= 0 && bytesWritten <= 0 && operations <= 0;
+}
+
+KernelRoofline::KernelRoofline() :
+		launches(0),
+		runtime(0),
+		bytes(0),
+		operations(0),
+		attainable(0),
+		efficiency(0),
+		bound("unknown")
+	{
+}
+
+double KernelRoofline::getBandwidth() const {
+	return runtime > 0 ? bytes / (runtime * 1.0e6) : 0;
+}
+
+double KernelRoofline::getOperationRate() const {
+	return runtime > 0 ? operations / (runtime * 1.0e6) : 0;
+}
+
+double KernelRoofline::getIntensity() const {
+	return bytes > 0 ? operations / bytes : 0;
+}
+
+double KernelRoofline::getAverageRuntime() const {
+	return launches > 0 ? runtime / launches : 0;
+}
+
+void RuntimeMeasurementsManager::setRooflinePeaks(double gigabytesPerSecond, double gigaOperationsPerSecond, double launchLatency) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	peakBandwidth = gigabytesPerSecond;
+	peakOperationRate = gigaOperationsPerSecond;
+	this->launchLatency = launchLatency;
+}
+
+/**
+ * The probe's arithmetic loop is a dependent chain, so the compute peak is
+ * conservative and kernels may end up above the roof on wide devices.
+ */
+void RuntimeMeasurementsManager::setRooflinePeaks(const DeviceProbeResult &device) {
+	this->setRooflinePeaks(device.memoryBandwidth * 1.0e-6, device.getPeakOperations() * 1.0e-6, device.launchLatency);
+}
+
+// A kernel running for less than this many launch latencies is launch-bound
+static const double LAUNCH_BOUND_LATENCIES = 2.0;
+
+/**
+ * The annotated kernel keys, ordered by key, with their bound and the
+ * fraction of the roofline they achieve
+ */
+std::vector<KernelRoofline> RuntimeMeasurementsManager::getRoofline() {
+	this->resolvePendingCLTimers();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::vector<KernelRoofline> result;
+	std::map<std::string, KernelRoofline>::iterator it;
+	for (it = rooflines.begin(); it != rooflines.end(); ++it) {
+		KernelRoofline roofline = it->second;
+		double intensity = roofline.getIntensity();
+		if (peakBandwidth > 0 && roofline.bytes > 0) {
+			roofline.attainable = intensity * peakBandwidth;
+			if (peakOperationRate > 0)
+				roofline.attainable = std::min(roofline.attainable, peakOperationRate);
+		} else {
+			roofline.attainable = peakOperationRate;
+		}
+
+		if (roofline.operations > 0 && roofline.attainable > 0)
+			roofline.efficiency = roofline.getOperationRate() / roofline.attainable;
+		else if (peakBandwidth > 0)
+			roofline.efficiency = roofline.getBandwidth() / peakBandwidth;
+
+		if (launchLatency > 0 && roofline.getAverageRuntime() < LAUNCH_BOUND_LATENCIES * launchLatency)
+			roofline.bound = "launch";
+		else if (peakBandwidth > 0 && roofline.bytes > 0 && (peakOperationRate <= 0 || intensity < peakOperationRate / peakBandwidth))
+			roofline.bound = "memory";
+		else if (peakOperationRate > 0)
+			roofline.bound = "compute";
+		result.push_back(roofline);
+	}
+	return result;
+}
+
+void RuntimeMeasurementsManager::printRoofline() {
+	if (!enabled)
+		return;
+
+	std::vector<KernelRoofline> roofline = this->getRoofline();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::cout << "Roofline" << std::endl;
+	std::cout << "----------------------------------------------------" << std::endl;
+	std::cout << "Peaks: " << peakBandwidth << " GB/s, " << peakOperationRate << " GOP/s, " <<
+			launchLatency << " ms launch latency" << std::endl;
+	for (unsigned int i = 0; i < roofline.size(); i++) {
+		std::cout << roofline[i].name << ": " << roofline[i].launches << " launches of " <<
+				roofline[i].getAverageRuntime() << " ms, " <<
+				roofline[i].getBandwidth() << " GB/s, " <<
+				roofline[i].getOperationRate() << " GOP/s, " <<
+				roofline[i].getIntensity() << " op/B, " <<
+				roofline[i].bound << " bound";
+		if (roofline[i].efficiency > 0)
+			std::cout << " at " << roofline[i].efficiency*100.0 << "% of the roof";
+		std::cout << std::endl;
+	}
+	std::cout << "----------------------------------------------------" << std::endl;
+}
+
+void RuntimeMeasurementsManager::enableTracing() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	if (traceEvents.empty())
+		traceOrigin = boost::chrono::steady_clock::now();
+	tracing = true;
+}
+
+void RuntimeMeasurementsManager::disableTracing() {
+	tracing = false;
+}
+
+/**
+ * Commands are only traced while the measurements are enabled,
+ * since the queues only have profiling enabled then.
+ */
+bool RuntimeMeasurementsManager::isTracing() {
+	return enabled && tracing;
+}
+
+void RuntimeMeasurementsManager::traceCLCommand(std::string name, std::string category, cl::Event event, cl::CommandQueue queue, size_t bytes) {
+	if (!this->isTracing())
+		return;
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	TraceEvent command;
+	command.name = name;
+	command.category = category;
+	command.event = event;
+	command.track = this->getQueueTrack(queue);
+	command.bytes = bytes;
+	command.hostStart = command.hostEnd = boost::chrono::steady_clock::now();
+	traceEvents.push_back(command);
+}
+
+/**
+ * Records a span of host time, such as a blocking call, on the calling thread's track
+ */
+void RuntimeMeasurementsManager::traceHostSpan(std::string name, std::string category, boost::chrono::steady_clock::time_point start, boost::chrono::steady_clock::time_point end) {
+	if (!this->isTracing())
+		return;
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	TraceEvent span;
+	span.name = name;
+	span.category = category;
+	span.track = this->getHostThreadTrack();
+	span.bytes = 0;
+	span.hostStart = start;
+	span.hostEnd = end;
+	traceEvents.push_back(span);
+}
+
+unsigned int RuntimeMeasurementsManager::getNumberOfTraceEvents() const {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	return traceEvents.size();
+}
+
+void RuntimeMeasurementsManager::clearTrace() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	traceEvents.clear();
+	traceOrigin = boost::chrono::steady_clock::now();
+}
+
+unsigned int RuntimeMeasurementsManager::getHostThreadTrack() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	boost::thread::id thread = boost::this_thread::get_id();
+	if (threadTracks.count(thread) == 0) {
+		unsigned int track = threadTracks.size();
+		threadTracks[thread] = track;
+	}
+	return threadTracks[thread];
+}
+
+unsigned int RuntimeMeasurementsManager::getQueueTrack(cl::CommandQueue queue) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	if (queueTracks.count(queue()) == 0) {
+		unsigned int track = queueTracks.size();
+		queueTracks[queue()] = track;
+	}
+	return queueTracks[queue()];
+}
+
+double RuntimeMeasurementsManager::getTraceTime(boost::chrono::steady_clock::time_point time) const {
+	boost::chrono::duration<double, boost::micro> elapsed = time - traceOrigin;
+	return elapsed.count();
+}
+
+static std::string escapeJSON(const std::string &text) {
+	std::string escaped;
+	for (unsigned int i = 0; i < text.size(); i++) {
+		char c = text[i];
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		} else if ((unsigned char)c < 0x20) {
+			escaped += ' ';
+		} else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+/**
+ * Waits for the traced commands and reads their device times. Commands from
+ * queues without profiling are not available.
+ *
+ * Each device has its own clock, which is mapped to the host clock with the
+ * smallest difference between when a command of that device was traced on
+ * the host and when the device says it was queued, as a command can't be
+ * queued after it was traced.
+ */
+void RuntimeMeasurementsManager::getDeviceTimes(std::vector<DeviceTimes> &times, std::vector<bool> &available) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	times.assign(traceEvents.size(), DeviceTimes());
+	available.assign(traceEvents.size(), false);
+	std::vector<cl_ulong> deviceTimes(traceEvents.size()*4);
+	std::vector<cl_device_id> devices(traceEvents.size());
+	std::map<cl_command_queue, cl_device_id> queueDevices;
+	std::map<cl_device_id, double> offsets; // Host trace time minus device time, in us
+	for (unsigned int i = 0; i < traceEvents.size(); i++) {
+		if (traceEvents[i].event() == NULL)
+			continue;
+		cl_ulong * t = &deviceTimes[i*4];
+		try {
+			traceEvents[i].event.wait();
+			t[0] = traceEvents[i].event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+			t[1] = traceEvents[i].event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+			t[2] = traceEvents[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			t[3] = traceEvents[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		} catch (cl::Error &error) {
+			continue;
+		}
+		// The plain handles, as they are not kept
+		cl_command_queue queue = NULL;
+		if (clGetEventInfo(traceEvents[i].event(), CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue, NULL) != CL_SUCCESS)
+			continue;
+		if (queueDevices.count(queue) == 0) {
+			cl_device_id device = NULL;
+			clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL);
+			queueDevices[queue] = device;
+		}
+		devices[i] = queueDevices[queue];
+		available[i] = true;
+		double difference = this->getTraceTime(traceEvents[i].hostEnd) - t[0] * 1.0e-3;
+		std::map<cl_device_id, double>::iterator offset = offsets.find(devices[i]);
+		if (offset == offsets.end())
+			offsets[devices[i]] = difference;
+		else if (difference < offset->second)
+			offset->second = difference;
+	}
+	for (unsigned int i = 0; i < traceEvents.size(); i++) {
+		if (!available[i])
+			continue;
+		double offset = offsets[devices[i]];
+		times[i].queued = deviceTimes[i*4] * 1.0e-3 + offset;
+		times[i].submit = deviceTimes[i*4+1] * 1.0e-3 + offset;
+		times[i].start = deviceTimes[i*4+2] * 1.0e-3 + offset;
+		times[i].end = deviceTimes[i*4+3] * 1.0e-3 + offset;
+	}
+}
+
+std::vector<RuntimeMeasurementsManager::HostSpan> RuntimeMeasurementsManager::getHostSpans() const {
+	std::vector<HostSpan> spans;
+	for (unsigned int i = 0; i < traceEvents.size(); i++) {
+		if (traceEvents[i].event() != NULL)
+			continue;
+		HostSpan span;
+		span.start = this->getTraceTime(traceEvents[i].hostStart);
+		span.end = this->getTraceTime(traceEvents[i].hostEnd);
+		span.event = i;
+		spans.push_back(span);
+	}
+	std::sort(spans.begin(), spans.end());
+	return spans;
+}
+
+/**
+ * Writes the trace in the Chrome trace event format, which chrome://tracing
+ * and Perfetto open. Host spans are in process 0 with a track per thread,
+ * device commands in process 1 with a track per queue.
+ * Commands from queues without profiling are left out.
+ */
+void RuntimeMeasurementsManager::exportChromeTrace(std::string filename) {
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		std::string msg = "Could not write the trace to " + filename;
+		throw oul::Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::vector<DeviceTimes> times;
+	std::vector<bool> available;
+	this->getDeviceTimes(times, available);
+
+	file << std::fixed << std::setprecision(3);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+	file << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":0,\"args\":{\"name\":\"Host\"}}," << std::endl;
+	file << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"args\":{\"name\":\"Device\"}}";
+	std::map<cl_command_queue, unsigned int>::iterator it;
+	for (it = queueTracks.begin(); it != queueTracks.end(); ++it) {
+		file << "," << std::endl << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << it->second <<
+				",\"args\":{\"name\":\"Queue " << it->second << "\"}}";
+	}
+	for (unsigned int i = 0; i < traceEvents.size(); i++) {
+		const TraceEvent &event = traceEvents[i];
+		std::string name = escapeJSON(event.name);
+		std::string category = escapeJSON(event.category);
+		if (event.event() == NULL) {
+			file << "," << std::endl << "{\"ph\":\"X\",\"name\":\"" << name << "\",\"cat\":\"" << category <<
+					"\",\"pid\":0,\"tid\":" << event.track << ",\"ts\":" << this->getTraceTime(event.hostStart) <<
+					",\"dur\":" << this->getTraceTime(event.hostEnd) - this->getTraceTime(event.hostStart) << "}";
+		} else if (available[i]) {
+			const DeviceTimes &t = times[i];
+			file << "," << std::endl << "{\"ph\":\"X\",\"name\":\"" << name << "\",\"cat\":\"" << category <<
+					"\",\"pid\":1,\"tid\":" << event.track << ",\"ts\":" << t.start <<
+					",\"dur\":" << t.end - t.start << ",\"args\":{\"queued\":" << t.queued <<
+					",\"submit\":" << t.submit << ",\"bytes\":" << event.bytes << "}}";
+		}
+	}
+	file << std::endl << "]}" << std::endl;
+}
+
+void RuntimeMeasurementsManager::enableStallDetection() {
+	detectingStalls = true;
+}
+
+void RuntimeMeasurementsManager::disableStallDetection() {
+	detectingStalls = false;
+}
+
+bool RuntimeMeasurementsManager::isDetectingStalls() {
+	return enabled && detectingStalls;
+}
+
+StallSite::StallSite() :
+		calls(0),
+		total(0),
+		max(0)
+	{
+}
+
+double StallSite::getAverage() const {
+	return calls > 0 ? total / calls : 0;
+}
+
+void RuntimeMeasurementsManager::recordBlockingCall(std::string call, const char * file, int line, boost::chrono::steady_clock::time_point start, boost::chrono::steady_clock::time_point end) {
+	this->traceHostSpan(call, "blocking", start, end);
+	if (!this->isDetectingStalls())
+		return;
+
+	// Only the file name, without the directories of the build machine
+	std::string site = file;
+	std::string::size_type separator = site.find_last_of("/\\");
+	if (separator != std::string::npos)
+		site = site.substr(separator+1);
+	site += ":" + oul::number(line);
+
+	boost::chrono::duration<double, boost::milli> stalled = end - start;
+	boost::mutex::scoped_lock lock(stallMutex);
+	StallSite &stall = stalls[call + " " + site];
+	stall.call = call;
+	stall.site = site;
+	stall.calls++;
+	stall.total += stalled.count();
+	stall.max = std::max(stall.max, stalled.count());
+}
+
+std::vector<StallSite> RuntimeMeasurementsManager::getStallSites() {
+	boost::mutex::scoped_lock lock(stallMutex);
+	std::vector<std::pair<double, std::string> > order;
+	std::map<std::string, StallSite>::iterator it;
+	for (it = stalls.begin(); it != stalls.end(); ++it)
+		order.push_back(std::make_pair(it->second.total, it->first));
+	std::sort(order.rbegin(), order.rend());
+	std::vector<StallSite> sites;
+	for (unsigned int i = 0; i < order.size(); i++)
+		sites.push_back(stalls[order[i].second]);
+	return sites;
+}
+
+void RuntimeMeasurementsManager::clearStalls() {
+	boost::mutex::scoped_lock lock(stallMutex);
+	stalls.clear();
+}
+
+void RuntimeMeasurementsManager::printStalls() {
+	if (!enabled)
+		return;
+
+	std::vector<StallSite> sites = this->getStallSites();
+	std::cout << "Host stalls in blocking calls" << std::endl;
+	std::cout << "----------------------------------------------------" << std::endl;
+	for (unsigned int i = 0; i < sites.size(); i++) {
+		std::cout << sites[i].total << " ms in " << sites[i].calls << " calls to " << sites[i].call <<
+				" at " << sites[i].site << ", " << sites[i].getAverage() << " ms average, " <<
+				sites[i].max << " ms max" << std::endl;
+	}
+	std::cout << "----------------------------------------------------" << std::endl;
+}
+
+QueueUtilization::QueueUtilization() :
+		commands(0),
+		span(0),
+		busy(0)
+	{
+}
+
+double QueueUtilization::getUtilization() const {
+	return span > 0 ? busy / span : 0;
+}
+
+/**
+ * One entry per queue that has traced commands, ordered by queue number
+ */
+std::vector<QueueUtilization> RuntimeMeasurementsManager::getQueueUtilization() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::vector<DeviceTimes> times;
+	std::vector<bool> available;
+	this->getDeviceTimes(times, available);
+	std::vector<HostSpan> spans = this->getHostSpans();
+
+	std::map<unsigned int, std::vector<unsigned int> > commands;
+	for (unsigned int i = 0; i < traceEvents.size(); i++) {
+		if (available[i])
+			commands[traceEvents[i].track].push_back(i);
+	}
+	std::vector<QueueUtilization> result;
+	std::map<unsigned int, std::vector<unsigned int> >::iterator it;
+	for (it = commands.begin(); it != commands.end(); ++it)
+		result.push_back(this->getUtilization("Queue " + oul::number(it->first), it->second, times, spans));
+	return result;
+}
+
+/**
+ * The device is busy when any of the queues is
+ */
+QueueUtilization RuntimeMeasurementsManager::getDeviceUtilization() {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::vector<DeviceTimes> times;
+	std::vector<bool> available;
+	this->getDeviceTimes(times, available);
+
+	std::vector<unsigned int> commands;
+	for (unsigned int i = 0; i < traceEvents.size(); i++) {
+		if (available[i])
+			commands.push_back(i);
+	}
+	return this->getUtilization("All queues", commands, times, this->getHostSpans());
+}
+
+QueueUtilization RuntimeMeasurementsManager::getUtilization(std::string name, const std::vector<unsigned int> &commands, const std::vector<DeviceTimes> &times, const std::vector<HostSpan> &spans) {
+	QueueUtilization utilization;
+	utilization.queue = name;
+	utilization.commands = commands.size();
+	if (commands.empty())
+		return utilization;
+
+	std::vector<std::pair<double, unsigned int> > starts;
+	for (unsigned int i = 0; i < commands.size(); i++)
+		starts.push_back(std::make_pair(times[commands[i]].start, commands[i]));
+	std::sort(starts.begin(), starts.end());
+
+	double first = starts[0].first;
+	double busyStart = first;
+	double busyEnd = times[starts[0].second].end;
+	unsigned int last = starts[0].second; // The command that ends the busy stretch
+	// The gaps come in order, so the host spans that overlap them are swept
+	// along instead of searched for each gap
+	std::vector<HostSpan> active;
+	unsigned int nextSpan = 0;
+	for (unsigned int i = 1; i < starts.size(); i++) {
+		double start = starts[i].first;
+		unsigned int command = starts[i].second;
+		double end = times[command].end;
+		if (start > busyEnd) {
+			utilization.busy += busyEnd - busyStart;
+			IdleGap gap;
+			gap.start = busyEnd * 1.0e-3;
+			gap.duration = (start - busyEnd) * 1.0e-3;
+			gap.before = traceEvents[last].name;
+			gap.after = traceEvents[command].name;
+			while (nextSpan < spans.size() && spans[nextSpan].start < start)
+				active.push_back(spans[nextSpan++]);
+			std::vector<HostSpan> overlapping;
+			for (unsigned int j = 0; j < active.size(); j++) {
+				if (active[j].end > busyEnd)
+					overlapping.push_back(active[j]);
+			}
+			active.swap(overlapping);
+			gap.cause = this->getIdleCause(busyEnd, start, command, active);
+			utilization.idleByCause[gap.cause] += gap.duration;
+			utilization.gaps.push_back(gap);
+			busyStart = start;
+		}
+		if (end >= busyEnd) {
+			busyEnd = end;
+			last = command;
+		}
+	}
+	utilization.busy = (utilization.busy + busyEnd - busyStart) * 1.0e-3;
+	utilization.span = (busyEnd - first) * 1.0e-3;
+	return utilization;
+}
+
+/**
+ * If the next command was traced after the queue went idle, the host was
+ * late. The gap is put on the host span, a blocking call or a timer, that
+ * overlaps it the most. Of spans that overlap it equally, such as a timer
+ * around a blocking call, the shortest and thus innermost is chosen.
+ * Only the host spans that started before the gap ended and are still
+ * running when it starts are passed in.
+ */
+std::string RuntimeMeasurementsManager::getIdleCause(double start, double end, unsigned int next, const std::vector<HostSpan> &active) const {
+	double enqueued = this->getTraceTime(traceEvents[next].hostEnd);
+	if (enqueued <= start)
+		return "device";
+
+	double late = std::min(enqueued, end);
+	int cause = -1;
+	double causeOverlap = 0;
+	double causeDuration = 0;
+	for (unsigned int i = 0; i < active.size(); i++) {
+		double spanStart = active[i].start;
+		double spanEnd = active[i].end;
+		double overlap = std::min(spanEnd, late) - std::max(spanStart, start);
+		if (overlap <= 0)
+			continue;
+		if (overlap > causeOverlap || (overlap == causeOverlap && spanEnd - spanStart < causeDuration)) {
+			cause = active[i].event;
+			causeOverlap = overlap;
+			causeDuration = spanEnd - spanStart;
+		}
+	}
+	if (cause < 0)
+		return "host";
+	if (traceEvents[cause].category == "blocking")
+		return traceEvents[cause].name;
+	return "host: " + traceEvents[cause].name;
+}
+
+static void printQueueUtilization(const QueueUtilization &utilization) {
+	std::cout << utilization.queue << ": " << utilization.commands << " commands, " <<
+			utilization.busy << " ms busy of " << utilization.span << " ms, " <<
+			utilization.getUtilization()*100.0 << "% utilization, " <<
+			utilization.gaps.size() << " idle gaps" << std::endl;
+	std::map<std::string, double>::const_iterator it;
+	for (it = utilization.idleByCause.begin(); it != utilization.idleByCause.end(); ++it)
+		std::cout << "  idle " << it->second << " ms: " << it->first << std::endl;
+}
+
+/**
+ * Prints the utilization of each queue and of all together, with the
+ * largest idle gaps
+ */
+void RuntimeMeasurementsManager::printUtilization() {
+	if (!enabled)
+		return;
+
+	std::cout << "Utilization" << std::endl;
+	std::cout << "----------------------------------------------------" << std::endl;
+	std::vector<QueueUtilization> queues = this->getQueueUtilization();
+	for (unsigned int i = 0; i < queues.size(); i++)
+		printQueueUtilization(queues[i]);
+	QueueUtilization device = this->getDeviceUtilization();
+	printQueueUtilization(device);
+
+	std::vector<std::pair<double, unsigned int> > largest;
+	for (unsigned int i = 0; i < device.gaps.size(); i++)
+		largest.push_back(std::make_pair(device.gaps[i].duration, i));
+	std::sort(largest.rbegin(), largest.rend());
+	for (unsigned int i = 0; i < largest.size() && i < 5; i++) {
+		const IdleGap &gap = device.gaps[largest[i].second];
+		std::cout << "  " << gap.duration << " ms at " << gap.start << " ms between " <<
+				gap.before << " and " << gap.after << ": " << gap.cause << std::endl;
+	}
+	std::cout << "----------------------------------------------------" << std::endl;
 }
 
 bool RuntimeMeasurementsManager::isEnabled() {
@@ -116,9 +1439,9 @@ cl::Event RuntimeMeasurementsManager::enqueueNewMarker(cl::CommandQueue queue) {
     // Use deprecated API
     queue.enqueueMarker(&event);
 #else
-    queue.enqueueMarkerWithWaitList(NULL, &event)
+    queue.enqueueMarkerWithWaitList(NULL, &event);
 #endif
-    queue.finish();
+    queue.flush();
 
     return event;
 }
@@ -130,17 +1453,66 @@ void RuntimeMeasurementsManager::verifyThatEventExists(std::string name) {
 }
 
 void RuntimeMeasurementsManager::verifyQueueProfilingIsEnabled(cl::CommandQueue queue) {
-    if (queue.getInfo<CL_QUEUE_PROPERTIES>() != CL_QUEUE_PROFILING_ENABLE) {
+    if ((queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) == 0) {
         throw oul::Exception(
-                "Failed to get profiling info. Make sure that RuntimeMeasurementManager::enable() is called before the OpenCL context is created.",
+                "Failed to get profiling info. Make sure that the queue is fetched from Context::getQueue() after RuntimeMeasurementManager::enable() is called.",
                 __LINE__, __FILE__);
     }
 }
 
+BlockingCall::BlockingCall(RuntimeMeasurementsManagerPtr manager, std::string call, const char * file, int line) :
+		manager(manager),
+		call(call),
+		file(file),
+		line(line),
+		start(boost::chrono::steady_clock::now())
+	{
+}
+
+BlockingCall::~BlockingCall() {
+	if (manager)
+		manager->recordBlockingCall(call, file, line, start, boost::chrono::steady_clock::now());
+}
+
+ScopedTimer::ScopedTimer(RuntimeMeasurementsManagerPtr manager, TimerHandle timer) :
+		manager(manager),
+		numbered(false),
+		handle(timer)
+	{
+	manager->startTimer(handle);
+}
+
+ScopedTimer::ScopedTimer(RuntimeMeasurementsManagerPtr manager, std::string name, bool numbered) :
+		manager(manager),
+		name(name),
+		numbered(numbered)
+	{
+	if (numbered)
+		manager->startNumberedRegularTimer(name);
+	else
+		manager->startRegularTimer(name);
+}
+
+/**
+ * Doesn't throw, also not if the manager was enabled while the timer was in scope
+ */
+ScopedTimer::~ScopedTimer() {
+	try {
+		if (handle.isValid())
+			manager->stopTimer(handle);
+		else if (numbered)
+			manager->stopNumberedRegularTimer(name);
+		else
+			manager->stopRegularTimer(name);
+	} catch (oul::Exception &exception) {
+	}
+}
+
 void RuntimeMeasurementsManager::addSampleToRuntimeMeasurement(std::string name, double runtime) {
+    boost::recursive_mutex::scoped_lock lock(timerMutex);
     if (timings.count(name) == 0) {
         // No timings with this name exists, create a new one
-        RuntimeMeasurementPtr runtimeMeasurement(new RuntimeMeasurement(name));
+        RuntimeMeasurementPtr runtimeMeasurement(new RuntimeMeasurement(name, reservoirSize));
         runtimeMeasurement->addSample(runtime);
         timings[name] =  runtimeMeasurement;
     } else {
@@ -148,4 +1520,149 @@ void RuntimeMeasurementsManager::addSampleToRuntimeMeasurement(std::string name,
     }
 }
 
+static const char * STATISTICS_CSV_HEADER = "name,samples,total,average,stddev,min,max,p50,p90,p99,p99.9";
+
+/**
+ * One object per timing with its sample count and statistics, all times in ms
+ */
+void RuntimeMeasurementsManager::exportJSON(std::string filename) {
+	this->mergeThreadSamples();
+	this->resolvePendingCLTimers();
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		std::string msg = "Could not write the measurements to " + filename;
+		throw oul::Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	file << "{\"measurements\":[";
+	std::map<std::string, RuntimeMeasurementPtr>::iterator it;
+	for (it = timings.begin(); it != timings.end(); ++it) {
+		const RuntimeMeasurement &m = *it->second;
+		file << (it == timings.begin() ? "" : ",") << std::endl <<
+				"{\"name\":\"" << escapeJSON(it->first) << "\",\"samples\":" << m.getNumberOfSamples() <<
+				",\"total\":" << m.getSum() << ",\"average\":" << m.getAverage() <<
+				",\"stddev\":" << m.getStdDeviation() << ",\"min\":" << m.getMin() << ",\"max\":" << m.getMax() <<
+				",\"p50\":" << m.getPercentile(50) << ",\"p90\":" << m.getPercentile(90) <<
+				",\"p99\":" << m.getPercentile(99) << ",\"p99.9\":" << m.getPercentile(99.9);
+		std::vector<std::string> counters = m.getCounterNames();
+		for (unsigned int i = 0; i < counters.size(); i++) {
+			file << (i == 0 ? ",\"counters\":{" : ",") << "\"" << escapeJSON(counters[i]) << "\":" <<
+					m.getCounterAverage(counters[i]) << (i == counters.size()-1 ? "}" : "");
+		}
+		file << "}";
+	}
+	file << std::endl << "]}" << std::endl;
+}
+
+void RuntimeMeasurementsManager::exportCSV(std::string filename) {
+	this->mergeThreadSamples();
+	this->resolvePendingCLTimers();
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		std::string msg = "Could not write the measurements to " + filename;
+		throw oul::Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	file << STATISTICS_CSV_HEADER << std::endl;
+	std::map<std::string, RuntimeMeasurementPtr>::iterator it;
+	for (it = timings.begin(); it != timings.end(); ++it) {
+		const RuntimeMeasurement &m = *it->second;
+		std::string name = it->first;
+		if (name.find_first_of(",\"") != std::string::npos) {
+			std::string quoted = "\"";
+			for (unsigned int i = 0; i < name.size(); i++)
+				quoted += name[i] == '"' ? std::string("\"\"") : std::string(1, name[i]);
+			name = quoted + "\"";
+		}
+		file << name << "," << m.getNumberOfSamples() << "," << m.getSum() << "," << m.getAverage() << "," <<
+				m.getStdDeviation() << "," << m.getMin() << "," << m.getMax() << "," << m.getPercentile(50) << "," <<
+				m.getPercentile(90) << "," << m.getPercentile(99) << "," << m.getPercentile(99.9) << std::endl;
+	}
+}
+
+/**
+ * Reads a file written by exportJSON(), and replaces any earlier baseline
+ */
+void RuntimeMeasurementsManager::loadBaseline(std::string filename) {
+	boost::property_tree::ptree tree;
+	try {
+		boost::property_tree::read_json(filename, tree);
+	} catch (boost::property_tree::ptree_error &error) {
+		std::string msg = "Could not read the baseline " + filename + ": " + error.what();
+		throw oul::Exception(msg.c_str(), __LINE__, __FILE__);
+	}
+
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	baseline.clear();
+	boost::property_tree::ptree::const_iterator it;
+	for (it = tree.get_child("measurements", boost::property_tree::ptree()).begin();
+			it != tree.get_child("measurements", boost::property_tree::ptree()).end(); ++it) {
+		BaselineTiming timing;
+		timing.average = it->second.get<double>("average", 0.0);
+		timing.p99 = it->second.get<double>("p99", 0.0);
+		baseline[it->second.get<std::string>("name", "")] = timing;
+	}
+}
+
+/**
+ * The allowed relative increase, such as 0.1 for 10 %, for all timings
+ * without a threshold of their own
+ */
+void RuntimeMeasurementsManager::setRegressionThreshold(double fraction) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	regressionThreshold = fraction;
+}
+
+void RuntimeMeasurementsManager::setRegressionThreshold(std::string name, double fraction) {
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	regressionThresholds[name] = fraction;
+}
+
+/**
+ * Compares the average and the p99 of every timing that is in the baseline
+ */
+std::vector<MeasurementRegression> RuntimeMeasurementsManager::findRegressions() {
+	this->mergeThreadSamples();
+	this->resolvePendingCLTimers();
+	boost::recursive_mutex::scoped_lock lock(timerMutex);
+	std::vector<MeasurementRegression> regressions;
+	std::map<std::string, BaselineTiming>::iterator it;
+	for (it = baseline.begin(); it != baseline.end(); ++it) {
+		if (timings.count(it->first) == 0)
+			continue;
+		const RuntimeMeasurement &m = *timings[it->first];
+		double threshold = regressionThresholds.count(it->first) > 0 ? regressionThresholds[it->first] : regressionThreshold;
+
+		MeasurementRegression regression;
+		regression.name = it->first;
+		regression.threshold = threshold;
+		if (it->second.average > 0 && m.getAverage() > it->second.average * (1.0 + threshold)) {
+			regression.statistic = "average";
+			regression.baseline = it->second.average;
+			regression.current = m.getAverage();
+			regressions.push_back(regression);
+		}
+		if (it->second.p99 > 0 && m.getPercentile(99) > it->second.p99 * (1.0 + threshold)) {
+			regression.statistic = "p99";
+			regression.baseline = it->second.p99;
+			regression.current = m.getPercentile(99);
+			regressions.push_back(regression);
+		}
+	}
+	return regressions;
+}
+
+bool RuntimeMeasurementsManager::printRegressions() {
+	std::vector<MeasurementRegression> regressions = this->findRegressions();
+	for (unsigned int i = 0; i < regressions.size(); i++) {
+		const MeasurementRegression &regression = regressions[i];
+		std::cout << "REGRESSION " << regression.name << " " << regression.statistic << ": " << regression.baseline <<
+				" ms -> " << regression.current << " ms (+" << regression.getIncrease()*100 << " %, allowed " <<
+				regression.threshold*100 << " %)" << std::endl;
+	}
+	return regressions.size() > 0;
+}
+
 } //namespace oul
@@ -3,51 +3,526 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <set>
+#include <boost/chrono.hpp>
+#include <boost/function.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
 #include "CL/OpenCL.hpp"
 #include "RuntimeMeasurement.hpp"
+#include "PerfCounters.hpp"
+#include "OulConfig.hpp"
 
 namespace oul {
 
+class DeviceProbeResult;
+
+enum TransferDirection {
+	TRANSFER_HOST_TO_DEVICE,
+	TRANSFER_DEVICE_TO_HOST,
+	TRANSFER_DEVICE_TO_DEVICE
+};
+
+/**
+ * Bytes moved in each direction, and the effective bandwidth of the
+ * transfers that were timed with an event
+ */
+struct TransferStatistics {
+	TransferStatistics();
+	double getBandwidth() const; // GB/s, 0 if none were timed
+
+	cl_ulong bytes[3]; // Indexed by TransferDirection
+	unsigned int transfers;
+	unsigned int slowTransfers;
+	cl_ulong timedBytes;
+	double timedRuntime; // ms
+};
+
+/**
+ * The memory traffic and arithmetic of one kernel launch, as annotated by
+ * whoever enqueues it. An empty annotation leaves the launch out of the roofline.
+ */
+struct KernelWork {
+	KernelWork();
+	KernelWork(double bytesRead, double bytesWritten, double operations);
+	bool isEmpty() const;
+
+	double bytesRead;
+	double bytesWritten;
+	double operations;
+};
+
+/**
+ * The annotated launches of a kernel key placed on the roofline of the device
+ */
+struct KernelRoofline {
+	KernelRoofline();
+	double getBandwidth() const; // GB/s achieved
+	double getOperationRate() const; // GOP/s achieved
+	double getIntensity() const; // Operations per byte
+	double getAverageRuntime() const; // ms per launch
+
+	std::string name;
+	unsigned int launches;
+	double runtime; // ms
+	double bytes;
+	double operations;
+	double attainable; // GOP/s the roofline allows at this intensity, 0 without peaks
+	double efficiency; // Achieved fraction of the roofline, 0 without peaks
+	std::string bound; // "launch", "memory", "compute" or "unknown" without peaks
+};
+
+/**
+ * A stretch where a queue had nothing to run, between two commands
+ */
+struct IdleGap {
+	double start; // ms since the trace began
+	double duration; // ms
+	std::string before; // The command that finished
+	std::string after; // The command that started next
+	// The blocking call or host timer the host was in while the next command
+	// had not been enqueued yet, "host" if nothing was traced, or "device" if
+	// the command had been enqueued and the device was slow to start it
+	std::string cause;
+};
+
+/**
+ * How busy a queue, or all queues together, were over the traced commands
+ */
+struct QueueUtilization {
+	QueueUtilization();
+	double getUtilization() const; // Fraction of the span that was busy
+
+	std::string queue;
+	unsigned int commands;
+	double span; // ms from the first start to the last end
+	double busy; // ms
+	std::vector<IdleGap> gaps;
+	std::map<std::string, double> idleByCause; // ms
+};
+
+/**
+ * The blocking calls made from one call site, and how long they stalled the host
+ */
+struct StallSite {
+	StallSite();
+	double getAverage() const; // ms
+
+	std::string call; // Such as "finish" or "blocking read"
+	std::string site; // file:line
+	unsigned int calls;
+	double total; // ms
+	double max; // ms
+};
+
+/**
+ * An interned timer name, from RuntimeMeasurementsManager::timer()
+ */
+class TimerHandle {
+
+public:
+	TimerHandle() : id(0) {}
+	explicit TimerHandle(unsigned int id) : id(id) {}
+	unsigned int getId() const { return id; }
+	bool isValid() const { return id > 0; }
+
+private:
+	unsigned int id; // 0 is no timer
+};
+
+/**
+ * A timing that got slower than its baseline by more than the threshold
+ */
+struct MeasurementRegression {
+	std::string name;
+	std::string statistic; // "average" or "p99"
+	double baseline; // ms
+	double current; // ms
+	double threshold; // Allowed relative increase
+	double getIncrease() const { return current / baseline - 1.0; }
+};
+
+// Switches a context's queues to or from profiling, see addProfilingSwitch()
+typedef boost::function<void (bool)> ProfilingSwitch;
+
+/**
+ * Enabling the manager makes Context::getQueue() return profiling enabled
+ * queues, also for contexts created without profiling. The switch is made
+ * by enable() and disable(), which finish the queues that are left. Queues
+ * fetched before the switch can't be timed, and work enqueued on them after
+ * the switch is not ordered with work on the new queues.
+ */
 class RuntimeMeasurementsManager {
 
 public:
 	RuntimeMeasurementsManager();
+	~RuntimeMeasurementsManager();
 
-	void enable();
-	void disable();
+	void enable(); //can throw cl::Error
+	void disable(); //can throw cl::Error
 	bool isEnabled();
+	// Called with true before the manager is enabled and with false after it
+	// is disabled. Contexts without profiling add one to switch their queues.
+	void addProfilingSwitch(ProfilingSwitch profilingSwitch);
 
 	void startCLTimer(std::string name, cl::CommandQueue queue);
 	void stopCLTimer(std::string name, cl::CommandQueue queue);
+	void addCLEvent(std::string name, cl::Event event);
+	void resolvePendingCLTimers(bool wait = true); //can throw cl::Error
+	unsigned int getNumberOfPendingCLTimers() const;
 
 	void startRegularTimer(std::string name);
 	void stopRegularTimer(std::string name);
 
+	// Numbered timers are stored as name#1, name#2 and so on, one per start
 	void startNumberedCLTimer(std::string name, cl::CommandQueue queue);
 	void stopNumberedCLTimer(std::string name, cl::CommandQueue queue);
 
 	void startNumberedRegularTimer(std::string name);
 	void stopNumberedRegularTimer(std::string name);
+	unsigned int getNumbering(std::string name) const;
 
 	RuntimeMeasurement getTiming(std::string name);
+	// Raw samples kept per timing, see RuntimeMeasurement::getReservoir().
+	// None are kept by default.
+	void setReservoirSize(unsigned int size);
+	unsigned int getReservoirSize() const;
+
+	// Interned timers. The name is looked up once, and starting and stopping
+	// only touches data of the calling thread, so they can be used from any
+	// number of threads and in hot loops. Samples are merged when reported.
+	TimerHandle timer(std::string name);
+	void startTimer(TimerHandle timer);
+	void stopTimer(TimerHandle timer);
+	void addSample(TimerHandle timer, double runtime);
+	void mergeThreadSamples();
+
+	// Tracing records every command enqueued through Context and the
+	// HistogramPyramids, and the spans of the regular timers, while enabled
+	void enableTracing();
+	void disableTracing();
+	bool isTracing();
+	void traceCLCommand(std::string name, std::string category, cl::Event event, cl::CommandQueue queue, size_t bytes = 0);
+	void traceHostSpan(std::string name, std::string category, boost::chrono::steady_clock::time_point start, boost::chrono::steady_clock::time_point end);
+	unsigned int getNumberOfTraceEvents() const;
+	void clearTrace();
+	void exportChromeTrace(std::string filename); //can throw oul::Exception
+
+	// Stall detection records the host time spent in each blocking OpenCL call
+	// made through the library, by call site. Blocking calls are also traced
+	// as host spans while tracing.
+	void enableStallDetection();
+	void disableStallDetection();
+	bool isDetectingStalls();
+	void recordBlockingCall(std::string call, const char * file, int line, boost::chrono::steady_clock::time_point start, boost::chrono::steady_clock::time_point end);
+	std::vector<StallSite> getStallSites(); // Ordered by total stall time, longest first
+	void clearStalls();
+	void printStalls();
+
+	// Utilization of the queues over the traced commands, with the idle gaps
+	// between commands attributed to what the host was doing meanwhile
+	std::vector<QueueUtilization> getQueueUtilization(); //can throw cl::Error
+	QueueUtilization getDeviceUtilization(); //can throw cl::Error
+	void printUtilization(); //can throw cl::Error
+
+	// Kernel instrumentation times every kernel launched through Context and
+	// the HistogramPyramids, keyed by function name and global size class
+	void enableKernelInstrumentation();
+	void disableKernelInstrumentation();
+	bool isInstrumentingKernels();
+	void instrumentKernel(cl::Kernel kernel, cl::NDRange global, cl::Event event, KernelWork work = KernelWork());
+	std::vector<RuntimeMeasurement> getKernelTimings(); //can throw cl::Error
+	static std::string getKernelKey(cl::Kernel kernel, cl::NDRange global);
+
+	// For kernels on CPU devices, the hardware counters of the process's
+	// threads can be sampled from when each instrumented kernel starts running
+	// until it completes, and added to the kernel's measurement. Kernels
+	// running at the same time are counted in each other's samples.
+	// The counters are read from event callbacks when the kernel starts
+	// running, which needs an OpenCL 2.0 device and platform.
+	bool enablePerfCounters(); // Returns false, and leaves them off, if they are not permitted or supported
+	void disablePerfCounters();
+	bool isSamplingPerfCounters();
+	static bool canSamplePerfCounters(cl::Device device);
+
+	// Instrumented launches that were annotated with their work are placed on
+	// a roofline made from the peaks of the device. Kernels that take less
+	// than a couple of launch latencies are launch-bound whatever their intensity.
+	void setRooflinePeaks(double gigabytesPerSecond, double gigaOperationsPerSecond, double launchLatency = 0);
+	void setRooflinePeaks(const DeviceProbeResult &device);
+	std::vector<KernelRoofline> getRoofline(); //can throw cl::Error
+	void printRoofline(); //can throw cl::Error
+
+	// Transfers are counted per queue and per named buffer. A transfer that is
+	// given an event is timed, and flagged as slow if it is large and runs far
+	// below the peak bandwidth, which is the highest measured unless it is set.
+	void recordTransfer(TransferDirection direction, size_t bytes, cl::CommandQueue queue, std::string bufferName = "", cl::Event event = cl::Event());
+	TransferStatistics getTransferStatistics(); //can throw cl::Error
+	std::map<std::string, TransferStatistics> getTransferStatisticsPerQueue(); //can throw cl::Error
+	std::map<std::string, TransferStatistics> getTransferStatisticsPerBuffer(); //can throw cl::Error
+	void setPeakTransferBandwidth(double gigabytesPerSecond);
+	double getPeakTransferBandwidth(); //can throw cl::Error
+	void printTransfers(); //can throw cl::Error
 
 	void print(std::string name);
 	void printAll();
 
+	// Export of all timings with their statistics, and comparison to a
+	// baseline loaded from an earlier JSON export
+	void exportJSON(std::string filename); //can throw oul::Exception
+	void exportCSV(std::string filename); //can throw oul::Exception
+	void loadBaseline(std::string filename); //can throw oul::Exception
+	void setRegressionThreshold(double fraction);
+	void setRegressionThreshold(std::string name, double fraction);
+	std::vector<MeasurementRegression> findRegressions();
+	bool printRegressions(); // Returns true if there are any
+
 private:
+	/**
+	 * Counters read by event callbacks when a kernel starts running and when
+	 * it completes
+	 */
+	struct PerfCounterSample {
+		PerfCounterSample() : failed(false) {}
+		PerfCountersPtr counters;
+		boost::mutex mutex;
+		boost::condition_variable completed;
+		std::vector<double> start;
+		std::vector<double> end;
+		bool failed;
+	};
+
+	struct TransferRecord {
+		TransferDirection direction;
+		size_t bytes;
+		std::string queue;
+		std::string bufferName;
+		double runtime; // ms, negative until timed
+	};
+
+	/**
+	 * A CL timing that has been enqueued but not read yet. The runtime is from
+	 * the start of the start event to the start of the end event, or, if they
+	 * are the same command, from its start to its end.
+	 */
+	struct PendingCLTimer {
+		std::string name;
+		cl::Event start;
+		cl::Event end;
+		bool isTransfer;
+		TransferRecord transfer; // If it times a transfer
+		KernelWork work; // Of an instrumented kernel
+		boost::shared_ptr<PerfCounterSample> counters; // Of an instrumented kernel on a CPU device
+	};
+
+	struct HandleSample {
+		unsigned int timer;
+		double runtime; // ms
+	};
+
+	/**
+	 * The samples of one thread. The thread is the only producer, and the
+	 * merge, which holds the timer mutex, the only consumer.
+	 */
+	struct ThreadSamples {
+		ThreadSamples() : samples(4096) {}
+		boost::lockfree::spsc_queue<HandleSample> samples;
+		std::vector<boost::chrono::steady_clock::time_point> starts; // Per timer id, the epoch if not started
+	};
+
+	// The samples of every manager a thread has used, by manager serial
+	typedef std::map<unsigned int, boost::shared_ptr<void> > ThreadLocalSamples;
+
+	struct BaselineTiming {
+		double average;
+		double p99;
+	};
+
+	/**
+	 * A traced command, or a host span if it has no event. The host time
+	 * of a command is when it was traced, shortly after it was enqueued.
+	 */
+	struct TraceEvent {
+		std::string name;
+		std::string category;
+		cl::Event event;
+		unsigned int track; // The queue or the host thread
+		size_t bytes;
+		boost::chrono::steady_clock::time_point hostStart;
+		boost::chrono::steady_clock::time_point hostEnd;
+	};
+
+	struct DeviceTimes {
+		double queued, submit, start, end; // On the host trace clock, in us
+	};
+
+	struct HostSpan {
+		double start, end; // In us
+		unsigned int event;
+		bool operator<(const HostSpan &other) const { return start < other.start; }
+	};
+
+	static void CL_CALLBACK perfCounterCallback(cl_event event, cl_int status, void * user_data);
+	void addPerfCounterSample(cl::Event event, PendingCLTimer &timer);
+	void reportPerfCounterFailure(cl::Error &error);
+	void addCounterSamples(std::string name, PerfCounterSample &sample);
+	bool canSamplePerfCounters(cl::Event event);
+
+	void addPendingCLTimer(const PendingCLTimer &timer); //can throw cl::Error
 	cl::Event enqueueNewMarker(cl::CommandQueue queue) ;
+	ThreadSamples &getThreadSamples();
+	void mergeThreadSamples(ThreadSamples &thread);
+	void removeThreadSamples(ThreadSamples * thread);
+	static void releaseThreadSamples(ThreadLocalSamples * samples);
+	unsigned int getHostThreadTrack();
+	unsigned int getQueueTrack(cl::CommandQueue queue);
+	void addTimedTransfer(const TransferRecord &transfer);
+	void countTransfer(const TransferRecord &transfer, double peak);
+	void addTransfer(TransferStatistics &statistics, const TransferRecord &transfer, double peak) const;
+	std::map<std::string, TransferStatistics> getTransferStatistics(bool perQueue);
+	double getTraceTime(boost::chrono::steady_clock::time_point time) const; // In us
+	void getDeviceTimes(std::vector<DeviceTimes> &times, std::vector<bool> &available);
+	std::vector<HostSpan> getHostSpans() const; // Sorted by start
+	QueueUtilization getUtilization(std::string name, const std::vector<unsigned int> &commands, const std::vector<DeviceTimes> &times, const std::vector<HostSpan> &spans);
+	std::string getIdleCause(double start, double end, unsigned int next, const std::vector<HostSpan> &active) const;
+	static bool isComplete(cl::Event event);
 	void verifyThatEventExists(std::string name);
+	std::string getNumberedName(std::string name);
 	void verifyQueueProfilingIsEnabled(cl::CommandQueue queue);
 	void addSampleToRuntimeMeasurement(std::string name, double runtime);
 
-	bool enabled;
+	// The flags are read without the timer mutex, everything else below is
+	// guarded by it unless a member says otherwise
+	boost::atomic<bool> enabled;
+	std::vector<ProfilingSwitch> profilingSwitches;
+	boost::mutex switchMutex; // Guards enabled while switching and profilingSwitches
 	std::map<std::string, RuntimeMeasurementPtr> timings;
+	unsigned int reservoirSize;
 	std::map<std::string, unsigned int> numberings;
 	std::map<std::string, cl::Event> startEvents;
+	std::map<std::string, boost::chrono::steady_clock::time_point> startTimes;
+	std::list<PendingCLTimer> pendingCLTimers;
+	unsigned int pendingCLTimerInsertions;
+
+	boost::atomic<bool> tracing;
+	boost::chrono::steady_clock::time_point traceOrigin;
+	std::vector<TraceEvent> traceEvents;
+	std::map<cl_command_queue, unsigned int> queueTracks;
+	std::map<boost::thread::id, unsigned int> threadTracks;
+
+	boost::atomic<bool> instrumentingKernels;
+	std::set<std::string> kernelKeys;
+	std::map<std::string, KernelRoofline> rooflines;
+	double peakBandwidth; // GB/s
+	double peakOperationRate; // GOP/s
+	double launchLatency; // ms
+
+	boost::atomic<bool> samplingPerfCounters;
+	PerfCountersPtr perfCounters;
+	std::map<cl_command_queue, bool> perfCounterQueues; // Whether the device of the queue can be sampled
+	boost::chrono::steady_clock::time_point lastThreadScan;
+
+	boost::atomic<bool> detectingStalls;
+	boost::mutex stallMutex; // Blocking calls are made from several threads
+	std::map<std::string, StallSite> stalls; // By call and site
+
+	unsigned int serial; // Identifies the manager in the thread local storage
+	mutable boost::recursive_mutex timerMutex;
+	std::map<std::string, unsigned int> timerIds;
+	std::vector<std::string> timerNames; // Indexed by timer id
+	std::vector<boost::shared_ptr<ThreadSamples> > threadSamples; // Of the threads that are running
+	static boost::thread_specific_ptr<ThreadLocalSamples> threadLocalSamples;
+
+	std::map<std::string, BaselineTiming> baseline;
+	double regressionThreshold;
+	std::map<std::string, double> regressionThresholds;
+
+	std::deque<TransferRecord> recentTransfers; // The latest timed transfers
+	TransferStatistics transferTotal; // Of the transfers that are not recent
+	std::map<std::string, TransferStatistics> queueTransfers;
+	std::map<std::string, TransferStatistics> bufferTransfers;
+	double measuredPeakTransferBandwidth; // GB/s
+	double peakTransferBandwidth; // GB/s, 0 to use the highest measured
 };
 
 typedef boost::shared_ptr<class RuntimeMeasurementsManager> RuntimeMeasurementsManagerPtr;
 
+/**
+ * Times the scope it lives in with a regular, or numbered regular, timer
+ */
+class ScopedTimer {
+
+public:
+	ScopedTimer(RuntimeMeasurementsManagerPtr manager, std::string name, bool numbered = false);
+	ScopedTimer(RuntimeMeasurementsManagerPtr manager, TimerHandle timer);
+	~ScopedTimer();
+
+private:
+	ScopedTimer(const ScopedTimer &other);
+	ScopedTimer &operator=(const ScopedTimer &other);
+
+	RuntimeMeasurementsManagerPtr manager;
+	std::string name;
+	bool numbered;
+	TimerHandle handle;
+};
+
+/**
+ * Records the blocking call made in the scope it lives in.
+ * The manager may be empty. The library's own blocking calls use this class
+ * directly, so OUL_DISABLE_INSTRUMENTATION does not hide them from the stall
+ * report or from the idle gap attribution.
+ */
+class BlockingCall {
+
+public:
+	BlockingCall(RuntimeMeasurementsManagerPtr manager, std::string call, const char * file, int line);
+	~BlockingCall();
+
+private:
+	BlockingCall(const BlockingCall &other);
+	BlockingCall &operator=(const BlockingCall &other);
+
+	RuntimeMeasurementsManagerPtr manager;
+	std::string call;
+	const char * file;
+	int line;
+	boost::chrono::steady_clock::time_point start;
+};
+
+/**
+ * Instrumentation that is removed completely when the library is configured
+ * with OUL_DISABLE_INSTRUMENTATION, for timers left in hot code.
+ * The handle should be made once, for instance in a static variable:
+ *   static oul::TimerHandle construct = OUL_TIMER(runtime, "hp.construct");
+ *   OUL_SCOPED_TIMER(runtime, construct);
+ * A blocking call is recorded by wrapping it in a scope:
+ *   { OUL_BLOCKING_CALL(runtime, "finish"); queue.finish(); }
+ */
+#define OUL_CONCATENATE_(a, b) a##b
+#define OUL_CONCATENATE(a, b) OUL_CONCATENATE_(a, b)
+#ifdef OUL_DISABLE_INSTRUMENTATION
+#define OUL_TIMER(manager, name) oul::TimerHandle()
+#define OUL_START_TIMER(manager, handle) ((void)0)
+#define OUL_STOP_TIMER(manager, handle) ((void)0)
+#define OUL_SCOPED_TIMER(manager, handle) ((void)0)
+#define OUL_BLOCKING_CALL(manager, call) ((void)0)
+#else
+#define OUL_TIMER(manager, name) (manager)->timer(name)
+#define OUL_START_TIMER(manager, handle) (manager)->startTimer(handle)
+#define OUL_STOP_TIMER(manager, handle) (manager)->stopTimer(handle)
+#define OUL_SCOPED_TIMER(manager, handle) oul::ScopedTimer OUL_CONCATENATE(oulScopedTimer, __LINE__)(manager, handle)
+#define OUL_BLOCKING_CALL(manager, call) oul::BlockingCall OUL_CONCATENATE(oulBlockingCall, __LINE__)(manager, call, __FILE__, __LINE__)
+#endif
+
 } //namespace oul
 
 #endif /* RUNTIMEMEASUREMENTMANAGER_HPP_ */
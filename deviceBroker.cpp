@@ -0,0 +1,30 @@
+#include "OpenCLManager.hpp"
+#include "Broker.hpp"
+#include <csignal>
+#include <iostream>
+
+/*
+ * Runs a device broker on all devices that match the default criteria.
+ * Usage: deviceBroker [socket path]
+ */
+static oul::DeviceBroker * broker = NULL;
+
+void stopBroker(int) {
+    if(broker != NULL)
+        broker->stop();
+}
+
+int main(int argc, char ** argv) {
+    std::string socketPath = argc > 1 ? argv[1] : oul::getDefaultBrokerSocketPath();
+
+    oul::DeviceCriteria criteria;
+    oul::Context context = oul::opencl()->createContext(criteria);
+
+    oul::DeviceBroker deviceBroker(context, socketPath);
+    broker = &deviceBroker;
+    signal(SIGINT, stopBroker);
+    signal(SIGTERM, stopBroker);
+    deviceBroker.run();
+
+    std::cout << "Device broker served " << deviceBroker.getNumberOfPrograms() << " distinct programs" << std::endl;
+}
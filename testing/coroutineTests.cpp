@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include "TestFixture.hpp"
+#include "OpenCLManager.hpp"
+#include "Exceptions.hpp"
+
+// Built as C++20 by the CoroutineTests target, the rest of the library is not
+#if defined(__cpp_impl_coroutine)
+#include "CommandCoroutines.hpp"
+
+namespace test
+{
+
+static oul::Task finishAt(bool fail) {
+	if(fail)
+		throw oul::Exception("Coroutine failed", __LINE__, __FILE__);
+	co_return;
+}
+
+static oul::Task addAndReadBack(oul::Context &context, cl::Kernel kernel, cl::Buffer buffer, int elements, int * output) {
+	co_await context.enqueue(kernel, cl::NDRange(elements));
+	co_await context.read(buffer, sizeof(int)*elements, output);
+}
+
+TEST_CASE("Tasks finish and keep the exception of a failed coroutine", "[oul][coroutine]") {
+	oul::Task task = finishAt(false);
+	CHECK(task.isDone());
+	CHECK_NOTHROW(task.rethrowIfFailed());
+
+	oul::Task failed = finishAt(true);
+	CHECK(failed.isDone());
+	CHECK_THROWS(failed.rethrowIfFailed());
+}
+
+TEST_CASE("Coroutines awaiting Commands are resumed by the EventExecutor", "[oul][OpenCL][coroutine]") {
+	oul::Context context = oul::opencl()->createContext(oul::TestFixture::getDefaultDeviceCriteria());
+	std::string code = "__kernel void add(__global int * data, int value){int i = get_global_id(0); data[i] += value;}";
+	cl::Program program = context.getProgram(context.createProgramFromString(code));
+
+	const int elements = 1024;
+	std::vector<int> input(elements), output(elements, 0);
+	for(int i = 0; i < elements; i++)
+		input[i] = i;
+	cl::Buffer buffer = context.createBuffer(context.getContext(), CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+			sizeof(int)*elements, &input[0], "coroutine data");
+	cl::Kernel kernel(program, "add");
+	kernel.setArg(0, buffer);
+	kernel.setArg(1, (cl_int)3);
+
+	oul::Task task = addAndReadBack(context, kernel, buffer, elements, &output[0]);
+	oul::EventExecutorPtr executor = context.getExecutor();
+	while(!task.isDone() && executor->runOne());
+	REQUIRE(task.isDone());
+	CHECK_NOTHROW(task.rethrowIfFailed());
+
+	bool correct = true;
+	for(int i = 0; i < elements; i++)
+		correct = correct && output[i] == input[i]+3;
+	CHECK(correct);
+}
+
+} // end namespace
+
+#endif
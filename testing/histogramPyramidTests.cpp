@@ -163,6 +163,51 @@ TEST_CASE("3D Histogram Pyramid Buffer Sum", "[oul][histogram]") {
     }
 }
 
+struct CountCompletions {
+    CountCompletions(int * count) : count(count) {}
+    void operator()() { (*count)++; }
+    int * count;
+};
+
+TEST_CASE("3D Histogram Pyramid Buffer async Sum", "[oul][histogram]") {
+    oul::TestFixture fixture;
+    std::vector<oul::PlatformDevices> platformDevices = fixture.getAllDevices();
+    // For every platform and every device:
+    for(int i = 0; i < platformDevices.size(); i++) {
+        for(int j = 0; j < platformDevices[i].second.size(); j++) {
+            cl::Device device = platformDevices[i].second[j];
+            oul::Context context = oul::opencl()->createContext(device);
+
+            unsigned int sizeX = 64;
+            unsigned int sizeY = 64;
+            unsigned int sizeZ = 64;
+            unsigned int size = sizeX*sizeY*sizeZ;
+            unsigned int correctSumA = 0;
+            unsigned int correctSumB = 0;
+            unsigned char * dataA = createRandomData(size, &correctSumA);
+            unsigned char * dataB = createRandomData(size, &correctSumB);
+            cl::Buffer bufferA = cl::Buffer(context.getContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(char)*size, dataA);
+            cl::Buffer bufferB = cl::Buffer(context.getContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(char)*size, dataB);
+            delete[] dataA;
+            delete[] dataB;
+
+            // Two pyramids driven by one host thread through the context executor
+            int completed = 0;
+            oul::HistogramPyramid3DBuffer hpA(context);
+            oul::HistogramPyramid3DBuffer hpB(context);
+            hpA.createAsync(bufferA, sizeX, sizeY, sizeZ).then(CountCompletions(&completed));
+            hpB.createAsync(bufferB, sizeX, sizeY, sizeZ).then(CountCompletions(&completed));
+            context.getExecutor()->run();
+
+            INFO("Device: " << device.getInfo<CL_DEVICE_NAME>());
+            INFO("Platform: " << platformDevices[i].first.getInfo<CL_PLATFORM_NAME>());
+            CHECK(completed == 2);
+            CHECK(hpA.getSum() == correctSumA);
+            CHECK(hpB.getSum() == correctSumB);
+        }
+    }
+}
+
 
 TEST_CASE("2D Histogram Pyramid Sum", "[oul][histogram]") {
     oul::TestFixture fixture;
@@ -434,4 +479,44 @@ TEST_CASE("3D Histogram Pyramid Buffer create positions", "[oul][histogram]") {
         }
     }
 }
+
+TEST_CASE("3D Histogram Pyramid Buffer reuses its levels and position buffer", "[oul][histogram]") {
+    oul::TestFixture fixture;
+    std::vector<oul::PlatformDevices> platformDevices = fixture.getAllDevices();
+    // For every platform and every device:
+    for(int i = 0; i < platformDevices.size(); i++) {
+        for(int j = 0; j < platformDevices[i].second.size(); j++) {
+            cl::Device device = platformDevices[i].second[j];
+            oul::Context context = oul::opencl()->createContext(device);
+
+            unsigned int sizeX = 64;
+            unsigned int sizeY = 64;
+            unsigned int sizeZ = 64;
+            unsigned int size = sizeX*sizeY*sizeZ;
+            unsigned int correctSumA = 0;
+            unsigned int correctSumB = 0;
+            unsigned char * dataA = createRandomData(size, &correctSumA);
+            unsigned char * dataB = createRandomData(size, &correctSumB);
+            cl::Buffer bufferA = cl::Buffer(context.getContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(char)*size, dataA);
+            cl::Buffer bufferB = cl::Buffer(context.getContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(char)*size, dataB);
+            delete[] dataA;
+            delete[] dataB;
+
+            // The second construction has the same size and reuses the levels of the first
+            oul::HistogramPyramid3DBuffer hp(context);
+            hp.create(bufferA, sizeX, sizeY, sizeZ);
+            cl::Buffer positionsA = hp.createPositionBuffer();
+            hp.create(bufferB, sizeX, sizeY, sizeZ);
+            cl::Buffer positionsB = hp.createPositionBuffer(positionsA);
+
+            INFO("Device: " << device.getInfo<CL_DEVICE_NAME>());
+            INFO("Platform: " << platformDevices[i].first.getInfo<CL_PLATFORM_NAME>());
+            CHECK(hp.getSum() == correctSumB);
+            CHECK((positionsA() == positionsB()) == (correctSumA == correctSumB));
+
+            // The same sum again writes the positions into the same buffer
+            CHECK(hp.createPositionBuffer(positionsB)() == positionsB());
+        }
+    }
+}
 } // end namespace
@@ -3,6 +3,18 @@
 #include "TestFixture.hpp"
 #include "OpenCLManager.hpp"
 #include "RuntimeMeasurementManager.hpp"
+#include "Pipeline.hpp"
+#include "DeviceDispatcher.hpp"
+#include "DeviceProbe.hpp"
+#include "MultiContext.hpp"
+#include "HistogramPyramids.hpp"
+#include "HelperFunctions.hpp"
+#include "PerfCounters.hpp"
+#include <cstdio>
+#include <boost/thread.hpp>
+#if !defined(_WIN32)
+#include "Broker.hpp"
+#endif
 
 namespace test
 {
@@ -61,6 +73,127 @@ TEST_CASE("Default construction gives expected values","[oul][OpenCL]"){
     CHECK(criteria.getDeviceCountMaxCriteria() == 100);
     CHECK(criteria.getPlatformCriteria() == oul::DEVICE_PLATFORM_ANY);
     CHECK(criteria.getDevicePreference() == oul::DEVICE_PREFERENCE_NONE);
+    CHECK(criteria.getPartitioning() == oul::DEVICE_PARTITION_NONE);
+    CHECK(criteria.getDevicePreferences().empty());
+    CHECK(criteria.getMinimumOpenCLVersionCriteria() == 0);
+}
+
+TEST_CASE("Weighted preferences rank devices with explanations","[oul][OpenCL]"){
+    oul::TestFixture fixture;
+    oul::DeviceCriteria criteria;
+    criteria.addDevicePreference(oul::DEVICE_PREFERENCE_COMPUTE_UNITS, 2.0);
+    criteria.addDevicePreference(oul::DEVICE_PREFERENCE_GLOBAL_MEMORY, 1.0);
+    CHECK(criteria.getDevicePreferences().size() == 2);
+    CHECK(criteria.getDevicePreference() == oul::DEVICE_PREFERENCE_COMPUTE_UNITS);
+
+    std::vector<cl::Device> devices;
+    std::vector<oul::PlatformDevices> platformDevices = fixture.getAllDevices();
+    for(unsigned int i = 0; i < platformDevices.size(); i++)
+        devices.insert(devices.end(), platformDevices[i].second.begin(), platformDevices[i].second.end());
+    std::vector<oul::DeviceRanking> rankings = oul::opencl()->rankDevices(criteria, devices);
+
+    REQUIRE(rankings.size() == devices.size());
+    for(unsigned int i = 0; i < rankings.size(); i++) {
+        CHECK(rankings[i].score <= 3.0);
+        CHECK(rankings[i].explanation != "");
+        if(i > 0)
+            CHECK(rankings[i-1].score >= rankings[i].score);
+    }
+
+    criteria.setDevicePreference(oul::DEVICE_PREFERENCE_NONE);
+    CHECK(criteria.getDevicePreferences().empty());
+}
+
+TEST_CASE("Device inventory is persisted and loaded again","[oul][OpenCL]"){
+    oul::TestFixture fixture;
+    std::string filename = "oul_device_inventory_test_cache";
+    std::remove(filename.c_str());
+
+    oul::DeviceInventoryPtr inventory = oul::DeviceInventory::create(filename);
+    CHECK_FALSE(inventory->wasLoadedFromCache());
+    REQUIRE(inventory->getPlatforms().size() > 0);
+    oul::DeviceInventoryPtr loaded = oul::DeviceInventory::create(filename);
+    if(oul::DeviceInventory::getICDFingerprint() != "")
+        CHECK(loaded->wasLoadedFromCache());
+
+    REQUIRE(loaded->getPlatforms().size() == inventory->getPlatforms().size());
+    for(unsigned int i = 0; i < inventory->getPlatforms().size(); i++) {
+        const oul::PlatformInfo &platform = inventory->getPlatforms()[i];
+        REQUIRE(loaded->getPlatforms()[i].devices.size() == platform.devices.size());
+        for(unsigned int j = 0; j < platform.devices.size(); j++) {
+            CHECK(loaded->getPlatforms()[i].devices[j].name == platform.devices[j].name);
+            CHECK(loaded->getPlatforms()[i].devices[j].globalMemory == platform.devices[j].globalMemory);
+            CHECK(loaded->getPlatforms()[i].devices[j].device() == platform.devices[j].device());
+        }
+    }
+    std::remove(filename.c_str());
+}
+
+TEST_CASE("Pooled contexts are reused with their programs and reclaimed when idle","[oul][OpenCL][pool]"){
+    oul::TestFixture fixture;
+    oul::DeviceCriteria criteria = oul::TestFixture::getDefaultDeviceCriteria();
+    oul::opencl()->setContextPoolTimeToLive(60.0);
+    oul::Context * first;
+    {
+        oul::ContextPtr context = oul::opencl()->acquireContext(criteria);
+        context->createProgramFromStringWithName("pooled", fixture.getTestCode());
+        first = context.get();
+
+        // A leased context is not handed out again
+        oul::ContextPtr other = oul::opencl()->acquireContext(criteria);
+        CHECK(other.get() != first);
+    }
+    oul::ContextPtr context = oul::opencl()->acquireContext(criteria);
+    CHECK(context.get() == first);
+    CHECK(context->hasProgram("pooled"));
+    context.reset();
+
+    unsigned int pooled = oul::opencl()->getNumberOfPooledContexts();
+    CHECK(pooled >= 2);
+    oul::opencl()->setContextPoolTimeToLive(0.0);
+    CHECK(oul::opencl()->reclaimIdleContexts() == pooled);
+    CHECK(oul::opencl()->getNumberOfPooledContexts() == 0);
+    oul::opencl()->setContextPoolTimeToLive(60.0);
+
+    // A Context copied out of a lease keeps its context out of the pool
+    context = oul::opencl()->acquireContext(criteria);
+    oul::Context copy = *context;
+    context.reset();
+    CHECK(oul::opencl()->getNumberOfPooledContexts() == 0);
+    context = oul::opencl()->acquireContext(criteria);
+    CHECK(context->getContext()() != copy.getContext()());
+}
+
+TEST_CASE("Pooled contexts stay in the pool only if objects holding a copy are gone","[oul][OpenCL][pool]"){
+    oul::TestFixture fixture;
+    oul::DeviceCriteria criteria = oul::TestFixture::getDefaultDeviceCriteria();
+    oul::opencl()->setContextPoolTimeToLive(0.0);
+    oul::opencl()->reclaimIdleContexts();
+    oul::opencl()->setContextPoolTimeToLive(60.0);
+
+    // A HistogramPyramid destroyed before the lease ends leaves the context pooled
+    oul::ContextPtr context = oul::opencl()->acquireContext(criteria);
+    cl_context first = context->getContext()();
+    {
+        oul::HistogramPyramid3DBuffer hp(*context);
+    }
+    context.reset();
+    CHECK(oul::opencl()->getNumberOfPooledContexts() == 1);
+    context = oul::opencl()->acquireContext(criteria);
+    CHECK(context->getContext()() == first);
+
+    // One that is still alive holds a copy of the Context, which evicts it
+    oul::HistogramPyramid3DBuffer * hp = new oul::HistogramPyramid3DBuffer(*context);
+    context.reset();
+    CHECK(oul::opencl()->getNumberOfPooledContexts() == 0);
+    delete hp;
+}
+
+TEST_CASE("Devices that fail a hard minimum are not selected","[oul][OpenCL]"){
+    oul::TestFixture fixture;
+    oul::DeviceCriteria criteria;
+    criteria.setMinimumOpenCLVersionCriteria(99, 0);
+    CHECK(oul::opencl()->getDevices(criteria).empty());
 }
 
 //TODO make a better test for the devicePlatformMismatch function...
@@ -139,6 +272,877 @@ TEST_CASE("Can run profiling on simple test code", "[oul][OpenCL][profiling]"){
 	runtime->printAll();
 }
 
+TEST_CASE("Profiling can be switched on and off for a context created without it", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	CHECK((context->getQueue(0).getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) == 0);
+
+	runtime->enable();
+	cl::CommandQueue queue = context->getQueue(0);
+	CHECK((queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) != 0);
+	runtime->startCLTimer("switched", queue);
+	fixture.canRunProgramOnQueue(program, queue, "test");
+	CHECK_NOTHROW(runtime->stopCLTimer("switched", queue));
+	CHECK(runtime->getTiming("switched").getSum() >= 0);
+	CHECK(runtime->getNumberOfPendingCLTimers() == 0);
+
+	runtime->disable();
+	CHECK((context->getQueue(0).getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) == 0);
+}
+
+TEST_CASE("CL timers stay pending until the timings are asked for", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+
+	oul::Command command = context->enqueue(cl::Kernel(program, "test"), cl::NDRange(1));
+	runtime->addCLEvent("kernel", command.getEvent());
+	CHECK(runtime->getNumberOfPendingCLTimers() == 1);
+	CHECK(runtime->getTiming("kernel").getSum() >= 0);
+	CHECK(runtime->getNumberOfPendingCLTimers() == 0);
+}
+
+TEST_CASE("Completed CL timers are collected without asking for the timings", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+
+	oul::Command command = context->enqueue(cl::Kernel(program, "test"), cl::NDRange(1));
+	command.wait();
+	for(int i = 0; i < 1000; i++)
+		runtime->addCLEvent("kernel", command.getEvent());
+	CHECK(runtime->getNumberOfPendingCLTimers() < 64);
+	CHECK(runtime->getTiming("kernel").getNumberOfSamples() == 1000);
+}
+
+TEST_CASE("Runtime measurements keep streaming statistics and percentiles", "[oul][profiling]"){
+	oul::RuntimeMeasurement measurement("test", 10);
+	for(int i = 1; i <= 1000; i++)
+		measurement.addSample(i);
+
+	CHECK(measurement.getNumberOfSamples() == 1000);
+	CHECK(measurement.getAverage() == Approx(500.5));
+	CHECK(measurement.getStdDeviation() == Approx(288.8194).epsilon(0.001));
+	CHECK(measurement.getMin() == 1);
+	CHECK(measurement.getMax() == 1000);
+	CHECK(measurement.getPercentile(50) == Approx(500).epsilon(0.05));
+	CHECK(measurement.getPercentile(99) == Approx(990).epsilon(0.05));
+	CHECK(measurement.getPercentile(100) <= 1000);
+	CHECK(measurement.getReservoir().size() == 10);
+}
+
+TEST_CASE("The manager keeps a reservoir of raw samples when asked to", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	oul::TimerHandle before = runtime->timer("before");
+	runtime->addSample(before, 1.0);
+	CHECK(runtime->getTiming("before").getReservoir().empty());
+
+	runtime->setReservoirSize(10);
+	CHECK(runtime->getReservoirSize() == 10);
+	oul::TimerHandle after = runtime->timer("after");
+	for(int i = 1; i <= 100; i++) {
+		runtime->addSample(before, i);
+		runtime->addSample(after, i);
+	}
+	CHECK(runtime->getTiming("before").getReservoir().size() == 10);
+	CHECK(runtime->getTiming("after").getReservoir().size() == 10);
+}
+
+TEST_CASE("Regular and numbered timers record host time", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	{
+		oul::ScopedTimer timer(runtime, "scope");
+	}
+	CHECK(runtime->getTiming("scope").getSum() >= 0);
+
+	for(int i = 0; i < 3; i++) {
+		oul::ScopedTimer timer(runtime, "iteration", true);
+	}
+	CHECK(runtime->getNumbering("iteration") == 3);
+	CHECK_NOTHROW(runtime->getTiming("iteration#1"));
+	CHECK_NOTHROW(runtime->getTiming("iteration#3"));
+	CHECK_THROWS(runtime->stopRegularTimer("notStarted"));
+}
+
+TEST_CASE("Traced commands and timer spans are exported as a Chrome trace", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	runtime->enableTracing();
+	{
+		oul::ScopedTimer timer(runtime, "host stage");
+		context->enqueue(cl::Kernel(program, "test"), cl::NDRange(1)).wait();
+	}
+	CHECK(runtime->getNumberOfTraceEvents() == 2);
+
+	std::string filename = "oul_trace_test.json";
+	runtime->exportChromeTrace(filename);
+	std::string trace = oul::readFile(filename);
+	CHECK(trace.find("\"traceEvents\"") != std::string::npos);
+	CHECK(trace.find("\"name\":\"host stage\"") != std::string::npos);
+	CHECK(trace.find("\"name\":\"test\"") != std::string::npos);
+	std::remove(filename.c_str());
+}
+
+TEST_CASE("Kernels launched through a Context are timed automatically", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	runtime->enableKernelInstrumentation();
+	cl::Kernel kernel(program, "test");
+	for(int i = 0; i < 3; i++)
+		context->enqueue(kernel, cl::NDRange(100));
+	context->enqueue(kernel, cl::NDRange(1000)).wait();
+
+	std::vector<oul::RuntimeMeasurement> timings = runtime->getKernelTimings();
+	REQUIRE(timings.size() == 2);
+	CHECK(timings[0].getName() == "test [2^10]");
+	CHECK(timings[0].getNumberOfSamples() == 1);
+	CHECK(timings[1].getName() == "test [2^7]");
+	CHECK(timings[1].getNumberOfSamples() == 3);
+}
+
+TEST_CASE("Transfers are counted per queue and buffer with their bandwidth", "[oul][OpenCL][profiling]"){
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	const size_t bytes = 1024*1024;
+	std::vector<char> data(bytes, 1);
+	cl::Buffer buffer = context->createBuffer(context->getContext(), CL_MEM_READ_WRITE, bytes, &data[0], "input");
+	cl::Buffer copy(context->getContext(), CL_MEM_READ_WRITE, bytes);
+	context->write(buffer, bytes, &data[0], 0, "input");
+	context->copy(buffer, copy, bytes, 0, "copy");
+	context->read(copy, bytes, &data[0], 0, "copy").wait();
+
+	oul::TransferStatistics total = runtime->getTransferStatistics();
+	CHECK(total.transfers == 4);
+	CHECK(total.bytes[oul::TRANSFER_HOST_TO_DEVICE] == 2*bytes);
+	CHECK(total.bytes[oul::TRANSFER_DEVICE_TO_HOST] == bytes);
+	CHECK(total.bytes[oul::TRANSFER_DEVICE_TO_DEVICE] == bytes);
+	CHECK(total.getBandwidth() > 0);
+	CHECK(runtime->getTransferStatisticsPerBuffer()["input"].transfers == 2);
+	CHECK(runtime->getTransferStatisticsPerQueue()["Queue 0"].transfers == 3);
+	CHECK_NOTHROW(runtime->printTransfers());
+}
+
+TEST_CASE("Transfers are aggregated without keeping a record of each", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	for(int i = 0; i < 1000; i++)
+		runtime->recordTransfer(oul::TRANSFER_HOST_TO_DEVICE, 100, cl::CommandQueue(), i % 2 == 0 ? "even" : "odd");
+
+	oul::TransferStatistics total = runtime->getTransferStatistics();
+	CHECK(total.transfers == 1000);
+	CHECK(total.bytes[oul::TRANSFER_HOST_TO_DEVICE] == 100000);
+	CHECK(total.slowTransfers == 0);
+	CHECK(runtime->getTransferStatisticsPerBuffer()["odd"].transfers == 500);
+	CHECK(runtime->getTransferStatisticsPerQueue()["No queue"].bytes[oul::TRANSFER_HOST_TO_DEVICE] == 100000);
+	CHECK(runtime->getPeakTransferBandwidth() == 0);
+}
+
+struct TimeInLoop {
+	TimeInLoop(oul::RuntimeMeasurementsManagerPtr runtime, oul::TimerHandle timer) : runtime(runtime), timer(timer) {}
+	void operator()() {
+		for(int i = 0; i < 10000; i++) {
+			OUL_SCOPED_TIMER(runtime, timer);
+		}
+	}
+	oul::RuntimeMeasurementsManagerPtr runtime;
+	oul::TimerHandle timer;
+};
+
+TEST_CASE("Interned timers record samples from several threads", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	oul::TimerHandle timer = runtime->timer("loop");
+	CHECK(runtime->timer("loop").getId() == timer.getId());
+
+	boost::thread_group threads;
+	for(int i = 0; i < 4; i++)
+		threads.create_thread(TimeInLoop(runtime, timer));
+	threads.join_all();
+#ifndef OUL_DISABLE_INSTRUMENTATION
+	CHECK(runtime->getTiming("loop").getNumberOfSamples() == 40000);
+#endif
+}
+
+struct RecordInLoop {
+	RecordInLoop(oul::RuntimeMeasurementsManagerPtr runtime, std::string name) : runtime(runtime), name(name) {}
+	void operator()() {
+		for(int i = 0; i < 1000; i++) {
+			runtime->startNumberedRegularTimer(name);
+			runtime->stopNumberedRegularTimer(name);
+			runtime->recordTransfer(oul::TRANSFER_DEVICE_TO_HOST, 10, cl::CommandQueue(), name);
+		}
+	}
+	oul::RuntimeMeasurementsManagerPtr runtime;
+	std::string name;
+};
+
+TEST_CASE("Timers and transfers are recorded from several threads", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	boost::thread_group threads;
+	for(int i = 0; i < 4; i++)
+		threads.create_thread(RecordInLoop(runtime, "thread" + oul::number(i)));
+	threads.join_all();
+
+	CHECK(runtime->getTransferStatistics().transfers == 4000);
+	for(int i = 0; i < 4; i++) {
+		CHECK(runtime->getNumbering("thread" + oul::number(i)) == 1000);
+		CHECK(runtime->getTransferStatisticsPerBuffer()["thread" + oul::number(i)].transfers == 1000);
+	}
+}
+
+TEST_CASE("Interned timers that were not started can't be stopped", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	oul::TimerHandle first = runtime->timer("first");
+	oul::TimerHandle second = runtime->timer("second");
+	runtime->startTimer(second);
+	CHECK_THROWS(runtime->stopTimer(first));
+	CHECK_NOTHROW(runtime->stopTimer(second));
+	CHECK_THROWS(runtime->stopTimer(second));
+}
+
+TEST_CASE("Measurements are exported and compared to a baseline", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr before(new oul::RuntimeMeasurementsManager());
+	before->enable();
+	oul::TimerHandle build = before->timer("hp.build");
+	oul::TimerHandle traverse = before->timer("hp.traverse");
+	for(int i = 0; i < 100; i++) {
+		before->addSample(build, 10.0);
+		before->addSample(traverse, 5.0);
+	}
+	std::string filename = "oul_baseline_test.json";
+	before->exportJSON(filename);
+	CHECK_NOTHROW(before->exportCSV("oul_baseline_test.csv"));
+
+	oul::RuntimeMeasurementsManagerPtr after(new oul::RuntimeMeasurementsManager());
+	after->enable();
+	after->loadBaseline(filename);
+	after->setRegressionThreshold("hp.traverse", 0.5);
+	for(int i = 0; i < 100; i++) {
+		after->addSample(after->timer("hp.build"), 12.0);
+		after->addSample(after->timer("hp.traverse"), 7.0);
+	}
+	std::vector<oul::MeasurementRegression> regressions = after->findRegressions();
+	REQUIRE(regressions.size() == 2);
+	CHECK(regressions[0].name == "hp.build");
+	CHECK(regressions[0].statistic == "average");
+	CHECK(regressions[0].getIncrease() == Approx(0.2));
+	CHECK(regressions[1].statistic == "p99");
+	std::remove(filename.c_str());
+	std::remove("oul_baseline_test.csv");
+}
+
+TEST_CASE("Kernel resources and the launches used are reported", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	context->getRunTimeMeasurementManager()->enable();
+	cl::Kernel kernel(program, "test");
+	size_t maximum = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context->getDevice(0));
+	context->enqueue(kernel, cl::NDRange(maximum*2), cl::NDRange(maximum)).wait();
+	context->enqueue(kernel, cl::NDRange(maximum*2), cl::NDRange(maximum)).wait();
+
+	std::vector<oul::KernelResources> resources = context->getKernelResources();
+	REQUIRE(resources.size() > 0);
+	CHECK(resources[0].kernelName == "test");
+	CHECK(resources[0].workGroupSize == maximum);
+	REQUIRE(resources[0].launches.size() == 1);
+	CHECK(resources[0].launches[0].local[0] == maximum);
+	CHECK_NOTHROW(context->printKernelResources());
+}
+
+TEST_CASE("Kernel launches the device rejects are reported as misfits", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	context->getRunTimeMeasurementManager()->enable();
+	cl::Kernel kernel(program, "test");
+	size_t oversized = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(context->getDevice(0))*2;
+	CHECK_THROWS(context->enqueue(kernel, cl::NDRange(oversized), cl::NDRange(oversized)));
+
+	std::vector<oul::KernelResources> resources = context->getKernelResources();
+	REQUIRE(resources.size() > 0);
+	REQUIRE(resources[0].launches.size() == 1);
+	bool warned = false;
+	for(unsigned int i = 0; i < resources[0].warnings.size(); i++)
+		warned = warned || resources[0].warnings[i].find("exceeds the maximum") != std::string::npos;
+	CHECK(warned);
+}
+
+TEST_CASE("Kernel launches are kept per program in a few size classes", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	int first = context->createProgramFromString(fixture.getTestCode());
+	int second = context->createProgramFromString(fixture.getTestCode());
+	context->getRunTimeMeasurementManager()->enable();
+	cl::Kernel kernel(context->getProgram(first), "test");
+	// A global size that changes every frame, like a pyramid traversal
+	for(int i = 0; i < 200; i++)
+		context->enqueue(kernel, cl::NDRange(1000+i));
+	context->finish();
+
+	// The kernel of the same name in the other program was not launched
+	std::vector<oul::KernelResources> resources = context->getKernelResources();
+	unsigned int checked = 0;
+	for(unsigned int i = 0; i < resources.size(); i++) {
+		if(resources[i].device() != context->getDevice(0)())
+			continue;
+		if(resources[i].program == first) {
+			REQUIRE(resources[i].launches.size() == 2);
+			CHECK(resources[i].launches[0].global[0] == 1024);
+			CHECK(resources[i].launches[1].global[0] == 2048);
+			checked++;
+		} else if(resources[i].program == second) {
+			CHECK(resources[i].launches.size() == 0);
+			checked++;
+		}
+	}
+	CHECK(checked == 2);
+}
+
+TEST_CASE("Annotated kernels are placed on the roofline of the device", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	runtime->enableKernelInstrumentation();
+	cl::Kernel kernel(program, "test");
+	context->enqueue(kernel, cl::NDRange(1000), cl::NullRange, 0, oul::KernelWork(4000, 4000, 1000));
+	context->enqueue(kernel, cl::NDRange(1000), cl::NullRange, 0, oul::KernelWork(4000, 4000, 1000));
+	context->enqueue(kernel, cl::NDRange(100)).wait();
+
+	runtime->setRooflinePeaks(100.0, 1000.0);
+	std::vector<oul::KernelRoofline> roofline = runtime->getRoofline();
+	REQUIRE(roofline.size() == 1);
+	CHECK(roofline[0].name == "test [2^10]");
+	CHECK(roofline[0].launches == 2);
+	CHECK(roofline[0].bytes == 16000);
+	CHECK(roofline[0].getIntensity() == Approx(0.125));
+	CHECK(roofline[0].attainable == Approx(12.5));
+	CHECK(roofline[0].bound == "memory");
+
+	runtime->setRooflinePeaks(100.0, 1000.0, 1.0e3);
+	CHECK(runtime->getRoofline()[0].bound == "launch");
+	CHECK_NOTHROW(runtime->printRoofline());
+}
+
+TEST_CASE("Idle gaps between commands are attributed to the host work in between", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	runtime->enableTracing();
+	cl::Kernel kernel(program, "test");
+	context->enqueue(kernel, cl::NDRange(100));
+	context->finish();
+	{
+		oul::ScopedTimer timer(runtime, "host work");
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+	}
+	context->enqueue(kernel, cl::NDRange(100)).wait();
+
+	std::vector<oul::QueueUtilization> queues = runtime->getQueueUtilization();
+	REQUIRE(queues.size() == 1);
+	CHECK(queues[0].commands == 2);
+	REQUIRE(queues[0].gaps.size() == 1);
+	CHECK(queues[0].gaps[0].duration >= 20.0);
+	CHECK(queues[0].gaps[0].cause == "host: host work");
+	CHECK(queues[0].getUtilization() < 0.5);
+	CHECK(runtime->getDeviceUtilization().busy == Approx(queues[0].busy));
+	CHECK_NOTHROW(runtime->printUtilization());
+}
+
+TEST_CASE("Blocking calls are ranked by the time they stall the host", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	runtime->enableStallDetection();
+	for(int i = 0; i < 3; i++) {
+		OUL_BLOCKING_CALL(runtime, "finish");
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(2));
+	}
+	{
+		OUL_BLOCKING_CALL(runtime, "blocking read");
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+	}
+#ifndef OUL_DISABLE_INSTRUMENTATION
+	std::vector<oul::StallSite> sites = runtime->getStallSites();
+	REQUIRE(sites.size() == 2);
+	CHECK(sites[0].call == "blocking read");
+	CHECK(sites[0].site.find("tests.cpp:") == 0);
+	CHECK(sites[0].total >= 20.0);
+	CHECK(sites[1].call == "finish");
+	CHECK(sites[1].calls == 3);
+	CHECK_NOTHROW(runtime->printStalls());
+#endif
+}
+
+struct SetFlag {
+	SetFlag(bool * flag) : flag(flag) {}
+	void operator()() {
+		*flag = true;
+	}
+	bool * flag;
+};
+
+TEST_CASE("Waiting for commands and continuations is recorded as blocking", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	runtime->enableStallDetection();
+
+	context->enqueue(cl::Kernel(program, "test"), cl::NDRange(1)).wait();
+	bool ran = false;
+	context->enqueue(cl::Kernel(program, "test"), cl::NDRange(1)).then(SetFlag(&ran));
+	context->getExecutor()->run();
+	CHECK(ran);
+
+	std::vector<oul::StallSite> sites = runtime->getStallSites();
+	bool commandWait = false;
+	for(unsigned int i = 0; i < sites.size(); i++) {
+		CHECK(sites[i].call == "event wait");
+		commandWait = commandWait || sites[i].site.find("Command.cpp:") == 0;
+	}
+	CHECK(commandWait);
+}
+
+struct BlockInLoop {
+	BlockInLoop(oul::RuntimeMeasurementsManagerPtr runtime) : runtime(runtime) {}
+	void operator()() {
+		for(int i = 0; i < 1000; i++) {
+			oul::BlockingCall call(runtime, "finish", __FILE__, __LINE__);
+		}
+	}
+	oul::RuntimeMeasurementsManagerPtr runtime;
+};
+
+TEST_CASE("Blocking calls from several threads are traced", "[oul][profiling]"){
+	oul::RuntimeMeasurementsManagerPtr runtime(new oul::RuntimeMeasurementsManager());
+	runtime->enable();
+	runtime->enableTracing();
+	runtime->enableStallDetection();
+
+	boost::thread_group threads;
+	for(int i = 0; i < 4; i++)
+		threads.create_thread(BlockInLoop(runtime));
+	threads.join_all();
+	CHECK(runtime->getNumberOfTraceEvents() == 4000);
+	REQUIRE(runtime->getStallSites().size() == 1);
+	CHECK(runtime->getStallSites()[0].calls == 4000);
+}
+
+TEST_CASE("Hardware counters are read when permitted and are otherwise absent", "[oul][profiling]"){
+	oul::PerfCounters counters;
+	if(counters.open()) {
+		std::vector<double> before = counters.read();
+		volatile double work = 0;
+		for(int i = 0; i < 1000000; i++)
+			work += i*0.5;
+		std::vector<double> after = counters.read();
+		REQUIRE(after.size() == oul::PERF_NUMBER_OF_COUNTERS);
+		if(counters.isAvailable(oul::PERF_INSTRUCTIONS))
+			CHECK(after[oul::PERF_INSTRUCTIONS] > before[oul::PERF_INSTRUCTIONS]);
+	} else {
+		CHECK(counters.getError() != "");
+		CHECK_FALSE(counters.isOpen());
+		CHECK(counters.read()[oul::PERF_CYCLES] < 0);
+	}
+
+	oul::RuntimeMeasurement measurement("kernel");
+	measurement.addCounterSample("cycles", 100);
+	measurement.addCounterSample("cycles", 300);
+	CHECK(measurement.getCounterAverage("cycles") == Approx(200));
+	CHECK(measurement.getNumberOfCounterSamples("cycles") == 2);
+	CHECK(measurement.getCounterAverage("instructions") == 0);
+}
+
+TEST_CASE("Instrumented kernels on CPU devices get hardware counter samples", "[oul][OpenCL][profiling]"){
+	oul::TestFixture fixture;
+	if(!fixture.isCPUDeviceAvailable())
+		return;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getCPUDeviceCriteria());
+	if(!oul::RuntimeMeasurementsManager::canSamplePerfCounters(context->getDevice(0)))
+		return; // The callbacks need OpenCL 2.0
+	cl::Program program = context->getProgram(context->createProgramFromString(fixture.getTestCode()));
+	oul::RuntimeMeasurementsManagerPtr runtime = context->getRunTimeMeasurementManager();
+	runtime->enable();
+	runtime->enableKernelInstrumentation();
+	if(!runtime->enablePerfCounters())
+		return; // perf_event_open is not permitted here
+	CHECK(runtime->isSamplingPerfCounters());
+
+	cl::Kernel kernel(program, "test");
+	context->enqueue(kernel, cl::NDRange(1024)).wait();
+	std::vector<oul::RuntimeMeasurement> timings = runtime->getKernelTimings();
+	REQUIRE(timings.size() == 1);
+	std::vector<std::string> names = runtime->getTiming(timings[0].getName()).getCounterNames();
+	REQUIRE(names.size() > 0);
+	CHECK(runtime->getTiming(timings[0].getName()).getNumberOfCounterSamples(names[0]) == 1);
+}
+
+static void sleepBriefly() {
+	boost::this_thread::sleep_for(boost::chrono::milliseconds(50));
+}
+
+TEST_CASE("Hardware counters close the threads that have exited", "[oul][profiling]"){
+	oul::PerfCounters counters;
+	if(!counters.open())
+		return;
+	unsigned int threads = counters.getNumberOfThreads();
+	boost::thread worker(sleepBriefly);
+	counters.addNewThreads();
+	CHECK(counters.getNumberOfThreads() == threads+1);
+	std::vector<double> before = counters.read();
+	worker.join();
+	counters.addNewThreads();
+	CHECK(counters.getNumberOfThreads() == threads);
+	// The exited thread keeps its final count
+	std::vector<double> after = counters.read();
+	for(int i = 0; i < oul::PERF_NUMBER_OF_COUNTERS; i++) {
+		if(counters.isAvailable((oul::PerfCounter)i))
+			CHECK(after[i] >= before[i]);
+	}
+}
+
+TEST_CASE("Pipeline processes a stream of frames through all stages", "[oul][OpenCL][pipeline]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+	int programID = context->createProgramFromString("__kernel void addOne(__global int * in, __global int * out){int i = get_global_id(0); out[i] = in[i]+1;}");
+	cl::Kernel kernel(context->getProgram(programID), "addOne");
+
+	const int elements = 1024;
+	const int frames = 8;
+	std::vector<std::vector<int> > input(frames, std::vector<int>(elements));
+	std::vector<std::vector<int> > output(frames, std::vector<int>(elements, 0));
+	for(int i = 0; i < frames; i++)
+		for(int j = 0; j < elements; j++)
+			input[i][j] = i*elements + j;
+
+	oul::Pipeline pipeline(*context, 3);
+	pipeline.addStage(oul::PipelineStagePtr(new oul::UploadStage("input", sizeof(int)*elements)));
+	pipeline.addStage(oul::PipelineStagePtr(new oul::KernelStage("addOne", kernel, std::vector<std::string>(1, "input"), cl::NDRange(elements), cl::NullRange, "output", sizeof(int)*elements)));
+	pipeline.addStage(oul::PipelineStagePtr(new oul::DownloadStage("output")));
+	for(int i = 0; i < frames; i++)
+		pipeline.push(&input[i][0], &output[i][0]);
+	pipeline.finish();
+
+	CHECK(pipeline.getFramesCompleted() == frames);
+	bool correct = true;
+	for(int i = 0; i < frames; i++)
+		for(int j = 0; j < elements; j++)
+			correct = correct && output[i][j] == input[i][j]+1;
+	CHECK(correct);
+	CHECK(pipeline.getStageLatency("addOne").getSum() > 0.0);
+	CHECK(pipeline.getThroughput() > 0.0);
+	pipeline.printStatistics();
+}
+
+struct RecordPositions {
+	RecordPositions(std::vector<int> * sums, std::vector<cl_mem> * positions) : sums(sums), positions(positions) {}
+	void operator()(oul::PipelineFrame &frame) {
+		(*sums)[frame.getFrameNumber()] = frame.getValue("sum");
+		(*positions)[frame.getFrameNumber()] = frame.getBuffer("positions")();
+	}
+	std::vector<int> * sums;
+	std::vector<cl_mem> * positions;
+};
+
+TEST_CASE("Pipeline creates and traverses a histogram pyramid per frame", "[oul][OpenCL][pipeline][histogram]"){
+	oul::TestFixture fixture;
+	oul::ContextPtr context = oul::opencl()->createContextPtr(oul::TestFixture::getDefaultDeviceCriteria());
+
+	const int size = 32;
+	const int elements = size*size*size;
+	const unsigned int framesInFlight = 3;
+	const int frames = 9;
+	// Every slot of the ring gets frames with the same sum, which differs between slots
+	std::vector<std::vector<unsigned char> > input(frames, std::vector<unsigned char>(elements, 0));
+	for(int i = 0; i < frames; i++)
+		for(int j = 0; j < 100 + i % framesInFlight; j++)
+			input[i][j*7] = 1;
+
+	std::vector<int> sums(frames, 0);
+	std::vector<cl_mem> positions(frames, NULL);
+	oul::Pipeline pipeline(*context, framesInFlight);
+	pipeline.addStage(oul::PipelineStagePtr(new oul::UploadStage("volume", elements)));
+	pipeline.addStage(oul::PipelineStagePtr(new oul::HistogramPyramid3DBufferStage("volume", size, size, size)));
+	pipeline.addStage(oul::PipelineStagePtr(new oul::TraverseStage()));
+	pipeline.setFrameCompletedCallback(RecordPositions(&sums, &positions));
+	for(int i = 0; i < frames; i++)
+		pipeline.push(&input[i][0]);
+	pipeline.finish();
+
+	CHECK(pipeline.getFramesCompleted() == frames);
+	for(int i = 0; i < frames; i++) {
+		CHECK(sums[i] == 100 + i % (int)framesInFlight);
+		if(i >= (int)framesInFlight)
+			CHECK(positions[i] == positions[i - framesInFlight]);
+	}
+}
+
+TEST_CASE("Cost model prefers the faster device for large jobs despite slower transfers", "[oul]"){
+	oul::DeviceCostModel host;
+	host.setLaunchLatency(0.01);
+	host.setTransferBandwidth(1.0e8);
+	host.setThroughput(1.0e5);
+	oul::DeviceCostModel discrete;
+	discrete.setLaunchLatency(0.1);
+	discrete.setTransferBandwidth(1.0e6);
+	discrete.setThroughput(1.0e7);
+
+	oul::DispatchJob small = oul::DispatchJob::histogramPyramid3D(16, 16, 16);
+	oul::DispatchJob large = oul::DispatchJob::histogramPyramid3D(512, 512, 512);
+	CHECK(host.predict(small) < discrete.predict(small));
+	CHECK(discrete.predict(large) < host.predict(large));
+
+	// A job that takes longer than predicted lowers the throughput estimate
+	double throughput = discrete.getThroughput();
+	discrete.update(large, 10.0*discrete.predict(large));
+	CHECK(discrete.getThroughput() < throughput);
+}
+
+struct ClearBuffer {
+	ClearBuffer(size_t bytes) : bytes(bytes) {}
+	void operator()(oul::Context &context) {
+		std::vector<char> data(bytes, 0);
+		cl::Buffer buffer(context.getContext(), CL_MEM_READ_WRITE, bytes);
+		context.getQueue(0).enqueueWriteBuffer(buffer, CL_FALSE, 0, bytes, &data[0]);
+		context.getQueue(0).finish();
+	}
+	size_t bytes;
+};
+
+TEST_CASE("Dispatcher runs jobs and records predictions", "[oul][OpenCL][dispatch]"){
+	oul::TestFixture fixture;
+	oul::DeviceDispatcher dispatcher(oul::TestFixture::getDefaultDeviceCriteria());
+	oul::DispatchJob job("clear", 1024*1024, 0, 0);
+	unsigned int device = dispatcher.dispatch(job, ClearBuffer(job.bytesToDevice));
+
+	CHECK(device < dispatcher.getNumberOfDevices());
+	REQUIRE(dispatcher.getRecords().size() == 1);
+	CHECK(dispatcher.getRecords()[0].predictions.size() == dispatcher.getNumberOfDevices());
+	CHECK(dispatcher.getRecords()[0].runtime > 0.0);
+}
+
+TEST_CASE("Device probe results are cached on disk", "[oul][OpenCL][probe]"){
+	oul::TestFixture fixture;
+	std::vector<oul::PlatformDevices> platformDevices = fixture.getAllDevices();
+	REQUIRE(platformDevices.size() > 0);
+	cl::Device device = platformDevices[0].second[0];
+	std::string filename = "oul_device_probe_test_cache";
+	std::remove(filename.c_str());
+
+	oul::DeviceProbeResult result;
+	result.launchLatency = 0.5;
+	result.throughput = 1234.0;
+	{
+		oul::DeviceProbeCache cache(filename);
+		CHECK_FALSE(cache.has(device));
+		cache.put(device, result);
+	}
+	oul::DeviceProbeCache cache(filename);
+	REQUIRE(cache.has(device));
+	CHECK(cache.get(device).launchLatency == Approx(0.5));
+	CHECK(cache.get(device).throughput == Approx(1234.0));
+	std::remove(filename.c_str());
+}
+
+TEST_CASE("Measured throughput preference selects a device", "[oul][OpenCL][probe]"){
+	oul::TestFixture fixture;
+	oul::DeviceCriteria criteria = oul::TestFixture::getDefaultDeviceCriteria();
+	criteria.setDevicePreference(oul::DEVICE_PREFERENCE_MEASURED_THROUGHPUT);
+	criteria.setDeviceCountCriteria(1);
+	oul::ContextPtr context;
+	CHECK_NOTHROW(context = oul::opencl()->createContextPtr(criteria));
+	CHECK(oul::opencl()->getDeviceProbeResult(context->getDevice(0)).getScore() > 0.0);
+}
+
+TEST_CASE("A partitioned CPU context has a queue for every sub-device", "[oul][OpenCL][partition]"){
+	oul::TestFixture fixture;
+	if(!fixture.isCPUDeviceAvailable())
+		return;
+	oul::DeviceCriteria criteria = oul::TestFixture::getCPUDeviceCriteria();
+	criteria.setDeviceCountCriteria(1);
+	criteria.setPartitionEqually(1);
+	oul::Context context = oul::opencl()->createContext(criteria);
+
+	std::vector<cl::Device> devices = context.getContext().getInfo<CL_CONTEXT_DEVICES>();
+	REQUIRE(devices.size() > 0);
+	for(unsigned int i = 0; i < devices.size(); i++)
+		CHECK(context.getDevice(context.getQueue(i))() == devices[i]());
+	// Either the device was split into single compute unit sub-devices, or it was used as it is
+	if(devices.size() > 1)
+		CHECK(devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() == 1);
+	fixture.canRunProgramOnQueue(context.getProgram(context.createProgramFromString(fixture.getTestCode())), context.getQueue(devices.size()-1), "test");
+}
+
+TEST_CASE("Sub-device counts on the command line must be positive", "[oul][partition]"){
+	oul::DeviceCriteria criteria;
+	const char * equally[] = {"program", "--partition", "equally:0"};
+	CHECK_THROWS_AS(oul::opencl()->createContext(3, const_cast<char **>(equally), criteria), oul::Exception);
+	const char * negative[] = {"program", "--partition", "equally:-2"};
+	CHECK_THROWS_AS(oul::opencl()->createContext(3, const_cast<char **>(negative), criteria), oul::Exception);
+	const char * counts[] = {"program", "--partition", "counts:2,0"};
+	CHECK_THROWS_AS(oul::opencl()->createContext(3, const_cast<char **>(counts), criteria), oul::Exception);
+}
+
+#if !defined(_WIN32)
+TEST_CASE("Broker clients share programs and run kernels on broker buffers", "[oul][OpenCL][broker]"){
+	oul::TestFixture fixture;
+	std::string socketPath = "/tmp/oul-broker-test.sock";
+	oul::DeviceBroker broker(oul::opencl()->createContext(oul::TestFixture::getDefaultDeviceCriteria()), socketPath);
+	boost::thread brokerThread(boost::bind(&oul::DeviceBroker::run, &broker));
+	// A second broker must not take over the socket of a running one
+	CHECK_THROWS(oul::DeviceBroker(oul::opencl()->createContext(oul::TestFixture::getDefaultDeviceCriteria()), socketPath));
+
+	std::string code = "__kernel void add(__global int * data, int value){int i = get_global_id(0); data[i] += value;}";
+	const int elements = 1024;
+	std::vector<int> input(elements), output(elements, 0);
+	for(int i = 0; i < elements; i++)
+		input[i] = i;
+	{
+		oul::BrokerClient first(socketPath);
+		oul::BrokerClient second(socketPath);
+		int program = first.createProgramFromString(code);
+		CHECK(second.createProgramFromString(code) == program);
+
+		oul::BrokerBuffer buffer = second.createBuffer(CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(int)*elements, &input[0], "data");
+		oul::BrokerKernelArguments arguments;
+		arguments.setArg(0, buffer);
+		arguments.setArg(1, (cl_int)3);
+		second.executeKernel(program, "add", arguments, elements);
+		second.readBuffer(buffer, sizeof(int)*elements, &output[0]);
+		CHECK_THROWS(first.executeKernel(program, "doesNotExist", arguments, elements));
+		// Only the client that created a buffer may use or release it
+		CHECK_THROWS(first.executeKernel(program, "add", arguments, elements));
+		CHECK_THROWS(first.releaseBuffer(buffer));
+		CHECK_NOTHROW(second.releaseBuffer(buffer));
+	}
+	broker.stop();
+	brokerThread.join();
+
+	CHECK(broker.getNumberOfPrograms() == 1);
+	bool correct = true;
+	for(int i = 0; i < elements; i++)
+		correct = correct && output[i] == input[i]+3;
+	CHECK(correct);
+}
+#endif
+
+TEST_CASE("Copies of a Context share programs created after the copy", "[oul][OpenCL]"){
+	oul::TestFixture fixture;
+	oul::Context context = oul::opencl()->createContext(oul::TestFixture::getDefaultDeviceCriteria());
+	oul::Context copy = context;
+	copy.createProgramFromStringWithName("shared", fixture.getTestCode());
+
+	CHECK(context.hasProgram("shared"));
+	CHECK(context.getProgram("shared")() == copy.getProgram("shared")());
+	CHECK(context.getQueue(0)() == copy.getQueue(0)());
+	CHECK(context.getRunTimeMeasurementManager() == copy.getRunTimeMeasurementManager());
+}
+
+struct AddToBuffer {
+	AddToBuffer(oul::MultiContextBuffer &buffer, int elements) : buffer(buffer), elements(elements) {}
+	void operator()(oul::Context &context) {
+		std::string code = "__kernel void increment(__global int * data){int i = get_global_id(0); data[i] += 1;}";
+		if(!context.hasProgram("increment"))
+			context.createProgramFromStringWithName("increment", code);
+		cl::Kernel kernel(context.getProgram("increment"), "increment");
+		kernel.setArg(0, buffer.get(context));
+		context.getQueue(0).enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(elements), cl::NullRange);
+		context.getQueue(0).finish();
+		buffer.setModified(context);
+	}
+	oul::MultiContextBuffer &buffer;
+	int elements;
+};
+
+struct ThrowNonStandard {
+	void operator()(oul::Context &context) {
+		throw 1;
+	}
+};
+
+TEST_CASE("MultiContext runs jobs on its platforms and moves buffers between them", "[oul][OpenCL][multicontext]"){
+	oul::TestFixture fixture;
+	// Two contexts on the same platform stand in for two platforms
+	std::vector<oul::Context> contexts;
+	contexts.push_back(oul::opencl()->createContext(oul::TestFixture::getDefaultDeviceCriteria()));
+	contexts.push_back(oul::opencl()->createContext(contexts[0].getDevice(0)));
+	oul::MultiContext multiContext(contexts);
+	REQUIRE(multiContext.getNumberOfPlatforms() == 2);
+
+	// Every job has a buffer of its own, so they all run at once
+	const int elements = 1024;
+	const int jobs = 4;
+	std::vector<oul::MultiContextBufferPtr> buffers;
+	std::vector<unsigned int> platforms;
+	oul::DispatchJob job("increment", 0, 0, elements);
+	for(int i = 0; i < jobs; i++) {
+		std::vector<int> input(elements, i);
+		buffers.push_back(oul::MultiContextBufferPtr(new oul::MultiContextBuffer(multiContext, sizeof(int)*elements)));
+		buffers[i]->write(&input[0]);
+	}
+	for(int i = 0; i < jobs; i++) {
+		platforms.push_back(multiContext.submit(job, AddToBuffer(*buffers[i], elements)));
+		CHECK(platforms[i] < multiContext.getNumberOfPlatforms());
+	}
+	multiContext.finish();
+
+	bool correct = true;
+	for(int i = 0; i < jobs; i++) {
+		std::vector<int> output(elements, 0);
+		buffers[i]->read(&output[0]);
+		for(int j = 0; j < elements; j++)
+			correct = correct && output[j] == i + 1;
+		CHECK(buffers[i]->getNumberOfStagedCopies() == 1);
+	}
+	CHECK(correct);
+	unsigned int completed = 0;
+	for(unsigned int i = 0; i < multiContext.getNumberOfPlatforms(); i++)
+		completed += multiContext.getPlatformThroughput(i).jobs;
+	CHECK(completed == jobs);
+	CHECK(multiContext.getThroughput() > 0);
+
+	// Modified in one context, the data is staged into the other one
+	oul::Context other = multiContext.getContext(1 - platforms[0]);
+	AddToBuffer(*buffers[0], elements)(other);
+	CHECK(buffers[0]->getNumberOfStagedCopies() == 2);
+	std::vector<int> output(elements, 0);
+	buffers[0]->read(&output[0]);
+	correct = true;
+	for(int j = 0; j < elements; j++)
+		correct = correct && output[j] == 2;
+	CHECK(correct);
+}
+
+TEST_CASE("A MultiContext job that throws a non-standard exception fails finish", "[oul][OpenCL][multicontext]"){
+	oul::TestFixture fixture;
+	oul::MultiContext multiContext(oul::TestFixture::getDefaultDeviceCriteria());
+	multiContext.submit(oul::DispatchJob("throws", 0, 0, 1), ThrowNonStandard());
+	CHECK_THROWS_AS(multiContext.finish(), oul::Exception);
+	CHECK_NOTHROW(multiContext.finish());
+}
+
 
 
 }//namespace test